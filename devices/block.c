@@ -3,7 +3,20 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Most sectors that requests merged into one transfer may cover.
+   A request bigger than this is transferred alone. */
+#define MERGE_SECTORS 64
+
+/* Timer ticks that a read or a write may wait in the queue before
+   it is dispatched ahead of the elevator's order.  Readers are
+   usually waiting, so reads expire sooner. */
+#define READ_EXPIRE (TIMER_FREQ / 2)
+#define WRITE_EXPIRE (TIMER_FREQ * 5)
 
 /* A block device. */
 struct block
@@ -17,8 +30,28 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
+    unsigned long long cache_cnt[BLOCK_CACHE_STAT_CNT]; /* Cache events. */
+
+    /* Request queue. */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct condition queue_ready;       /* Signaled when queue nonempty. */
+    struct list queue;                  /* Requests, ordered by sector. */
+    struct list fifo;                   /* Requests, oldest first. */
+    size_t queue_depth;                 /* Number of requests queued. */
+    block_sector_t head;                /* Sector after last transfer. */
+    uint8_t *bounce;                    /* MERGE_SECTORS for merging. */
+
+    /* Statistics. */
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long read_reqs;       /* Number of read requests. */
+    unsigned long long write_reqs;      /* Number of write requests. */
+    unsigned long long queued;          /* Requests that were queued. */
+    size_t max_depth;                   /* Greatest queue depth. */
+    unsigned long long depth_sum;       /* Sum of depths at submission. */
+    unsigned long long transfers;       /* Transfers dispatched. */
+    unsigned long long merges;          /* Requests merged into others. */
+    unsigned long long expired;         /* Dispatched past deadline. */
   };
 
 /* List of all block devices. */
@@ -28,6 +61,9 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void transfer_now (struct block *, block_sector_t, void *,
+                          size_t cnt, bool write);
+static thread_func block_thread NO_RETURN;
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -120,9 +156,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, buffer, 1);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -132,11 +166,356 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
    per-block device locking is unneeded. */
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
+{
+  block_write_multiple (block, sector, buffer, 1);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK into BUFFER, which must have room for
+   CNT * BLOCK_SECTOR_SIZE bytes.  A device that can transfer
+   several sectors per command does so; any other is read a
+   sector at a time.  BUFFER may be in the current process's user
+   memory.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer, size_t cnt)
+{
+  struct block_request request;
+
+  if (cnt == 0)
+    return;
+  if (!is_kernel_vaddr (buffer))
+    {
+      transfer_now (block, sector, buffer, cnt, false);
+      return;
+    }
+  block_request_init (&request, sector, buffer, cnt, false, NULL, NULL);
+  block_submit (block, &request);
+  block_wait (&request);
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all
+   of the data.  A device that can transfer several sectors per
+   command does so; any other is written a sector at a time.
+   BUFFER may be in the current process's user memory.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer, size_t cnt)
+{
+  struct block_request request;
+
+  if (cnt == 0)
+    return;
+  if (!is_kernel_vaddr (buffer))
+    {
+      transfer_now (block, sector, (void *) buffer, cnt, true);
+      return;
+    }
+  block_request_init (&request, sector, buffer, cnt, true, NULL, NULL);
+  block_submit (block, &request);
+  block_wait (&request);
+}
+
+/* Initializes REQUEST to transfer the CNT sectors starting at
+   SECTOR between a block device and BUFFER, writing to the device
+   if WRITE is true and reading from it otherwise.  When the
+   request is done, COMPLETE is called with it if COMPLETE is
+   non-null; otherwise, block_wait() returns. */
+void
+block_request_init (struct block_request *request, block_sector_t sector,
+                    const void *buffer, size_t cnt, bool write,
+                    block_complete_func *complete, void *aux)
+{
+  ASSERT (cnt > 0);
+
+  request->sector = sector;
+  request->cnt = cnt;
+  request->buffer = (void *) buffer;
+  request->write = write;
+  request->complete = complete;
+  request->aux = aux;
+  sema_init (&request->done, 0);
+}
+
+/* Returns true if request A_ is for a lower sector than B_. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a
+    = list_entry (a_, struct block_request, sort_elem);
+  const struct block_request *b
+    = list_entry (b_, struct block_request, sort_elem);
+
+  return a->sector < b->sector;
+}
+
+/* Adds REQUEST, which must have been initialized with
+   block_request_init(), to BLOCK's queue and returns without
+   waiting for it to be done.  REQUEST's buffer must be in kernel
+   memory, since BLOCK's thread carries out the transfer. */
+void
+block_submit (struct block *block, struct block_request *request)
+{
+  check_sector (block, request->sector);
+  check_sector (block, request->sector + request->cnt - 1);
+  ASSERT (!request->write || block->type != BLOCK_FOREIGN);
+  ASSERT (is_kernel_vaddr (request->buffer));
+
+  lock_acquire (&block->queue_lock);
+  request->deadline = (timer_ticks ()
+                       + (request->write ? WRITE_EXPIRE : READ_EXPIRE));
+  list_insert_ordered (&block->queue, &request->sort_elem,
+                       request_less, NULL);
+  list_push_back (&block->fifo, &request->fifo_elem);
+  if (request->write)
+    block->write_reqs++;
+  else
+    block->read_reqs++;
+  block->queued++;
+  block->queue_depth++;
+  block->depth_sum += block->queue_depth;
+  if (block->queue_depth > block->max_depth)
+    block->max_depth = block->queue_depth;
+  cond_signal (&block->queue_ready, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Waits for REQUEST, which must have been submitted without a
+   completion function, to be done. */
+void
+block_wait (struct block_request *request)
+{
+  ASSERT (request->complete == NULL);
+  sema_down (&request->done);
+}
+
+/* Chooses the next request to dispatch from BLOCK's queue, which
+   must not be empty, and removes it from the queue, storing the
+   queue element that followed it into *NEXT.  That is the
+   oldest request if its deadline has passed.  Otherwise, it is the
+   first request at or past the sector where the last transfer
+   ended, or the lowest request if there is none, so that the disk
+   head sweeps upward and then returns to the start (C-LOOK). */
+static struct block_request *
+next_request (struct block *block, struct list_elem **next)
+{
+  struct block_request *oldest, *r;
+  struct list_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&block->queue_lock));
+  ASSERT (!list_empty (&block->queue));
+
+  oldest = list_entry (list_front (&block->fifo),
+                       struct block_request, fifo_elem);
+  if (timer_ticks () >= oldest->deadline)
+    {
+      r = oldest;
+      block->expired++;
+    }
+  else
+    {
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        if (list_entry (e, struct block_request, sort_elem)->sector
+            >= block->head)
+          break;
+      if (e == list_end (&block->queue))
+        e = list_begin (&block->queue);
+      r = list_entry (e, struct block_request, sort_elem);
+    }
+
+  *next = list_remove (&r->sort_elem);
+  list_remove (&r->fifo_elem);
+  block->queue_depth--;
+  return r;
+}
+
+/* Removes from BLOCK's queue the requests, starting at NEXT, that
+   continue FIRST, which is no longer in the queue, in the same
+   direction on adjacent sectors, up to MERGE_SECTORS in all, and
+   adds them in order to BATCH.  Returns the number of sectors that FIRST and
+   the merged requests cover. */
+static size_t
+merge_requests (struct block *block, struct block_request *first,
+                struct list_elem *next, struct list *batch)
+{
+  size_t cnt = first->cnt;
+
+  if (cnt >= MERGE_SECTORS)
+    return cnt;
+  while (next != list_end (&block->queue))
+    {
+      struct block_request *r
+        = list_entry (next, struct block_request, sort_elem);
+
+      if (r->write != first->write
+          || r->sector != first->sector + cnt
+          || cnt + r->cnt > MERGE_SECTORS)
+        break;
+      next = list_remove (&r->sort_elem);
+      list_remove (&r->fifo_elem);
+      list_push_back (batch, &r->sort_elem);
+      block->queue_depth--;
+      block->merges++;
+      cnt += r->cnt;
+    }
+  return cnt;
+}
+
+/* Has BLOCK's driver transfer the CNT sectors starting at SECTOR
+   between the device and BUFFER. */
+static void
+transfer (struct block *block, block_sector_t sector, uint8_t *buffer,
+          size_t cnt, bool write)
+{
+  size_t i;
+
+  if (write)
+    {
+      if (block->ops->write_multiple != NULL)
+        block->ops->write_multiple (block->aux, sector, buffer, cnt);
+      else
+        for (i = 0; i < cnt; i++)
+          block->ops->write (block->aux, sector + i,
+                             buffer + i * BLOCK_SECTOR_SIZE);
+    }
+  else
+    {
+      if (block->ops->read_multiple != NULL)
+        block->ops->read_multiple (block->aux, sector, buffer, cnt);
+      else
+        for (i = 0; i < cnt; i++)
+          block->ops->read (block->aux, sector + i,
+                            buffer + i * BLOCK_SECTOR_SIZE);
+    }
+
+  /* BLOCK's thread and threads with user buffers transfer at the
+     same time. */
+  lock_acquire (&block->queue_lock);
+  if (write)
+    block->write_cnt += cnt;
+  else
+    block->read_cnt += cnt;
+  lock_release (&block->queue_lock);
+}
+
+/* Transfers the CNT sectors starting at SECTOR between BLOCK and
+   BUFFER, which is in user memory, at once.  Only the current
+   thread's page directory maps BUFFER, so BLOCK's thread cannot
+   do it for us. */
+static void
+transfer_now (struct block *block, block_sector_t sector, void *buffer,
+              size_t cnt, bool write)
 {
   check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  check_sector (block, sector + cnt - 1);
+  ASSERT (!write || block->type != BLOCK_FOREIGN);
+
+  lock_acquire (&block->queue_lock);
+  if (write)
+    block->write_reqs++;
+  else
+    block->read_reqs++;
+  lock_release (&block->queue_lock);
+
+  transfer (block, sector, buffer, cnt, write);
+}
+
+/* Carries out the requests in BATCH, which are for CNT adjacent
+   sectors in all and in the same direction, as one transfer.
+   Buffers that are not adjacent in memory go through BLOCK's
+   bounce buffer. */
+static void
+transfer_batch (struct block *block, struct list *batch, size_t cnt)
+{
+  struct block_request *first
+    = list_entry (list_front (batch), struct block_request, sort_elem);
+  struct list_elem *e;
+  uint8_t *buffer = first->buffer;
+  bool bounce = false;
+  size_t ofs;
+
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct block_request *r
+        = list_entry (e, struct block_request, sort_elem);
+      if ((uint8_t *) r->buffer
+          != buffer + (r->sector - first->sector) * BLOCK_SECTOR_SIZE)
+        bounce = true;
+    }
+  if (bounce)
+    {
+      buffer = block->bounce;
+      if (first->write)
+        for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+          {
+            struct block_request *r
+              = list_entry (e, struct block_request, sort_elem);
+            ofs = (r->sector - first->sector) * BLOCK_SECTOR_SIZE;
+            memcpy (buffer + ofs, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+          }
+    }
+
+  transfer (block, first->sector, buffer, cnt, first->write);
+
+  if (bounce && !first->write)
+    for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+      {
+        struct block_request *r
+          = list_entry (e, struct block_request, sort_elem);
+        ofs = (r->sector - first->sector) * BLOCK_SECTOR_SIZE;
+        memcpy (r->buffer, buffer + ofs, r->cnt * BLOCK_SECTOR_SIZE);
+      }
+}
+
+/* Block device thread.  Carries out the requests in the queue of
+   BLOCK_, merging adjacent ones, in elevator order. */
+static void
+block_thread (void *block_)
+{
+  struct block *block = block_;
+
+  for (;;)
+    {
+      struct block_request *first;
+      struct list_elem *next;
+      struct list batch;
+      size_t cnt;
+
+      /* Take the next request and those that merge with it. */
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_ready, &block->queue_lock);
+      first = next_request (block, &next);
+      list_init (&batch);
+      list_push_back (&batch, &first->sort_elem);
+      cnt = merge_requests (block, first, next, &batch);
+      block->transfers++;
+      block->head = first->sector + cnt;
+      lock_release (&block->queue_lock);
+
+      transfer_batch (block, &batch, cnt);
+
+      /* Report each request done.  A completion function may free
+         its request, so take it off BATCH first. */
+      while (!list_empty (&batch))
+        {
+          struct block_request *r
+            = list_entry (list_pop_front (&batch),
+                          struct block_request, sort_elem);
+          if (r->complete != NULL)
+            r->complete (r);
+          else
+            sema_up (&r->done);
+        }
+    }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -171,13 +550,54 @@ block_print_stats (void)
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
+          lock_acquire (&block->queue_lock);
           printf ("%s (%s): %llu reads, %llu writes\n",
                   block->name, block_type_name (block->type),
                   block->read_cnt, block->write_cnt);
+          if (block->read_reqs != block->read_cnt
+              || block->write_reqs != block->write_cnt)
+            printf ("%s (%s): %llu read requests, %llu write requests\n",
+                    block->name, block_type_name (block->type),
+                    block->read_reqs, block->write_reqs);
+          if (block->transfers != 0)
+            {
+              /* Only queued requests had a depth.  Every transfer
+                 carries at least one of them. */
+              unsigned long long tenths
+                = block->depth_sum * 10 / block->queued;
+              printf ("%s (%s): %llu transfers, %llu requests merged, "
+                      "%llu past deadline, queue depth %llu.%llu average, "
+                      "%zu max\n",
+                      block->name, block_type_name (block->type),
+                      block->transfers, block->merges, block->expired,
+                      tenths / 10, tenths % 10, block->max_depth);
+            }
+          lock_release (&block->queue_lock);
+          if (block->cache_cnt[BLOCK_CACHE_HIT] != 0
+              || block->cache_cnt[BLOCK_CACHE_MISS] != 0)
+            printf ("%s (%s): %llu cache hits, %llu cache misses, "
+                    "%llu write-backs, %llu read-aheads, %llu direct\n",
+                    block->name, block_type_name (block->type),
+                    block->cache_cnt[BLOCK_CACHE_HIT],
+                    block->cache_cnt[BLOCK_CACHE_MISS],
+                    block->cache_cnt[BLOCK_CACHE_WRITE_BACK],
+                    block->cache_cnt[BLOCK_CACHE_READ_AHEAD],
+                    block->cache_cnt[BLOCK_CACHE_DIRECT]);
         }
     }
 }
 
+/* Counts one buffer cache event of the given TYPE against
+   BLOCK.  The buffer cache is the only caller, and it calls this
+   function with its own lock held, which serializes the
+   counts. */
+void
+block_count_cache (struct block *block, enum block_cache_stat type)
+{
+  ASSERT (type < BLOCK_CACHE_STAT_CNT);
+  block->cache_cnt[type]++;
+}
+
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
@@ -189,6 +609,7 @@ block_register (const char *name, enum block_type type,
                 const struct block_operations *ops, void *aux)
 {
   struct block *block = malloc (sizeof *block);
+  char thread_name[16];
   if (block == NULL)
     PANIC ("Failed to allocate memory for block device descriptor");
 
@@ -200,6 +621,23 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->read_reqs = 0;
+  block->write_reqs = 0;
+  memset (block->cache_cnt, 0, sizeof block->cache_cnt);
+
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_ready);
+  list_init (&block->queue);
+  list_init (&block->fifo);
+  block->queue_depth = 0;
+  block->head = 0;
+  block->bounce = malloc (MERGE_SECTORS * BLOCK_SECTOR_SIZE);
+  if (block->bounce == NULL)
+    PANIC ("Failed to allocate memory for block device bounce buffer");
+  block->max_depth = 0;
+  block->queued = 0;
+  block->depth_sum = 0;
+  block->transfers = block->merges = block->expired = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -208,6 +646,10 @@ block_register (const char *name, enum block_type type,
     printf (", %s", extra_info);
   printf ("\n");
 
+  snprintf (thread_name, sizeof thread_name, "blk-%.11s", block->name);
+  if (thread_create (thread_name, PRI_MAX, block_thread, block) == TID_ERROR)
+    PANIC ("Failed to start thread for block device %s", block->name);
+
   return block;
 }
 
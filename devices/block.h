@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,11 +55,66 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, void *, size_t cnt);
+void block_write_multiple (struct block *, block_sector_t, const void *,
+                           size_t cnt);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous block device requests.
+
+   Each block device has a queue of requests that a thread of its
+   own carries out, in the order of an elevator rather than the
+   order submitted.  Requests for adjacent sectors are merged into
+   a single transfer.  Requests that are outstanding at the same
+   time must not overlap. */
+
+struct block_request;
+
+/* Called, in the block device's thread, when REQUEST is done.
+   It may free REQUEST or submit more requests, but must not wait
+   for a request to the same device. */
+typedef void block_complete_func (struct block_request *request);
+
+struct block_request
+  {
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    void *buffer;               /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                 /* Write to device, or read from it? */
+    block_complete_func *complete;      /* Called when done, or null. */
+    void *aux;                  /* For use by COMPLETE. */
+
+    /* Owned by the block layer. */
+    struct list_elem sort_elem; /* In queue, by sector. */
+    struct list_elem fifo_elem; /* In queue, by submission. */
+    int64_t deadline;           /* Dispatch by this timer tick. */
+    struct semaphore done;      /* Up'd when done, if COMPLETE is null. */
+  };
+
+void block_request_init (struct block_request *, block_sector_t,
+                         const void *buffer, size_t cnt, bool write,
+                         block_complete_func *, void *aux);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
+
+/* Buffer cache events, counted per device by the file system's
+   sector cache so that they print alongside the device's raw
+   read and write counts. */
+enum block_cache_stat
+  {
+    BLOCK_CACHE_HIT,            /* Sector found in the cache. */
+    BLOCK_CACHE_MISS,           /* Sector not in the cache. */
+    BLOCK_CACHE_WRITE_BACK,     /* Dirty sector written to the device. */
+    BLOCK_CACHE_READ_AHEAD,     /* Sector fetched before it was needed. */
+    BLOCK_CACHE_DIRECT,         /* Sector transferred around the cache. */
+    BLOCK_CACHE_STAT_CNT
+  };
+
+void block_count_cache (struct block *, enum block_cache_stat);
 
 /* Lower-level interface to block device drivers. */
 
@@ -65,6 +122,14 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional.  Transfer CNT consecutive sectors in as few
+       commands as the device allows.  If null, the block layer
+       calls read or write once per sector instead. */
+    void (*read_multiple) (void *aux, block_sector_t, void *buffer,
+                           size_t cnt);
+    void (*write_multiple) (void *aux, block_sector_t, const void *buffer,
+                            size_t cnt);
   };
 
 struct block *block_register (const char *name, enum block_type,
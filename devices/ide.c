@@ -8,10 +8,15 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  If the
+   controller supports bus-master DMA, as described in
+   [SFF-8038i], which the PIIX family in PCs and in emulators
+   does, disks that support DMA transfer data with it. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -34,10 +39,41 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
 
+/* Bus master IDE port addresses. */
+#define bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)    /* Command. */
+#define bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)     /* Status. */
+#define bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)       /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Error (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Interrupt (write 1 to clear). */
+#define BM_STA_DMA0 0x20        /* Device 0 is DMA capable. */
+#define BM_STA_DMA1 0x40        /* Device 1 is DMA capable. */
+
+/* Physical region descriptor table.  Each descriptor is a pair
+   of 32-bit words: the physical address of a memory region, and
+   its size in bytes, with 0 meaning 64 kB.  A region may not
+   cross a 64 kB boundary.  The last descriptor has PRD_EOT set
+   in its second word. */
+#define PRD_EOT 0x80000000u
+
+/* PCI configuration space ports and the bus master IDE
+   controller's class, subclass, and programming interface bit. */
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_IDE_BUS_MASTER 0x80
+
 /* Device Register bits. */
 #define DEV_MBS 0xa0            /* Must be set. */
 #define DEV_LBA 0x40            /* Linear based addressing. */
@@ -49,6 +85,15 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors that one read or write command can transfer.  The
+   sector count register holds 0 for this many. */
+#define MAX_COMMAND_SECTORS 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +102,18 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt with READ/WRITE
+                                   MULTIPLE, or 0 if not supported. */
+    bool dma;                   /* Transfer with bus-master DMA? */
+
+    /* Statistics. */
+    unsigned long long commands;        /* Read and write commands. */
+    unsigned long long interrupts;      /* Data transfer interrupts. */
+    unsigned long long sectors;         /* Sectors transferred. */
+    unsigned long long pio_sectors;     /* Sectors copied by the CPU. */
+    unsigned long long pio_cycles;      /* CPU cycles spent copying them. */
+    unsigned long long dma_sectors;     /* Sectors moved by DMA. */
+    unsigned long long dma_cycles;      /* CPU cycles spent setting up DMA. */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +129,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base I/O port, or 0. */
+    uint32_t *prdt;             /* Physical region descriptor table. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -84,11 +144,19 @@ static struct block_operations ide_operations;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, int max);
+static uint16_t find_bus_master (void);
+
+static bool dma_transfer (struct ata_disk *, block_sector_t, const void *,
+                          size_t cnt, bool write);
+static void pio_read (struct ata_disk *, block_sector_t, void *, size_t cnt);
+static void pio_write (struct ata_disk *, block_sector_t, const void *,
+                       size_t cnt);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sectors (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
-static void input_sector (struct channel *, void *);
-static void output_sector (struct channel *, const void *);
+static void input_sectors (struct channel *, void *, size_t cnt);
+static void output_sectors (struct channel *, const void *, size_t cnt);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -97,10 +165,20 @@ static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
+/* Returns the CPU's time-stamp counter, which counts cycles. */
+static inline uint64_t
+read_tsc (void)
+{
+  uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t) hi << 32) | lo;
+}
+
 /* Initialize the disk subsystem and detect disks. */
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +204,12 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+
+      /* Each channel has 8 bus master ports, primary first.  A
+         page-aligned PRD table never crosses a 64 kB boundary,
+         as the controller requires. */
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+      c->prdt = bm_base != 0 ? palloc_get_page (PAL_ASSERT) : NULL;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +220,11 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
+          d->commands = d->interrupts = d->sectors = 0;
+          d->pio_sectors = d->pio_cycles = 0;
+          d->dma_sectors = d->dma_cycles = 0;
         }
 
       /* Register interrupt handler. */
@@ -265,6 +354,7 @@ identify_ata_device (struct ata_disk *d)
   char *model, *serial;
   char extra_info[128];
   struct block *block;
+  uint64_t start;
 
   ASSERT (d->is_ata);
 
@@ -279,7 +369,12 @@ identify_ata_device (struct ata_disk *d)
       d->is_ata = false;
       return;
     }
-  input_sector (c, id);
+  /* Timing the copy measures what PIO costs even on disks that
+     go on to use DMA. */
+  start = read_tsc ();
+  input_sectors (c, id, 1);
+  d->pio_cycles += read_tsc () - start;
+  d->pio_sectors++;
 
   /* Calculate capacity.
      Read model name and serial number. */
@@ -303,12 +398,117 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Transfer as many sectors per interrupt as the disk allows,
+     which it reports in the low byte of word 47. */
+  set_multiple_mode (d, *(uint16_t *) &id[47 * 2] & 0xff);
+
+  /* Use DMA if the controller and the disk, per bit 8 of word 49,
+     both support it.  The DMA capable bit in the bus master status
+     register tells the controller the same. */
+  if (c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100))
+    {
+      d->dma = true;
+      outb (bm_status (c), (inb (bm_status (c)) & ~(BM_STA_ERR | BM_STA_INTR))
+                           | (d->dev_no == 0 ? BM_STA_DMA0 : BM_STA_DMA1));
+    }
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
 }
 
+/* Sends a SET MULTIPLE MODE command to disk D to make READ
+   MULTIPLE and WRITE MULTIPLE transfer the largest power of 2
+   sectors, up to MAX, per interrupt.  If MAX is 0 or the disk
+   refuses, D is left transferring one sector per interrupt. */
+static void
+set_multiple_mode (struct ata_disk *d, int max)
+{
+  struct channel *c = d->channel;
+  int cnt;
+
+  d->multiple = 0;
+  if (max <= 1)
+    return;
+  for (cnt = 1; cnt * 2 <= max; cnt *= 2)
+    continue;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if (inb (reg_alt_status (c)) & STA_ERR)
+    printf ("%s: SET MULTIPLE MODE %d failed\n", d->name, cnt);
+  else
+    d->multiple = cnt;
+}
+
+/* Reads the 32-bit register at offset REG in the PCI
+   configuration space of function FUNC of device DEV on BUS. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDR,
+        0x80000000u | (bus << 16) | (dev << 11) | (func << 8) | reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit register at offset REG in the PCI
+   configuration space of function FUNC of device DEV on BUS. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDR,
+        0x80000000u | (bus << 16) | (dev << 11) | (func << 8) | reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that supports bus
+   master DMA and drives the legacy channels at their usual
+   ports, such as the PIIX.  If there is one, enables it to
+   master the bus and returns its bus master base port.
+   Otherwise, returns 0, and disks are transferred with PIO. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar4, command;
+
+        if ((pci_read_config (0, dev, func, 0x00) & 0xffff) == 0xffff)
+          continue;
+
+        /* Class code, subclass, and programming interface.  The
+           interface's low bits must be clear for the channels to
+           be at 0x1f0 and 0x170. */
+        class = pci_read_config (0, dev, func, 0x08) >> 8;
+        if ((class >> 16) != PCI_CLASS_STORAGE
+            || ((class >> 8) & 0xff) != PCI_SUBCLASS_IDE
+            || !(class & PCI_IDE_BUS_MASTER)
+            || (class & 0x05) != 0)
+          continue;
+
+        /* The bus master ports are in I/O space, at BAR 4. */
+        bar4 = pci_read_config (0, dev, func, 0x20);
+        if (!(bar4 & 1) || (bar4 & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space access and bus mastering. */
+        command = pci_read_config (0, dev, func, 0x04) & 0xffff;
+        pci_write_config (0, dev, func, 0x04, command | 0x05);
+
+        printf ("ide: bus master DMA at port %#x\n",
+                (unsigned) (bar4 & 0xfffc));
+        return bar4 & 0xfffc;
+      }
+  return 0;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +537,301 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE bytes,
+   with as few commands and interrupts as D allows.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, void *buffer_, size_t cnt)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+      if (!dma_transfer (d, sec_no, buffer, n, false))
+        pio_read (d, sec_no, buffer, n);
+      d->commands++;
+      d->sectors += n;
+
+      sec_no += n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes, with
+   as few commands and interrupts as D allows.  Returns after the
+   disk has acknowledged receiving the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, const void *buffer_,
+                    size_t cnt)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+      if (!dma_transfer (d, sec_no, buffer, n, true))
+        pio_write (d, sec_no, buffer, n);
+      d->commands++;
+      d->sectors += n;
+
+      sec_no += n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO from disk D into BUFFER, with the CPU copying the data.
+   D's channel lock must be held. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, void *buffer_, size_t cnt)
+{
+  struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+  size_t per_intr = d->multiple > 0 ? d->multiple : 1;
+  size_t done, block;
+
+  /* The disk interrupts as each block of PER_INTR sectors, or
+     the last, shorter block, is ready to be read. */
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0
+                         ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY));
+  for (done = 0; done < cnt; done += block)
+    {
+      uint64_t start;
+
+      block = cnt - done < per_intr ? cnt - done : per_intr;
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      start = read_tsc ();
+      input_sectors (c, buffer + done * BLOCK_SECTOR_SIZE, block);
+      d->pio_cycles += read_tsc () - start;
+      d->interrupts++;
+    }
+  d->pio_sectors += cnt;
+}
+
+/* Writes CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO to disk D from BUFFER, with the CPU copying the data.
+   D's channel lock must be held. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, const void *buffer_,
+           size_t cnt)
+{
+  struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+  size_t per_intr = d->multiple > 0 ? d->multiple : 1;
+  size_t done, block;
+
+  /* The disk asks for each block of PER_INTR sectors, or the
+     last, shorter block, by setting DRQ, and interrupts once it
+     has taken each one. */
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0
+                         ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY));
+  for (done = 0; done < cnt; done += block)
+    {
+      uint64_t start;
+
+      block = cnt - done < per_intr ? cnt - done : per_intr;
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      start = read_tsc ();
+      output_sectors (c, buffer + done * BLOCK_SECTOR_SIZE, block);
+      d->pio_cycles += read_tsc () - start;
+      sema_down (&c->completion_wait);
+      d->interrupts++;
+    }
+  d->pio_sectors += cnt;
+}
+
+/* Transfers CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO between disk D and BUFFER with bus-master DMA, reading
+   from the disk if WRITE is false and writing to it otherwise.
+   Returns true if successful.  Returns false, without having
+   transferred anything that PIO cannot simply redo, if D does not
+   use DMA, if BUFFER is not in kernel memory or not aligned as
+   DMA requires, or if the transfer fails, in which case D goes
+   back to PIO for good.  D's channel lock must be held. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, const void *buffer,
+              size_t cnt, bool write)
+{
+  struct channel *c = d->channel;
+  const uint8_t *p = buffer;
+  size_t size = cnt * BLOCK_SECTOR_SIZE;
+  size_t prd_cnt = 0;
+  uint8_t direction = write ? 0 : BM_CMD_READ;
+  uint8_t status;
+  uint64_t start;
+  bool ok;
+
+  if (!d->dma || !is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1))
+    return false;
+  start = read_tsc ();
+
+  /* Kernel virtual memory maps physical memory contiguously, so
+     the buffer only has to be split at 64 kB boundaries. */
+  while (size > 0)
+    {
+      uintptr_t phys = vtop (p);
+      size_t len = 0x10000 - (phys & 0xffff);
+
+      if (len > size)
+        len = size;
+      c->prdt[prd_cnt * 2] = phys;
+      c->prdt[prd_cnt * 2 + 1] = len & 0xffff;
+      prd_cnt++;
+      p += len;
+      size -= len;
+    }
+  c->prdt[prd_cnt * 2 - 1] |= PRD_EOT;
+
+  /* Program the controller, then the disk, then start. */
+  outl (bm_prdt (c), vtop (c->prdt));
+  outb (bm_command (c), direction);
+  outb (bm_status (c), inb (bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (bm_command (c), direction | BM_CMD_START);
+  d->dma_cycles += read_tsc () - start;
+
+  /* The disk interrupts once, when the whole transfer is done. */
+  sema_down (&c->completion_wait);
+
+  start = read_tsc ();
+  outb (bm_command (c), direction);
+  status = inb (bm_status (c));
+  outb (bm_status (c), status | BM_STA_ERR | BM_STA_INTR);
+  ok = (!(status & BM_STA_ERR)
+        && !wait_while_busy (d)
+        && !(inb (reg_alt_status (c)) & STA_ERR));
+  d->dma_cycles += read_tsc () - start;
+  d->interrupts++;
+
+  if (!ok)
+    {
+      /* The caller counts only the PIO command that redoes this
+         one, so count the failed command here. */
+      printf ("%s: DMA %s failed, sector=%"PRDSNu", using PIO\n",
+              d->name, write ? "write" : "read", sec_no);
+      d->commands++;
+      d->dma = false;
+      return false;
+    }
+  d->dma_sectors += cnt;
+  return true;
+}
+
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d, sec_no, buffer, 1);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d, sec_no, buffer, 1);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple
   };
-
+
+/* Returns the CPU cycles spent per megabyte when CYCLES were
+   spent on SECTORS sectors. */
+static unsigned long long
+cycles_per_mb (unsigned long long cycles, unsigned long long sectors)
+{
+  if (sectors == 0)
+    return 0;
+  return cycles * (1024 * 1024 / BLOCK_SECTOR_SIZE) / sectors;
+}
+
+/* Prints statistics for each disk that has transferred data,
+   including the CPU time that moving data took with PIO and with
+   DMA.  The difference is what DMA saves. */
+void
+ide_print_stats (void)
+{
+  size_t chan_no;
+  int dev_no;
+
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    for (dev_no = 0; dev_no < 2; dev_no++)
+      {
+        struct ata_disk *d = &channels[chan_no].devices[dev_no];
+        unsigned long long tenths, pio_mb, dma_mb;
+
+        if (d->interrupts == 0)
+          continue;
+        tenths = d->sectors * 10 / d->interrupts;
+        printf ("%s: %llu sectors in %llu commands, %llu interrupts "
+                "(%llu.%llu sectors per interrupt, multiple mode %d)\n",
+                d->name, d->sectors, d->commands, d->interrupts,
+                tenths / 10, tenths % 10, d->multiple);
+
+        pio_mb = cycles_per_mb (d->pio_cycles, d->pio_sectors);
+        dma_mb = cycles_per_mb (d->dma_cycles, d->dma_sectors);
+        printf ("%s: PIO %llu sectors at %llu kcycles/MB, "
+                "DMA %llu sectors at %llu kcycles/MB",
+                d->name, d->pio_sectors, pio_mb / 1000,
+                d->dma_sectors, dma_mb / 1000);
+        if (d->dma_sectors > 0 && pio_mb > dma_mb)
+          printf (", DMA saved %llu kcycles of CPU time per MB",
+                  (pio_mb - dma_mb) / 1000);
+        printf ("\n");
+      }
+}
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, which must be between 1 and
+   MAX_COMMAND_SECTORS, to the disk's sector selection registers.
+   (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sectors (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MAX_COMMAND_SECTORS);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_COMMAND_SECTORS ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -414,22 +852,24 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
-/* Reads a sector from channel C's data register in PIO mode into
-   SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
+/* Reads CNT sectors from channel C's data register in PIO mode
+   into SECTORS, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
 static void
-input_sector (struct channel *c, void *sector) 
+input_sectors (struct channel *c, void *sectors, size_t cnt)
 {
-  insw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  insw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
-/* Writes SECTOR to channel C's data register in PIO mode.
-   SECTOR must contain BLOCK_SECTOR_SIZE bytes. */
+/* Writes CNT sectors from SECTORS to channel C's data register in
+   PIO mode.  SECTORS must contain CNT * BLOCK_SECTOR_SIZE
+   bytes. */
 static void
-output_sector (struct channel *c, const void *sector) 
+output_sectors (struct channel *c, const void *sectors, size_t cnt)
 {
-  outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  outsw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
-
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
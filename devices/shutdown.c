@@ -11,6 +11,7 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "devices/ide.h"
 #include "filesys/filesys.h"
 #endif
 
@@ -133,7 +134,9 @@ print_stats (void)
   timer_print_stats ();
   thread_print_stats ();
 #ifdef FILESYS
+  ide_print_stats ();
   block_print_stats ();
+  filesys_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
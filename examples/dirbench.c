@@ -0,0 +1,62 @@
+/* dirbench.c
+
+   Creates, looks up and deletes many files in one directory, to
+   measure the cost of directory operations.  The disk statistics
+   that Pintos prints at shutdown show how many sectors each run
+   read and wrote.
+
+   Usage: dirbench [COUNT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+int
+main (int argc, char *argv[])
+{
+  int cnt = argc > 1 ? atoi (argv[1]) : 10000;
+  char name[16];
+  int i;
+
+  /* Create. */
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "f%d", i);
+      if (!create (name, 0))
+        {
+          printf ("%s: create failed\n", name);
+          return EXIT_FAILURE;
+        }
+    }
+  printf ("created %d files\n", cnt);
+
+  /* Look up, in an order unrelated to creation order. */
+  for (i = 0; i < cnt; i++)
+    {
+      int fd;
+
+      snprintf (name, sizeof name, "f%d", (i * 7919) % cnt);
+      fd = open (name);
+      if (fd < 0)
+        {
+          printf ("%s: open failed\n", name);
+          return EXIT_FAILURE;
+        }
+      close (fd);
+    }
+  printf ("looked up %d files\n", cnt);
+
+  /* Delete. */
+  for (i = 0; i < cnt; i++)
+    {
+      snprintf (name, sizeof name, "f%d", i);
+      if (!remove (name))
+        {
+          printf ("%s: remove failed\n", name);
+          return EXIT_FAILURE;
+        }
+    }
+  printf ("deleted %d files\n", cnt);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+/* ls.c
+
+   Lists the contents of the directories named on the command
+   line, or of the current directory if there are none, with
+   each entry's inode number, type and size.  Reads entries a
+   batch at a time with getdents(), so that listing even a
+   large directory takes only a few system calls.
+
+   Usage: ls [DIR]... */
+
+#include <stdio.h>
+#include <syscall.h>
+
+/* Number of entries to read per getdents() call. */
+#define BATCH 128
+
+static struct dirent entries[BATCH];
+
+static bool
+list_dir (const char *dir)
+{
+  int fd, cnt, i;
+
+  fd = open (dir);
+  if (fd < 0)
+    {
+      printf ("%s: not found\n", dir);
+      return false;
+    }
+  if (!isdir (fd))
+    {
+      printf ("%s: not a directory\n", dir);
+      close (fd);
+      return false;
+    }
+
+  printf ("%s:\n", dir);
+  while ((cnt = getdents (fd, entries, BATCH)) > 0)
+    for (i = 0; i < cnt; i++)
+      printf ("%8d %c %10d %s\n", entries[i].inumber,
+              entries[i].type == DT_DIR ? 'd' : '-',
+              entries[i].size, entries[i].name);
+  close (fd);
+  return true;
+}
+
+int
+main (int argc, char *argv[])
+{
+  bool success = true;
+  int i;
+
+  if (argc < 2)
+    success = list_dir (".");
+  for (i = 1; i < argc; i++)
+    if (!list_dir (argv[i]))
+      success = false;
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,578 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <list.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Number of sectors held in the buffer cache. */
+#define CACHE_CNT 64
+
+/* Sector number of a cache entry that holds no sector. */
+#define INVALID_SECTOR ((block_sector_t) -1)
+
+/* Maximum number of sectors waiting to be read ahead.  Requests
+   beyond this are dropped. */
+#define READ_AHEAD_CNT 32
+
+/* A cached file system sector. */
+struct cache_entry
+  {
+    struct lock lock;                   /* Protects DIRTY and DATA. */
+    block_sector_t sector;              /* Sector held, or INVALID_SECTOR. */
+    bool accessed;                      /* Used since last clock sweep? */
+    bool dirty;                         /* Modified since written back? */
+    int64_t dirtied;                    /* Timer tick when made dirty. */
+    bool journaled;                     /* Contents held by the journal? */
+    bool revoked;                       /* Journal revocation of SECTOR
+                                           not yet on disk? */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+/* The cache proper. */
+static struct cache_entry cache[CACHE_CNT];
+
+/* Protects the SECTOR and ACCESSED members of every entry and
+   the clock hand.  Never held while waiting for the disk. */
+static struct lock cache_lock;
+
+/* Next entry to be examined by the clock algorithm. */
+static size_t clock_hand;
+
+/* A run of sectors being transferred directly between the disk
+   and a caller's buffer.  None of them may be brought into the
+   cache until the transfer is done. */
+struct direct_io
+  {
+    struct list_elem elem;              /* Element in direct_ios. */
+    block_sector_t start;               /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+  };
+
+/* Direct transfers in progress.  Protected by cache_lock. */
+static struct list direct_ios;
+static struct condition direct_done;    /* Signaled when one ends. */
+
+/* Sectors waiting to be read ahead, in a circular queue. */
+static block_sector_t read_ahead_queue[READ_AHEAD_CNT];
+static size_t read_ahead_head;          /* Next sector to fetch. */
+static size_t read_ahead_cnt;           /* Number of queued sectors. */
+static struct lock read_ahead_lock;     /* Protects the queue. */
+static struct semaphore read_ahead_sema; /* Up'd once per queued sector. */
+
+static struct cache_entry *cache_get (block_sector_t, bool load, bool ahead);
+static struct cache_entry *lookup (block_sector_t);
+static struct cache_entry *choose_victim (void);
+static void write_back (struct cache_entry *);
+static void write_back_range (block_sector_t start, size_t cnt,
+                              int64_t cutoff);
+static void mark_dirty (struct cache_entry *);
+static void transfer_direct (block_sector_t, uint8_t *, size_t cnt,
+                             bool write);
+static bool direct_io_busy (block_sector_t);
+static thread_func read_ahead NO_RETURN;
+
+/* Initializes the buffer cache and starts the thread that reads
+   sectors ahead of their use. */
+void
+cache_init (void)
+{
+  struct cache_entry *e;
+
+  lock_init (&cache_lock);
+  for (e = cache; e < cache + CACHE_CNT; e++)
+    {
+      lock_init (&e->lock);
+      e->sector = INVALID_SECTOR;
+      e->accessed = false;
+      e->dirty = false;
+      e->journaled = false;
+      e->revoked = false;
+    }
+  clock_hand = 0;
+  list_init (&direct_ios);
+  cond_init (&direct_done);
+
+  lock_init (&read_ahead_lock);
+  sema_init (&read_ahead_sema, 0);
+  read_ahead_head = read_ahead_cnt = 0;
+
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead, NULL);
+}
+
+/* Reads SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within SECTOR
+   into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, true, false);
+  memcpy (buffer, e->data + ofs, size);
+  lock_release (&e->lock);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into SECTOR.
+   The data reaches the disk when the sector is evicted or
+   written back. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR, starting at byte
+   offset OFS within the sector. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  /* A write that covers the whole sector need not read it. */
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE, false);
+  if (e->journaled)
+    {
+      /* The sector held metadata before.  It is file data now. */
+      if (journal_forget (sector))
+        e->revoked = true;
+      e->journaled = false;
+    }
+  memcpy (e->data + ofs, buffer, size);
+  mark_dirty (e);
+  lock_release (&e->lock);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes of file system metadata from
+   BUFFER into SECTOR, through the journal. */
+void
+cache_write_meta (block_sector_t sector, const void *buffer)
+{
+  cache_write_meta_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes of file system metadata from BUFFER into
+   SECTOR, starting at byte offset OFS within the sector.  The
+   new contents of the sector go to the journal, which writes
+   them to disk, so the cache entry stays clean. */
+void
+cache_write_meta_at (block_sector_t sector, const void *buffer,
+                     size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE, false);
+  memcpy (e->data + ofs, buffer, size);
+  if (journal_write (sector, e->data))
+    {
+      e->journaled = true;
+      e->dirty = false;
+    }
+  else
+    mark_dirty (e);
+  lock_release (&e->lock);
+}
+
+/* Asks for SECTOR to be brought into the cache in the
+   background, in anticipation of a read.  Returns without
+   waiting for the disk.  The request is silently dropped if too
+   many sectors are already waiting. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&read_ahead_lock);
+  if (read_ahead_cnt < READ_AHEAD_CNT)
+    {
+      size_t tail = (read_ahead_head + read_ahead_cnt) % READ_AHEAD_CNT;
+      read_ahead_queue[tail] = sector;
+      read_ahead_cnt++;
+      sema_up (&read_ahead_sema);
+    }
+  lock_release (&read_ahead_lock);
+}
+
+/* Reads the CNT consecutive sectors starting at START into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Sectors that are not cached are read straight from
+   disk into BUFFER, without passing through the cache or
+   displacing anything in it. */
+void
+cache_read_direct (block_sector_t start, void *buffer, size_t cnt)
+{
+  transfer_direct (start, buffer, cnt, false);
+}
+
+/* Writes CNT * BLOCK_SECTOR_SIZE bytes from BUFFER into the CNT
+   consecutive sectors starting at START.  Sectors that are not
+   cached are written straight from BUFFER to disk, at once. */
+void
+cache_write_direct (block_sector_t start, const void *buffer, size_t cnt)
+{
+  transfer_direct (start, (uint8_t *) buffer, cnt, true);
+}
+
+/* Writes every dirty sector in the cache back to disk. */
+void
+cache_flush (void)
+{
+  write_back_range (0, SIZE_MAX, INT64_MAX);
+}
+
+/* Writes back every sector that has been dirty since timer tick
+   CUTOFF or earlier. */
+void
+cache_writeback (int64_t cutoff)
+{
+  write_back_range (0, SIZE_MAX, cutoff);
+}
+
+/* Writes back the dirty sectors among the CNT sectors starting
+   at START. */
+void
+cache_sync (block_sector_t start, size_t cnt)
+{
+  write_back_range (start, cnt, INT64_MAX);
+}
+
+/* Returns the entry that holds SECTOR, locked by the current
+   thread.  If SECTOR is not cached, evicts another sector to
+   make room for it and, if LOAD is true, reads SECTOR from
+   disk.  The access counts as a cache hit or miss, unless AHEAD
+   is true, in which case it is a read-ahead and a sector that
+   must be read counts as one instead. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load, bool ahead)
+{
+  ASSERT (sector != INVALID_SECTOR);
+
+  for (;;)
+    {
+      struct cache_entry *e;
+
+      /* Look for SECTOR in the cache. */
+      lock_acquire (&cache_lock);
+      e = lookup (sector);
+      if (e != NULL)
+        {
+          e->accessed = true;
+          lock_release (&cache_lock);
+
+          /* The entry may be evicted while we wait for it. */
+          lock_acquire (&e->lock);
+          if (e->sector == sector)
+            {
+              if (!ahead)
+                {
+                  lock_acquire (&cache_lock);
+                  block_count_cache (fs_device, BLOCK_CACHE_HIT);
+                  lock_release (&cache_lock);
+                }
+              return e;
+            }
+          lock_release (&e->lock);
+          continue;
+        }
+
+      /* Not cached.  Pick an entry to evict.  If every entry is
+         in use, let their holders finish and try again. */
+      e = choose_victim ();
+      lock_release (&cache_lock);
+      if (e == NULL)
+        {
+          thread_yield ();
+          continue;
+        }
+
+      /* Write back the victim's old contents while it is still
+         visible under its old sector number, so that anyone who
+         wants that sector waits for us instead of reading stale
+         data from disk. */
+      if (e->dirty)
+        write_back (e);
+
+      /* Another thread may have brought SECTOR in meanwhile, or
+         be transferring it directly. */
+      lock_acquire (&cache_lock);
+      if (lookup (sector) != NULL || direct_io_busy (sector))
+        {
+          lock_release (&e->lock);
+          while (direct_io_busy (sector))
+            cond_wait (&direct_done, &cache_lock);
+          lock_release (&cache_lock);
+          continue;
+        }
+      e->sector = sector;
+      e->accessed = true;
+      block_count_cache (fs_device, (ahead ? BLOCK_CACHE_READ_AHEAD
+                                     : BLOCK_CACHE_MISS));
+      lock_release (&cache_lock);
+
+      /* The journal may hold a newer version than the disk. */
+      e->journaled = journal_read (sector, e->data);
+      if (load && !e->journaled)
+        block_read (fs_device, sector, e->data);
+      return e;
+    }
+}
+
+/* Returns the entry holding SECTOR, or a null pointer if SECTOR
+   is not cached.  The cache lock must be held. */
+static struct cache_entry *
+lookup (block_sector_t sector)
+{
+  struct cache_entry *e;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  for (e = cache; e < cache + CACHE_CNT; e++)
+    if (e->sector == sector)
+      return e;
+  return NULL;
+}
+
+/* Advances the clock hand to an entry that has not been used
+   since the hand last passed it and that no other thread is
+   using, and returns it locked.  Returns a null pointer if every
+   entry is in use.  The cache lock must be held. */
+static struct cache_entry *
+choose_victim (void)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  for (i = 0; i < 2 * CACHE_CNT; i++)
+    {
+      struct cache_entry *e = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_CNT;
+
+      if (e->accessed)
+        e->accessed = false;
+      else if (lock_try_acquire (&e->lock))
+        return e;
+    }
+  return NULL;
+}
+
+/* Does the work of cache_read_direct() and, if WRITE is true,
+   of cache_write_direct(). */
+static void
+transfer_direct (block_sector_t start, uint8_t *buffer, size_t cnt,
+                 bool write)
+{
+  while (cnt > 0)
+    {
+      struct direct_io io;
+      size_t i;
+
+      /* A cached sector must go through the cache, which may
+         hold a newer version than the disk. */
+      lock_acquire (&cache_lock);
+      if (lookup (start) != NULL)
+        {
+          lock_release (&cache_lock);
+          if (write)
+            cache_write (start, buffer);
+          else
+            cache_read (start, buffer);
+          start++;
+          buffer += BLOCK_SECTOR_SIZE;
+          cnt--;
+          continue;
+        }
+
+      /* Claim the run of uncached sectors that follows. */
+      io.start = start;
+      for (io.cnt = 1; io.cnt < cnt && lookup (start + io.cnt) == NULL;
+           io.cnt++)
+        continue;
+      list_push_back (&direct_ios, &io.elem);
+      lock_release (&cache_lock);
+
+      /* Move the whole run with one request, so that the disk
+         can transfer it with as few commands as it allows. */
+      if (write)
+        {
+          /* Committing the last revocation commits the others
+             with it. */
+          block_sector_t revoked = INVALID_SECTOR;
+          for (i = 0; i < io.cnt; i++)
+            if (journal_forget (start + i))
+              revoked = start + i;
+          if (revoked != INVALID_SECTOR)
+            journal_sync_revoke (revoked);
+          block_write_multiple (fs_device, start, buffer, io.cnt);
+        }
+      else
+        block_read_multiple (fs_device, start, buffer, io.cnt);
+
+      lock_acquire (&cache_lock);
+      for (i = 0; i < io.cnt; i++)
+        block_count_cache (fs_device, BLOCK_CACHE_DIRECT);
+      list_remove (&io.elem);
+      cond_broadcast (&direct_done, &cache_lock);
+      lock_release (&cache_lock);
+
+      start += io.cnt;
+      buffer += io.cnt * BLOCK_SECTOR_SIZE;
+      cnt -= io.cnt;
+    }
+}
+
+/* Returns true if SECTOR is being transferred directly.  The
+   cache lock must be held. */
+static bool
+direct_io_busy (block_sector_t sector)
+{
+  struct list_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  for (e = list_begin (&direct_ios); e != list_end (&direct_ios);
+       e = list_next (e))
+    {
+      struct direct_io *io = list_entry (e, struct direct_io, elem);
+      if (sector - io->start < io->cnt)
+        return true;
+    }
+  return false;
+}
+
+/* A cache entry to be written back, and the sector it held when
+   it was chosen. */
+struct write_back_slot
+  {
+    block_sector_t sector;
+    struct cache_entry *e;
+  };
+
+/* Compares write_back_slots A and B by sector, for qsort(). */
+static int
+compare_slots (const void *a_, const void *b_)
+{
+  const struct write_back_slot *a = a_;
+  const struct write_back_slot *b = b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes back the entries that hold a sector among the CNT
+   sectors starting at START and that have been dirty since timer
+   tick CUTOFF or earlier.  They are written in one batch, in
+   ascending sector order, so that the disk sweeps across them
+   once instead of seeking back and forth. */
+static void
+write_back_range (block_sector_t start, size_t cnt, int64_t cutoff)
+{
+  struct write_back_slot batch[CACHE_CNT];
+  size_t batch_cnt = 0;
+  size_t i;
+
+  /* Choose entries.  DIRTY is only a hint without the entry's
+     lock, so it is checked again below. */
+  lock_acquire (&cache_lock);
+  for (i = 0; i < CACHE_CNT; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      if (e->sector != INVALID_SECTOR && (size_t) (e->sector - start) < cnt
+          && e->dirty && e->dirtied <= cutoff)
+        {
+          batch[batch_cnt].sector = e->sector;
+          batch[batch_cnt].e = e;
+          batch_cnt++;
+        }
+    }
+  lock_release (&cache_lock);
+
+  qsort (batch, batch_cnt, sizeof *batch, compare_slots);
+  for (i = 0; i < batch_cnt; i++)
+    {
+      struct cache_entry *e = batch[i].e;
+      lock_acquire (&e->lock);
+      if (e->sector == batch[i].sector && e->dirty)
+        write_back (e);
+      lock_release (&e->lock);
+    }
+}
+
+/* Marks entry E dirty, noting when it became so.  E must be
+   locked. */
+static void
+mark_dirty (struct cache_entry *e)
+{
+  ASSERT (lock_held_by_current_thread (&e->lock));
+
+  if (!e->dirty)
+    {
+      e->dirty = true;
+      e->dirtied = timer_ticks ();
+    }
+}
+
+/* Writes dirty entry E back to disk.  E must be locked. */
+static void
+write_back (struct cache_entry *e)
+{
+  ASSERT (lock_held_by_current_thread (&e->lock));
+  ASSERT (e->dirty);
+
+  /* The journal must not replay old metadata over the new data. */
+  if (e->revoked)
+    {
+      journal_sync_revoke (e->sector);
+      e->revoked = false;
+    }
+  block_write (fs_device, e->sector, e->data);
+  e->dirty = false;
+
+  lock_acquire (&cache_lock);
+  block_count_cache (fs_device, BLOCK_CACHE_WRITE_BACK);
+  lock_release (&cache_lock);
+}
+
+/* Thread function that fetches the sectors queued by
+   cache_read_ahead() into the cache. */
+static void
+read_ahead (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t sector;
+      bool cached;
+
+      sema_down (&read_ahead_sema);
+      lock_acquire (&read_ahead_lock);
+      sector = read_ahead_queue[read_ahead_head];
+      read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_CNT;
+      read_ahead_cnt--;
+      lock_release (&read_ahead_lock);
+
+      lock_acquire (&cache_lock);
+      cached = lookup (sector) != NULL;
+      lock_release (&cache_lock);
+      if (!cached)
+        {
+          struct cache_entry *e = cache_get (sector, true, true);
+          lock_release (&e->lock);
+        }
+    }
+}
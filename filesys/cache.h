@@ -0,0 +1,23 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+void cache_init (void);
+void cache_read (block_sector_t, void *);
+void cache_read_at (block_sector_t, void *, size_t ofs, size_t size);
+void cache_write (block_sector_t, const void *);
+void cache_write_at (block_sector_t, const void *, size_t ofs, size_t size);
+void cache_write_meta (block_sector_t, const void *);
+void cache_write_meta_at (block_sector_t, const void *,
+                          size_t ofs, size_t size);
+void cache_read_ahead (block_sector_t);
+void cache_read_direct (block_sector_t, void *, size_t cnt);
+void cache_write_direct (block_sector_t, const void *, size_t cnt);
+void cache_flush (void);
+void cache_writeback (int64_t cutoff);
+void cache_sync (block_sector_t, size_t cnt);
+
+#endif /* filesys/cache.h */
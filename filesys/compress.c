@@ -0,0 +1,189 @@
+#include "filesys/compress.h"
+#include <debug.h>
+#include <stdint.h>
+#include <string.h>
+#include "threads/synch.h"
+
+/* Lempel-Ziv compression in the format of LZF.
+
+   The compressed data is a series of items, each starting with a
+   control byte C.  If C < 32, it is followed by C + 1 literal
+   bytes.  Otherwise, it is a back reference to earlier output:
+   its top 3 bits are the length less 2, and if they are all 1s
+   another byte follows with the rest of the length; then a byte
+   follows that, with the low 5 bits of C, gives the distance
+   back less 1.
+
+   The format has no end marker.  The decompressor is told how
+   many bytes to produce and ignores anything after them, so the
+   compressed data may be padded out to a whole sector. */
+
+/* Longest run of literal bytes in one item. */
+#define MAX_LIT 32
+
+/* Farthest back that a reference may point. */
+#define MAX_OFF (1 << 13)
+
+/* Longest back reference. */
+#define MAX_REF (7 + 255 + 2)
+
+/* Number of bits in a hash of 3 bytes. */
+#define HASH_BITS 12
+
+/* For each hash of 3 bytes, 1 + the offset in the input where
+   they last occurred, or 0.  Too big for a kernel stack, so it
+   is shared, under compress_lock. */
+static uint16_t last_seen[1 << HASH_BITS];
+static struct lock compress_lock;
+
+/* Initializes the compressor. */
+void
+compress_init (void)
+{
+  lock_init (&compress_lock);
+}
+
+/* Returns a hash of the 3 bytes at P. */
+static inline unsigned
+hash3 (const uint8_t *p)
+{
+  unsigned v = (p[0] << 16) | (p[1] << 8) | p[2];
+  return ((v * 2654435761u) >> (32 - HASH_BITS)) & ((1 << HASH_BITS) - 1);
+}
+
+/* Compresses the IN_LEN bytes at IN_, which must be fewer than
+   65536, into OUT_.  Returns the number of bytes of compressed
+   data, or 0 if it would be longer than OUT_MAX bytes. */
+size_t
+compress_data (const void *in_, size_t in_len, void *out_, size_t out_max)
+{
+  const uint8_t *in = in_;
+  uint8_t *out = out_;
+  size_t ip = 0, op = 0;
+  size_t lit = 0, lit_pos = 0;
+
+  ASSERT (in_len < 65536);
+
+  lock_acquire (&compress_lock);
+  memset (last_seen, 0, sizeof last_seen);
+  while (ip < in_len)
+    {
+      size_t len = 0, ref = 0;
+
+      /* Look for an earlier occurrence of the next 3 bytes. */
+      if (ip + 3 <= in_len)
+        {
+          unsigned h = hash3 (in + ip);
+          if (last_seen[h] != 0)
+            {
+              ref = last_seen[h] - 1;
+              if (ip - ref <= MAX_OFF && !memcmp (in + ref, in + ip, 3))
+                {
+                  size_t max = in_len - ip < MAX_REF ? in_len - ip : MAX_REF;
+                  for (len = 3; len < max && in[ref + len] == in[ip + len];
+                       len++)
+                    continue;
+                }
+            }
+          last_seen[h] = ip + 1;
+        }
+
+      if (len == 0)
+        {
+          /* Literal byte, starting a new run if need be. */
+          if (lit == 0)
+            {
+              if (op + 2 > out_max)
+                goto overflow;
+              lit_pos = op++;
+            }
+          else if (op + 1 > out_max)
+            goto overflow;
+          out[op++] = in[ip++];
+          out[lit_pos] = lit++;
+          if (lit == MAX_LIT)
+            lit = 0;
+        }
+      else
+        {
+          /* Back reference. */
+          size_t off = ip - ref - 1;
+          size_t l = len - 2;
+
+          if (op + 3 > out_max)
+            goto overflow;
+          if (l < 7)
+            out[op++] = (l << 5) | (off >> 8);
+          else
+            {
+              out[op++] = (7 << 5) | (off >> 8);
+              out[op++] = l - 7;
+            }
+          out[op++] = off & 0xff;
+          lit = 0;
+
+          /* Remember the bytes inside the match, too. */
+          for (ip++, len--; len > 0; ip++, len--)
+            if (ip + 3 <= in_len)
+              last_seen[hash3 (in + ip)] = ip + 1;
+        }
+    }
+  lock_release (&compress_lock);
+  return op;
+
+ overflow:
+  lock_release (&compress_lock);
+  return 0;
+}
+
+/* Decompresses the data at IN_, at most IN_LEN bytes of it,
+   into the OUT_SIZE bytes at OUT_.  Returns true if successful,
+   false if the data is corrupt or ends too soon. */
+bool
+decompress_data (const void *in_, size_t in_len, void *out_, size_t out_size)
+{
+  const uint8_t *in = in_;
+  uint8_t *out = out_;
+  size_t ip = 0, op = 0;
+
+  while (op < out_size)
+    {
+      unsigned c;
+
+      if (ip >= in_len)
+        return false;
+      c = in[ip++];
+      if (c < 32)
+        {
+          size_t n = c + 1;
+          if (ip + n > in_len || op + n > out_size)
+            return false;
+          memcpy (out + op, in + ip, n);
+          ip += n;
+          op += n;
+        }
+      else
+        {
+          size_t len = c >> 5, off;
+
+          if (len == 7)
+            {
+              if (ip >= in_len)
+                return false;
+              len += in[ip++];
+            }
+          len += 2;
+          if (ip >= in_len)
+            return false;
+          off = (((c & 0x1f) << 8) | in[ip++]) + 1;
+          if (off > op || op + len > out_size)
+            return false;
+
+          /* The source may overlap the destination, so copy a
+             byte at a time. */
+          for (; len > 0; len--, op++)
+            out[op] = out[op - off];
+        }
+    }
+  return true;
+}
@@ -0,0 +1,11 @@
+#ifndef FILESYS_COMPRESS_H
+#define FILESYS_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void compress_init (void);
+size_t compress_data (const void *, size_t, void *, size_t out_max);
+bool decompress_data (const void *, size_t, void *, size_t out_size);
+
+#endif /* filesys/compress.h */
@@ -0,0 +1,215 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Dentry cache.
+
+   Maps a (directory, name) pair to the number of the inode that
+   the name refers to, so that resolving a path whose components
+   have been seen before takes a hash lookup per component rather
+   than a directory bucket read.  A negative entry records that
+   the directory has no entry for the name, which makes repeated
+   lookups of missing files, as in a search path, just as cheap.
+
+   The cache does not read directories itself.  directory.c fills
+   it in on lookups and keeps it up to date as entries are added
+   and removed, in each case while holding the directory's lock,
+   so a lookup never sees an entry older than the directory. */
+
+/* Maximum number of entries.  The least recently used entry is
+   evicted to make room for a new one. */
+#define DCACHE_MAX 512
+
+/* A cached directory entry. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in lru. */
+    inumber_t dir;                      /* Directory's inode number. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    inumber_t inumber;                  /* Inode number or DCACHE_NEGATIVE. */
+  };
+
+static struct hash dentries;            /* All entries. */
+static struct list lru;                 /* All entries, most recent first. */
+static struct lock dcache_lock;         /* Protects the above. */
+
+/* Statistics. */
+static unsigned long long hit_cnt;      /* Lookups that found a file. */
+static unsigned long long neg_hit_cnt;  /* Lookups that found no file. */
+static unsigned long long miss_cnt;     /* Lookups not in the cache. */
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static struct dentry *find (inumber_t dir, const char *name);
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void)
+{
+  hash_init (&dentries, dentry_hash, dentry_less, NULL);
+  list_init (&lru);
+  lock_init (&dcache_lock);
+}
+
+/* Prints dentry cache statistics. */
+void
+dcache_print_stats (void)
+{
+  printf ("Dentry cache: %zu entries, %llu hits, %llu negative hits, "
+          "%llu misses\n",
+          hash_size (&dentries), hit_cnt, neg_hit_cnt, miss_cnt);
+}
+
+/* Looks up NAME in the directory whose inode number is DIR.
+   If the cache has an entry for it, sets *INUMBERP to the number
+   of NAME's inode, or to DCACHE_NEGATIVE if DIR has no entry for
+   NAME, and returns true.  Otherwise, returns false. */
+bool
+dcache_lookup (inumber_t dir, const char *name, inumber_t *inumberp)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&lru, &d->lru_elem);
+      *inumberp = d->inumber;
+      if (d->inumber != DCACHE_NEGATIVE)
+        hit_cnt++;
+      else
+        neg_hit_cnt++;
+    }
+  else
+    miss_cnt++;
+  lock_release (&dcache_lock);
+
+  return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode number is DIR
+   refers to inode INUMBER, or, if INUMBER is DCACHE_NEGATIVE,
+   that DIR has no entry for NAME.  Does nothing if memory is
+   short. */
+void
+dcache_insert (inumber_t dir, const char *name, inumber_t inumber)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    list_remove (&d->lru_elem);
+  else
+    {
+      if (hash_size (&dentries) >= DCACHE_MAX)
+        {
+          d = list_entry (list_pop_back (&lru), struct dentry, lru_elem);
+          hash_delete (&dentries, &d->hash_elem);
+        }
+      else
+        {
+          d = malloc (sizeof *d);
+          if (d == NULL)
+            {
+              lock_release (&dcache_lock);
+              return;
+            }
+        }
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+    }
+  d->inumber = inumber;
+  list_push_front (&lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Drops any entry for NAME in the directory whose inode number
+   is DIR. */
+void
+dcache_remove (inumber_t dir, const char *name)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      hash_delete (&dentries, &d->hash_elem);
+      list_remove (&d->lru_elem);
+      free (d);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Drops every entry in the directory whose inode number is DIR.
+   Called when the directory is deleted, because its inode number
+   may later be given to a different directory. */
+void
+dcache_purge (inumber_t dir)
+{
+  struct list_elem *e;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&lru); e != list_end (&lru); )
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      e = list_next (e);
+      if (d->dir == dir)
+        {
+          hash_delete (&dentries, &d->hash_elem);
+          list_remove (&d->lru_elem);
+          free (d);
+        }
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns the entry for NAME in DIR, or a null pointer if there
+   is none.  The caller must hold dcache_lock. */
+static struct dentry *
+find (inumber_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Returns a hash value for dentry E. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
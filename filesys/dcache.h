@@ -0,0 +1,18 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "filesys/inode.h"
+
+/* Inode number recorded for a name known not to exist. */
+#define DCACHE_NEGATIVE ((inumber_t) -1)
+
+void dcache_init (void);
+void dcache_print_stats (void);
+
+bool dcache_lookup (inumber_t dir, const char *name, inumber_t *);
+void dcache_insert (inumber_t dir, const char *name, inumber_t);
+void dcache_remove (inumber_t dir, const char *name);
+void dcache_purge (inumber_t dir);
+
+#endif /* filesys/dcache.h */
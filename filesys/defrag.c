@@ -0,0 +1,175 @@
+#include "filesys/defrag.h"
+#include <debug.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "filesys/inode.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+
+/* Online defragmenter.
+
+   Walks the directory tree from the root and moves the data of
+   each file or directory that is stored in more than one run of
+   sectors into a single free run, so that reading it in order
+   takes no seeks.  Each move is a journal operation of its own,
+   so a crash leaves each file either wholly at its old place or
+   wholly at its new one.  Files stay open for use by others
+   while this happens; each is locked only while it is moved. */
+
+/* A directory that is being walked. */
+struct level
+  {
+    struct list_elem elem;              /* Element in the walk's stack. */
+    struct dir *dir;                    /* The directory. */
+  };
+
+static void walk (struct dir *, struct defrag_stats *before,
+                  struct defrag_stats *after);
+static void visit (struct inode *, struct defrag_stats *before,
+                   struct defrag_stats *after);
+static thread_func defrag_thread NO_RETURN;
+
+/* Defragments every file and directory.  Stores how fragmented
+   the file system was into *BEFORE and, if AFTER is non-null,
+   how fragmented it is afterward into *AFTER.  If AFTER is null,
+   only scans. */
+void
+defrag_run (struct defrag_stats *before, struct defrag_stats *after)
+{
+  struct dir *root;
+
+  memset (before, 0, sizeof *before);
+  if (after != NULL)
+    memset (after, 0, sizeof *after);
+
+  root = dir_open_root ();
+  if (root == NULL)
+    return;
+  visit (dir_get_inode (root), before, after);
+  walk (root, before, after);
+  dir_close (root);
+}
+
+/* Starts a thread that defragments the file system in the
+   background every INTERVAL milliseconds. */
+void
+defrag_start (unsigned interval)
+{
+  static unsigned msec;
+
+  msec = interval;
+  thread_create ("defrag", PRI_MIN, defrag_thread, &msec);
+}
+
+/* Prints STATS, labeled with LABEL. */
+void
+defrag_print_stats (const char *label, const struct defrag_stats *stats)
+{
+  printf ("%s: %zu files, %zu fragmented, %zu runs of sectors",
+          label, stats->files, stats->fragmented, stats->runs);
+  if (stats->moved > 0)
+    printf (", %zu moved", stats->moved);
+  printf ("\n");
+}
+
+/* Visits each file and directory under ROOT, depth first.  The
+   directories being walked are kept on a list rather than on the
+   call stack, which is too small for a deep tree.  A directory
+   is not walked if memory is short. */
+static void
+walk (struct dir *root, struct defrag_stats *before,
+      struct defrag_stats *after)
+{
+  struct list stack;
+  struct level bottom;
+  char name[NAME_MAX + 1];
+
+  list_init (&stack);
+  bottom.dir = root;
+  list_push_front (&stack, &bottom.elem);
+  while (!list_empty (&stack))
+    {
+      struct level *top = list_entry (list_front (&stack),
+                                      struct level, elem);
+      struct level *child;
+      struct inode *inode;
+
+      if (!dir_readdir (top->dir, name))
+        {
+          list_pop_front (&stack);
+          if (top != &bottom)
+            {
+              dir_close (top->dir);
+              free (top);
+            }
+          continue;
+        }
+
+      /* Open the file by name, under the directory's lock, since
+         it may have been removed since it was listed. */
+      if (!dir_lookup (top->dir, name, &inode))
+        continue;
+      visit (inode, before, after);
+      if (!inode_is_dir (inode))
+        {
+          inode_close (inode);
+          continue;
+        }
+      child = malloc (sizeof *child);
+      if (child == NULL)
+        {
+          inode_close (inode);
+          continue;
+        }
+      child->dir = dir_open (inode);
+      if (child->dir != NULL)
+        list_push_front (&stack, &child->elem);
+      else
+        free (child);
+    }
+}
+
+/* Adds INODE to the statistics in *BEFORE and, if AFTER is
+   non-null, defragments it and adds it to *AFTER. */
+static void
+visit (struct inode *inode, struct defrag_stats *before,
+       struct defrag_stats *after)
+{
+  size_t runs = inode_fragments (inode);
+
+  before->files++;
+  before->runs += runs;
+  if (runs > 1)
+    before->fragmented++;
+
+  if (after != NULL)
+    {
+      if (runs > 1 && inode_defragment (inode))
+        {
+          after->moved++;
+          runs = inode_fragments (inode);
+        }
+      after->files++;
+      after->runs += runs;
+      if (runs > 1)
+        after->fragmented++;
+    }
+}
+
+/* Defragments the file system every *AUX_ milliseconds. */
+static void
+defrag_thread (void *aux_)
+{
+  const unsigned *msec = aux_;
+
+  for (;;)
+    {
+      struct defrag_stats before, after;
+
+      timer_msleep (*msec);
+      defrag_run (&before, &after);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef FILESYS_DEFRAG_H
+#define FILESYS_DEFRAG_H
+
+#include <stddef.h>
+
+/* How fragmented the files in the file system are. */
+struct defrag_stats
+  {
+    size_t files;                       /* Files and directories. */
+    size_t fragmented;                  /* Those in more than one run. */
+    size_t runs;                        /* Runs of sectors, in all. */
+    size_t moved;                       /* Files moved into one run. */
+  };
+
+void defrag_run (struct defrag_stats *before, struct defrag_stats *after);
+void defrag_start (unsigned interval);
+void defrag_print_stats (const char *, const struct defrag_stats *);
+
+#endif /* filesys/defrag.h */
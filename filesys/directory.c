@@ -1,12 +1,23 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
-/* A directory. */
+/* A directory.
+   Every operation on a directory's entries holds the directory
+   inode's lock (see inode_lock()), because adding an entry may
+   move other entries between buckets, and because the dentry
+   cache must change along with the entries.
+
+   Every directory has entries "." for itself and ".." for its
+   parent, which dir_readdir() does not return.  The root
+   directory is its own parent. */
 struct dir 
   {
     struct inode *inode;                /* Backing store. */
@@ -16,17 +27,72 @@ struct dir
 /* A single directory entry. */
 struct dir_entry 
   {
-    block_sector_t inode_sector;        /* Sector number of header. */
+    inumber_t inumber;                  /* Inode number. */
     char name[NAME_MAX + 1];            /* Null terminated file name. */
     bool in_use;                        /* In use or free? */
   };
 
-/* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+/* Number of entries in a bucket. */
+#define BUCKET_ENTRIES (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+
+/* Maximum number of buckets in a directory. */
+#define MAX_BUCKETS 65536
+
+/* On disk, a directory is a hash table of one-sector buckets.
+   An entry for NAME is in bucket name_hash(NAME) modulo the
+   number of buckets, which is always a power of 2 and is given
+   by the directory's length, so finding an entry takes a single
+   sector read.  When an entry's bucket is full, the number of
+   buckets is doubled, splitting each bucket in two.  A split
+   that fails partway can leave buckets past the last power of 2
+   in the directory's length; they are not used, and the next
+   split overwrites them. */
+struct dir_bucket
+  {
+    struct dir_entry entries[BUCKET_ENTRIES];
+    uint8_t unused[BLOCK_SECTOR_SIZE
+                   - BUCKET_ENTRIES * sizeof (struct dir_entry)];
+  };
+
+static bool split_buckets (struct dir *);
+static bool is_empty (struct dir *);
+
+/* Creates a directory with space for ENTRY_CNT entries as inode
+   INUMBER, whose parent directory is inode PARENT.  Returns true
+   if successful, false on failure.  On failure, INUMBER is
+   released. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (inumber_t inumber, size_t entry_cnt, inumber_t parent)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  size_t bucket_cnt = 1;
+  struct dir *dir;
+  bool success;
+
+  ASSERT (sizeof (struct dir_bucket) == BLOCK_SECTOR_SIZE);
+
+  while (bucket_cnt * BUCKET_ENTRIES < entry_cnt + 2)
+    bucket_cnt *= 2;
+  if (!inode_create (inumber, bucket_cnt * sizeof (struct dir_bucket), true))
+    {
+      inode_release (inumber);
+      return false;
+    }
+
+  /* Releases INUMBER on failure, when the inode is closed. */
+  dir = dir_open (inode_open (inumber));
+  if (dir == NULL)
+    {
+      inode_release (inumber);
+      return false;
+    }
+  success = dir_add (dir, ".", inumber) && dir_add (dir, "..", parent);
+  if (!success)
+    {
+      inode_remove (dir->inode);
+      dcache_purge (inumber);
+    }
+  dir_close (dir);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -54,7 +120,7 @@ dir_open (struct inode *inode)
 struct dir *
 dir_open_root (void)
 {
-  return dir_open (inode_open (ROOT_DIR_SECTOR));
+  return dir_open (inode_open (ROOT_DIR_INODE));
 }
 
 /* Opens and returns a new directory for the same inode as DIR.
@@ -83,63 +149,145 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Sets the position in DIR at which dir_readdir() continues to
+   POS, which must have been returned by dir_tell(). */
+void
+dir_seek (struct dir *dir, off_t pos)
+{
+  ASSERT (pos >= 0);
+  dir->pos = pos;
+}
+
+/* Returns the position in DIR at which dir_readdir() continues. */
+off_t
+dir_tell (struct dir *dir)
+{
+  return dir->pos;
+}
+
+/* Returns the hash of NAME.  FNV leaves the low bits, which
+   select the bucket, depending mostly on the last characters, so
+   the high bits are folded into them. */
+static unsigned
+name_hash (const char *name)
+{
+  unsigned hash = hash_string (name);
+  return hash ^ (hash >> 16);
+}
+
+/* Returns the number of buckets in DIR. */
+static size_t
+bucket_cnt (const struct dir *dir)
+{
+  size_t cnt = inode_length (dir->inode) / sizeof (struct dir_bucket);
+
+  /* Round down to a power of 2. */
+  while ((cnt & (cnt - 1)) != 0)
+    cnt &= cnt - 1;
+  return cnt;
+}
+
+/* Returns the byte offset within DIR of the bucket for NAME,
+   which must have at least one bucket. */
+static off_t
+bucket_ofs (const struct dir *dir, const char *name)
+{
+  return (name_hash (name) & (bucket_cnt (dir) - 1))
+         * sizeof (struct dir_bucket);
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   If FREEP is non-null, sets it to the byte offset of a free
+   entry in NAME's bucket, or to -1 if the bucket is full. */
 static bool
 lookup (const struct dir *dir, const char *name,
-        struct dir_entry *ep, off_t *ofsp) 
+        struct dir_entry *ep, off_t *ofsp, off_t *freep) 
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_bucket *b;
+  off_t ofs;
+  size_t i;
+  bool found = false;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
+  if (freep != NULL)
+    *freep = -1;
+  if (bucket_cnt (dir) == 0)
+    return false;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return false;
+  ofs = bucket_ofs (dir, name);
+  if (inode_read_at (dir->inode, b, sizeof *b, ofs) == sizeof *b)
+    for (i = 0; i < BUCKET_ENTRIES; i++)
       {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
+        struct dir_entry *e = &b->entries[i];
+        if (e->in_use && !strcmp (name, e->name)) 
+          {
+            if (ep != NULL)
+              *ep = *e;
+            if (ofsp != NULL)
+              *ofsp = ofs + i * sizeof *e;
+            found = true;
+            break;
+          }
+        else if (!e->in_use && freep != NULL && *freep == -1)
+          *freep = ofs + i * sizeof *e;
       }
-  return false;
+  free (b);
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   The answer comes from the dentry cache if it has one; if not,
+   it is added to the cache. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  inumber_t dir_inumber, inumber;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
+  dir_inumber = inode_get_inumber (dir->inode);
+  inode_lock (dir->inode);
+  if (inode_is_removed (dir->inode))
     *inode = NULL;
+  else if (dcache_lookup (dir_inumber, name, &inumber))
+    *inode = inumber != DCACHE_NEGATIVE ? inode_open (inumber) : NULL;
+  else if (lookup (dir, name, &e, NULL, NULL))
+    {
+      dcache_insert (dir_inumber, name, e.inumber);
+      *inode = inode_open (e.inumber);
+    }
+  else
+    {
+      dcache_insert (dir_inumber, name, DCACHE_NEGATIVE);
+      *inode = NULL;
+    }
+  inode_unlock (dir->inode);
 
   return *inode != NULL;
 }
 
 /* Adds a file named NAME to DIR, which must not already contain a
-   file by that name.  The file's inode is in sector
-   INODE_SECTOR.
+   file by that name.  The file's inode number is INUMBER.
    Returns true if successful, false on failure.
-   Fails if NAME is invalid (i.e. too long) or a disk or memory
-   error occurs. */
+   Fails if NAME is invalid (i.e. too long), if DIR has been
+   removed, or if a disk or memory error occurs. */
 bool
-dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
+dir_add (struct dir *dir, const char *name, inumber_t inumber)
 {
   struct dir_entry e;
   off_t ofs;
@@ -152,35 +300,39 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  /* Check that NAME is not in use, and set OFS to the offset of
+     a free slot in its bucket.  If the bucket is full, split the
+     buckets and try again. */
+  inode_lock (dir->inode);
+  if (inode_is_removed (dir->inode))
     goto done;
-
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+  for (;;)
+    {
+      if (lookup (dir, name, NULL, NULL, &ofs))
+        goto done;
+      if (ofs != -1)
+        break;
+      if (!split_buckets (dir))
+        goto done;
+    }
 
   /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
-  e.inode_sector = inode_sector;
+  e.inumber = inumber;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inumber);
 
  done:
+  inode_unlock (dir->inode);
   return success;
 }
 
 /* Removes any entry for NAME in DIR.
    Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   which occurs if there is no file with the given NAME, if NAME
+   is "." or "..", or if NAME is a directory that is not empty. */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
@@ -192,45 +344,216 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (!strcmp (name, ".") || !strcmp (name, ".."))
+    return false;
+
   /* Find directory entry. */
-  if (!lookup (dir, name, &e, &ofs))
+  inode_lock (dir->inode);
+  if (!lookup (dir, name, &e, &ofs, NULL))
     goto done;
 
   /* Open inode. */
-  inode = inode_open (e.inode_sector);
+  inode = inode_open (e.inumber);
   if (inode == NULL)
     goto done;
 
-  /* Erase directory entry. */
-  e.in_use = false;
-  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
-    goto done;
+  /* A directory must be empty.  Its lock is held until it is
+     marked removed, so that no file can be added to it in the
+     meantime. */
+  if (inode_is_dir (inode))
+    {
+      struct dir *child = dir_open (inode_reopen (inode));
+      bool empty;
 
-  /* Remove inode. */
-  inode_remove (inode);
+      if (child == NULL)
+        goto done;
+      inode_lock (inode);
+      empty = is_empty (child);
+      if (empty)
+        {
+          e.in_use = false;
+          empty = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+        }
+      if (empty)
+        {
+          inode_remove (inode);
+          dcache_purge (e.inumber);
+        }
+      inode_unlock (inode);
+      dir_close (child);
+      if (!empty)
+        goto done;
+    }
+  else
+    {
+      /* Erase directory entry. */
+      e.in_use = false;
+      if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
+        goto done;
+
+      /* Remove inode. */
+      inode_remove (inode);
+    }
+  dcache_remove (inode_get_inumber (dir->inode), name);
   success = true;
 
  done:
+  inode_unlock (dir->inode);
   inode_close (inode);
   return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
-   contains no more entries. */
+   contains no more entries.  Skips "." and "..".
+
+   The position is a byte offset, so a split between calls moves
+   entries from buckets already read to buckets not yet read.  An
+   entry only ever moves to a later bucket, so none that is in
+   the directory throughout is skipped, but such an entry may be
+   returned twice. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
+{
+  return dir_readdir_inumber (dir, name, NULL);
+}
+
+/* Like dir_readdir(), but also stores the entry's inode number
+   in *INUMBERP, if INUMBERP is non-null. */
+bool
+dir_readdir_inumber (struct dir *dir, char name[NAME_MAX + 1],
+                     inumber_t *inumberp)
 {
   struct dir_entry e;
+  bool success = false;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  inode_lock (dir->inode);
+  for (;;)
     {
+      /* Skip the unused tail of each bucket. */
+      off_t bucket_pos = dir->pos % sizeof (struct dir_bucket);
+      if (bucket_pos >= (off_t) (BUCKET_ENTRIES * sizeof e))
+        dir->pos += sizeof (struct dir_bucket) - bucket_pos;
+
+      if (dir->pos >= (off_t) (bucket_cnt (dir) * sizeof (struct dir_bucket))
+          || inode_read_at (dir->inode, &e, sizeof e, dir->pos) != sizeof e)
+        break;
       dir->pos += sizeof e;
-      if (e.in_use)
+      if (e.in_use && strcmp (e.name, ".") && strcmp (e.name, ".."))
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          if (inumberp != NULL)
+            *inumberp = e.inumber;
+          success = true;
+          break;
         } 
     }
-  return false;
+  inode_unlock (dir->inode);
+  return success;
+}
+
+/* Doubles the number of buckets in DIR, moving each entry whose
+   hash has the new bit set from bucket I to bucket I + N, where
+   N is the old number of buckets.  Returns true if successful,
+   false if DIR already has MAX_BUCKETS buckets or if memory or
+   disk space is short, in which case DIR's entries are where
+   they were. */
+static bool
+split_buckets (struct dir *dir)
+{
+  struct dir_bucket *lo, *hi;
+  size_t old_cnt = bucket_cnt (dir);
+  size_t new_cnt = old_cnt > 0 ? old_cnt * 2 : 1;
+  bool success = false;
+  size_t i, j;
+
+  ASSERT (inode_length (dir->inode) % sizeof (struct dir_bucket) == 0);
+  if (new_cnt > MAX_BUCKETS)
+    return false;
+
+  lo = malloc (sizeof *lo);
+  hi = malloc (sizeof *hi);
+  if (lo == NULL || hi == NULL)
+    goto done;
+
+  /* Write each new bucket, in order, with copies of the entries
+     that move to it.  Until the last one is written, the number
+     of buckets does not reach NEW_CNT, so lookups still use the
+     old buckets, which are not changed yet.  A write that fails
+     does not extend DIR. */
+  for (i = 0; i < new_cnt - old_cnt; i++)
+    {
+      memset (hi, 0, sizeof *hi);
+      if (old_cnt > 0)
+        {
+          if (inode_read_at (dir->inode, lo, sizeof *lo, i * sizeof *lo)
+              != sizeof *lo)
+            goto done;
+          for (j = 0; j < BUCKET_ENTRIES; j++)
+            {
+              struct dir_entry *e = &lo->entries[j];
+              if (e->in_use && (name_hash (e->name) & old_cnt) != 0)
+                hi->entries[j] = *e;
+            }
+        }
+      if (inode_write_at (dir->inode, hi, sizeof *hi,
+                          (i + old_cnt) * sizeof *hi) != sizeof *hi)
+        goto done;
+    }
+  success = true;
+
+  /* Now remove the moved entries from the old buckets, which
+     exist already, so that writing them takes no new space. */
+  for (i = 0; i < old_cnt; i++)
+    {
+      bool moved = false;
+
+      if (inode_read_at (dir->inode, lo, sizeof *lo, i * sizeof *lo)
+          != sizeof *lo)
+        continue;
+      for (j = 0; j < BUCKET_ENTRIES; j++)
+        {
+          struct dir_entry *e = &lo->entries[j];
+          if (e->in_use && (name_hash (e->name) & old_cnt) != 0)
+            {
+              e->in_use = false;
+              moved = true;
+            }
+        }
+      if (moved)
+        inode_write_at (dir->inode, lo, sizeof *lo, i * sizeof *lo);
+    }
+
+ done:
+  free (lo);
+  free (hi);
+  return success;
+}
+
+/* Returns true if DIR has no entries besides "." and "..".  The
+   caller must hold DIR's lock. */
+static bool
+is_empty (struct dir *dir)
+{
+  struct dir_bucket *b;
+  size_t i, j;
+  bool empty = true;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return false;
+  for (i = 0; empty && i < bucket_cnt (dir); i++)
+    {
+      if (inode_read_at (dir->inode, b, sizeof *b, i * sizeof *b)
+          != sizeof *b)
+        empty = false;
+      for (j = 0; empty && j < BUCKET_ENTRIES; j++)
+        {
+          struct dir_entry *e = &b->entries[j];
+          if (e->in_use && strcmp (e->name, ".") && strcmp (e->name, ".."))
+            empty = false;
+        }
+    }
+  free (b);
+  return empty;
 }
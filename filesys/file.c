@@ -1,7 +1,22 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include "devices/block.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Bounds on the number of bytes read ahead of a sequential
+   reader.  The window starts at the minimum. */
+#define READ_AHEAD_MIN (2 * BLOCK_SECTOR_SIZE)
+#define READ_AHEAD_MAX (16 * BLOCK_SECTOR_SIZE)
+
+/* Number of back-to-back sequential reads that make a stream. */
+#define READ_AHEAD_RUN 2
+
+/* Size of the buffer through which file_copy() moves data. */
+#define COPY_PAGES 8
+#define COPY_BYTES (COPY_PAGES * PGSIZE)
 
 /* An open file. */
 struct file 
@@ -9,8 +24,18 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+
+    /* Read-ahead state. */
+    off_t ra_next;              /* Where a sequential read would start. */
+    off_t ra_end;               /* End of the bytes already read ahead. */
+    off_t ra_window;            /* Bytes to keep ahead of the reader. */
+    int ra_run;                 /* Consecutive sequential reads. */
+    unsigned ra_hits;           /* Reads that found data read ahead. */
+    unsigned ra_misses;         /* Read-ahead data abandoned unread. */
   };
 
+static void update_read_ahead (struct file *, off_t pos, off_t size);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -23,6 +48,7 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_window = READ_AHEAD_MIN;
       return file;
     }
   else
@@ -64,11 +90,14 @@ file_get_inode (struct file *file)
    starting at the file's current position.
    Returns the number of bytes actually read,
    which may be less than SIZE if end of file is reached.
-   Advances FILE's position by the number of bytes read. */
+   Advances FILE's position by the number of bytes read.
+   Successive reads are watched for sequential access, which
+   starts reading the file ahead of FILE's position. */
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  update_read_ahead (file, file->pos, bytes_read);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -87,10 +116,9 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at the file's current position.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
-   Advances FILE's position by the number of bytes read. */
+   which may be less than SIZE if the disk is full.
+   Writing past end of file grows the file.
+   Advances FILE's position by the number of bytes written. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
 {
@@ -102,9 +130,8 @@ file_write (struct file *file, const void *buffer, off_t size)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file grows the file.
    The file's current position is unaffected. */
 off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
@@ -140,6 +167,16 @@ file_allow_write (struct file *file)
     }
 }
 
+/* Writes FILE's data and metadata to disk, so that they survive
+   a crash.  Returns true if successful, false if the disk is full
+   or memory is short. */
+bool
+file_sync (struct file *file)
+{
+  ASSERT (file != NULL);
+  return inode_sync (file->inode);
+}
+
 /* Returns the size of FILE in bytes. */
 off_t
 file_length (struct file *file) 
@@ -148,6 +185,50 @@ file_length (struct file *file)
   return inode_length (file->inode);
 }
 
+/* Copies up to SIZE bytes from SRC, starting at its current
+   position, to DST, starting at its current position, and
+   advances both positions by the number of bytes copied.  The
+   data passes through a kernel buffer of COPY_BYTES, so that
+   both transfers are large enough for the inode layer to move
+   runs of sectors directly between disk and buffer, bypassing
+   the cache.  Returns the number of bytes copied, which may be
+   less than SIZE if SRC ends, if DST cannot grow or is not
+   writable, or if memory is short. */
+off_t
+file_copy (struct file *dst, struct file *src, off_t size)
+{
+  uint8_t *buffer;
+  off_t bytes_copied = 0;
+
+  ASSERT (dst != NULL);
+  ASSERT (src != NULL);
+
+  buffer = palloc_get_multiple (0, COPY_PAGES);
+  if (buffer == NULL)
+    return 0;
+  while (bytes_copied < size)
+    {
+      /* Keep later chunks sector-aligned in SRC. */
+      off_t chunk_size = COPY_BYTES - src->pos % BLOCK_SECTOR_SIZE;
+      off_t bytes_read, bytes_written;
+
+      if (chunk_size > size - bytes_copied)
+        chunk_size = size - bytes_copied;
+      bytes_read = inode_read_at (src->inode, buffer, chunk_size, src->pos);
+      if (bytes_read == 0)
+        break;
+      bytes_written = inode_write_at (dst->inode, buffer, bytes_read,
+                                      dst->pos);
+      src->pos += bytes_written;
+      dst->pos += bytes_written;
+      bytes_copied += bytes_written;
+      if (bytes_written < bytes_read)
+        break;
+    }
+  palloc_free_multiple (buffer, COPY_PAGES);
+  return bytes_copied;
+}
+
 /* Sets the current position in FILE to NEW_POS bytes from the
    start of the file. */
 void
@@ -166,3 +247,61 @@ file_tell (struct file *file)
   ASSERT (file != NULL);
   return file->pos;
 }
+
+/* Stores in *HITS the number of reads from FILE that found their
+   data already read ahead, and in *MISSES the number of times
+   data read ahead for FILE went unused. */
+void
+file_read_ahead_stats (struct file *file, unsigned *hits, unsigned *misses)
+{
+  ASSERT (file != NULL);
+  *hits = file->ra_hits;
+  *misses = file->ra_misses;
+}
+
+/* Records that SIZE bytes were just read from FILE at offset
+   POS.  A read that starts where the previous one ended extends
+   a sequential stream; once the stream is long enough, the next
+   window of the file is read ahead in the background.  The
+   window doubles each time a read finds its data already read
+   ahead and halves each time read-ahead data is abandoned by a
+   jump elsewhere in the file.  Random access never reads
+   ahead. */
+static void
+update_read_ahead (struct file *file, off_t pos, off_t size)
+{
+  if (pos == file->ra_next)
+    {
+      file->ra_run++;
+      if (pos < file->ra_end)
+        {
+          file->ra_hits++;
+          if (file->ra_window < READ_AHEAD_MAX)
+            file->ra_window *= 2;
+        }
+    }
+  else
+    {
+      if (file->ra_end > file->ra_next)
+        {
+          file->ra_misses++;
+          if (file->ra_window > READ_AHEAD_MIN)
+            file->ra_window /= 2;
+        }
+      file->ra_run = 1;
+      file->ra_end = 0;
+    }
+  file->ra_next = pos + size;
+
+  if (file->ra_run >= READ_AHEAD_RUN && size > 0)
+    {
+      off_t start = (file->ra_end > file->ra_next
+                     ? file->ra_end : file->ra_next);
+      off_t end = file->ra_next + file->ra_window;
+      if (end > start)
+        {
+          inode_read_ahead (file->inode, start, end - start);
+          file->ra_end = end;
+        }
+    }
+}
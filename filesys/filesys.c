@@ -1,16 +1,54 @@
 #include "filesys/filesys.h"
 #include <debug.h>
+#include <list.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
+#include "filesys/defrag.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* Milliseconds that data may stay dirty in memory.  Set by the
+   kernel command line option -wb-age. */
+unsigned filesys_writeback_age = 5000;
+
+/* Milliseconds between passes of the background defragmenter,
+   or 0 to run none.  Set by the kernel command line option
+   -defrag. */
+unsigned filesys_defrag_interval = 0;
+
+/* Longest time, in milliseconds, between passes of the writeback
+   thread. */
+#define WRITEBACK_MSEC 1000
+
+/* A thread's working directory.  A thread that has none works in
+   the root directory. */
+struct cwd
+  {
+    struct list_elem elem;              /* Element in cwds. */
+    tid_t tid;                          /* Thread. */
+    struct dir *dir;                    /* Working directory. */
+  };
+
+static struct list cwds;                /* All working directories. */
+static struct lock cwds_lock;           /* Protects cwds. */
+
+static bool create (const char *path, off_t initial_size, bool is_dir);
+static struct dir *open_parent (const char *path, char name[NAME_MAX + 1]);
+static struct inode *open_inode (const char *path);
 static void do_format (void);
+static thread_func writeback NO_RETURN;
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -21,13 +59,23 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  list_init (&cwds);
+  lock_init (&cwds_lock);
+  cache_init ();
+  dcache_init ();
   inode_init ();
+  journal_init ();
   free_map_init ();
 
   if (format) 
     do_format ();
+  else
+    journal_open ();
 
   free_map_open ();
+  thread_create ("writeback", PRI_DEFAULT, writeback, NULL);
+  if (filesys_defrag_interval != 0)
+    defrag_start (filesys_defrag_interval);
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -35,9 +83,32 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_flush_all ();
   free_map_close ();
+  journal_close ();
+  cache_flush ();
 }
 
+/* Writes all file data and metadata to disk, so that it
+   survives a crash. */
+void
+filesys_sync (void)
+{
+  inode_writeback (INT64_MAX);
+  cache_flush ();
+  journal_commit ();
+}
+
+/* Prints file system statistics. */
+void
+filesys_print_stats (void)
+{
+  inode_print_stats ();
+  dcache_print_stats ();
+  free_map_print_stats ();
+  journal_print_stats ();
+}
+
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
@@ -45,17 +116,17 @@ filesys_done (void)
 bool
 filesys_create (const char *name, off_t initial_size) 
 {
-  block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
-  if (!success && inode_sector != 0) 
-    free_map_release (inode_sector, 1);
-  dir_close (dir);
+  return create (name, initial_size, false);
+}
 
-  return success;
+/* Creates a directory named NAME.
+   Returns true if successful, false otherwise.
+   Fails if a file named NAME already exists,
+   or if internal memory allocation fails. */
+bool
+filesys_mkdir (const char *name)
+{
+  return create (name, 0, true);
 }
 
 /* Opens the file with the given NAME.
@@ -66,37 +137,275 @@ filesys_create (const char *name, off_t initial_size)
 struct file *
 filesys_open (const char *name)
 {
-  struct dir *dir = dir_open_root ();
-  struct inode *inode = NULL;
-
-  if (dir != NULL)
-    dir_lookup (dir, name, &inode);
-  dir_close (dir);
-
-  return file_open (inode);
+  return file_open (open_inode (name));
 }
 
 /* Deletes the file named NAME.
    Returns true if successful, false on failure.
-   Fails if no file named NAME exists,
-   or if an internal memory allocation fails. */
+   Fails if no file named NAME exists, if NAME is a directory
+   that is not empty, or if an internal memory allocation fails. */
 bool
 filesys_remove (const char *name) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  char last[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = open_parent (name, last);
+  success = dir != NULL && dir_remove (dir, last);
   dir_close (dir); 
+  journal_end ();
 
   return success;
 }
-
+
+/* Makes the directory named NAME the current thread's working
+   directory.  Returns true if successful, false if NAME does not
+   name a directory. */
+bool
+filesys_chdir (const char *name)
+{
+  struct inode *inode = open_inode (name);
+
+  if (inode == NULL || !inode_is_dir (inode))
+    {
+      inode_close (inode);
+      return false;
+    }
+  filesys_set_cwd (dir_open (inode));
+  return true;
+}
+
+/* Returns a new directory for the current thread's working
+   directory, which the caller must close.  Returns a null pointer
+   if memory allocation fails. */
+struct dir *
+filesys_get_cwd (void)
+{
+  tid_t tid = thread_current ()->tid;
+  struct dir *dir = NULL;
+  bool found = false;
+  struct list_elem *e;
+
+  lock_acquire (&cwds_lock);
+  for (e = list_begin (&cwds); e != list_end (&cwds); e = list_next (e))
+    {
+      struct cwd *cwd = list_entry (e, struct cwd, elem);
+      if (cwd->tid == tid)
+        {
+          dir = dir_reopen (cwd->dir);
+          found = true;
+          break;
+        }
+    }
+  lock_release (&cwds_lock);
+
+  return found ? dir : dir_open_root ();
+}
+
+/* Makes DIR the current thread's working directory, taking
+   ownership of it and closing the old one.  A null DIR returns
+   the thread to the root directory; a thread that exits must do
+   this to release its working directory. */
+void
+filesys_set_cwd (struct dir *dir)
+{
+  tid_t tid = thread_current ()->tid;
+  struct cwd *cwd = NULL;
+  struct dir *old = NULL;
+  struct list_elem *e;
+
+  lock_acquire (&cwds_lock);
+  for (e = list_begin (&cwds); e != list_end (&cwds); e = list_next (e))
+    if (list_entry (e, struct cwd, elem)->tid == tid)
+      {
+        cwd = list_entry (e, struct cwd, elem);
+        break;
+      }
+  if (cwd != NULL)
+    {
+      old = cwd->dir;
+      if (dir != NULL)
+        cwd->dir = dir;
+      else
+        {
+          list_remove (&cwd->elem);
+          free (cwd);
+        }
+    }
+  else if (dir != NULL)
+    {
+      cwd = malloc (sizeof *cwd);
+      if (cwd != NULL)
+        {
+          cwd->tid = tid;
+          cwd->dir = dir;
+          list_push_back (&cwds, &cwd->elem);
+        }
+      else
+        old = dir;
+    }
+  lock_release (&cwds_lock);
+
+  dir_close (old);
+}
+
+/* Creates a file or, if IS_DIR is true, a directory named PATH.
+   A file is INITIAL_SIZE bytes long.  The new inode is placed
+   in or near its directory's inode table sector. */
+static bool
+create (const char *path, off_t initial_size, bool is_dir)
+{
+  char name[NAME_MAX + 1];
+  inumber_t inumber = 0;
+  inumber_t parent;
+  struct dir *dir;
+  bool success = false;
+
+  journal_begin ();
+  dir = open_parent (path, name);
+  parent = dir != NULL ? inode_get_inumber (dir_get_inode (dir)) : 0;
+  if (dir != NULL && name[0] != '\0'
+      && inode_allocate (parent, &inumber))
+    {
+      if (is_dir
+          ? !dir_create (inumber, 16, parent)
+          : !inode_create (inumber, initial_size, false))
+        {
+          /* dir_create() releases the inode number itself. */
+          if (!is_dir)
+            inode_release (inumber);
+        }
+      else if (dir_add (dir, name, inumber))
+        success = true;
+      else
+        {
+          /* Deleting the inode releases its number, too. */
+          struct inode *inode = inode_open (inumber);
+          if (inode != NULL)
+            inode_remove (inode);
+          inode_close (inode);
+        }
+    }
+  dir_close (dir);
+  journal_end ();
+
+  return success;
+}
+
+/* Opens the directory that contains the file named by PATH and
+   copies the file's name, the last component of PATH, into
+   NAME.  PATH is relative to the current thread's working
+   directory unless it begins with "/".  If PATH names the root
+   directory, sets NAME to the empty string and returns the root
+   directory.  Returns a null pointer if PATH is empty, if a
+   component is longer than NAME_MAX, if a directory on the way
+   does not exist, or if memory allocation fails. */
+static struct dir *
+open_parent (const char *path, char name[NAME_MAX + 1])
+{
+  struct dir *dir;
+
+  if (*path == '\0')
+    return NULL;
+  dir = *path == '/' ? dir_open_root () : filesys_get_cwd ();
+  name[0] = '\0';
+  while (dir != NULL)
+    {
+      struct inode *inode;
+      size_t len;
+
+      path += strspn (path, "/");
+      len = strcspn (path, "/");
+      if (len == 0)
+        break;
+      if (len > NAME_MAX)
+        {
+          dir_close (dir);
+          return NULL;
+        }
+
+      /* The previous component, if any, must be a directory. */
+      if (name[0] != '\0')
+        {
+          dir_lookup (dir, name, &inode);
+          dir_close (dir);
+          if (inode == NULL || !inode_is_dir (inode))
+            {
+              inode_close (inode);
+              return NULL;
+            }
+          dir = dir_open (inode);
+        }
+      memcpy (name, path, len);
+      name[len] = '\0';
+      path += len;
+    }
+  return dir;
+}
+
+/* Opens and returns the inode for the file or directory named by
+   PATH, or returns a null pointer if there is none. */
+static struct inode *
+open_inode (const char *path)
+{
+  char name[NAME_MAX + 1];
+  struct dir *dir = open_parent (path, name);
+  struct inode *inode = NULL;
+
+  if (dir == NULL)
+    return NULL;
+  if (name[0] == '\0')
+    inode = inode_reopen (dir_get_inode (dir));
+  else
+    dir_lookup (dir, name, &inode);
+  dir_close (dir);
+  return inode;
+}
+
+/* Thread function that writes back data once it has been dirty
+   for filesys_writeback_age milliseconds.  Each pass gives disk
+   space to the files' delayed data that has reached that age and
+   writes their data, writes the other cached sectors that have
+   reached it in one sorted batch, and, once per period, commits
+   the journal.  A crash therefore loses at most about that much
+   work, while data that is rewritten or deleted sooner never
+   reaches the disk at all. */
+static void
+writeback (void *aux UNUSED)
+{
+  int64_t last_commit = timer_ticks ();
+
+  for (;;)
+    {
+      int64_t age = (int64_t) filesys_writeback_age * TIMER_FREQ / 1000;
+      int64_t cutoff;
+
+      timer_msleep (filesys_writeback_age < WRITEBACK_MSEC
+                    ? filesys_writeback_age + 1 : WRITEBACK_MSEC);
+      cutoff = timer_ticks () - age;
+      inode_writeback (cutoff);
+      cache_writeback (cutoff);
+      if (last_commit <= cutoff)
+        {
+          journal_commit ();
+          last_commit = timer_ticks ();
+        }
+    }
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
+  static uint8_t zeros[BLOCK_SECTOR_SIZE];
+
   printf ("Formatting file system...");
+  journal_create ();
+  cache_write_meta (SYSTEM_INODE_SECTOR, zeros);
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_INODE, 16, ROOT_DIR_INODE))
     PANIC ("root directory creation failed");
   free_map_close ();
   printf ("done.\n");
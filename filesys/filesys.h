@@ -4,17 +4,40 @@
 #include <stdbool.h>
 #include "filesys/off_t.h"
 
-/* Sectors of system file inodes. */
-#define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
-#define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+/* Inode numbers of system files. */
+#define FREE_MAP_INODE 0        /* Free map file inode. */
+#define ROOT_DIR_INODE 1        /* Root directory file inode. */
+
+/* Inode table sector that holds the system file inodes. */
+#define SYSTEM_INODE_SECTOR 0
+
+/* Location of the journal. */
+#define JOURNAL_SECTOR 2        /* First sector of the journal. */
+#define JOURNAL_SECTORS 256     /* Number of sectors in the journal. */
 
 /* Block device that contains the file system. */
 struct block *fs_device;
 
+/* Milliseconds that data may stay dirty in memory before the
+   writeback thread writes it to disk. */
+extern unsigned filesys_writeback_age;
+
+/* Milliseconds between passes of the background defragmenter,
+   or 0 if there is none. */
+extern unsigned filesys_defrag_interval;
+
 void filesys_init (bool format);
 void filesys_done (void);
+void filesys_print_stats (void);
 bool filesys_create (const char *name, off_t initial_size);
 struct file *filesys_open (const char *name);
 bool filesys_remove (const char *name);
+bool filesys_mkdir (const char *name);
+bool filesys_chdir (const char *name);
+void filesys_sync (void);
+
+/* Working directories. */
+struct dir *filesys_get_cwd (void);
+void filesys_set_cwd (struct dir *);
 
 #endif /* filesys/filesys.h */
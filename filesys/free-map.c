@@ -1,70 +1,245 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdio.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static size_t free_cnt;              /* Number of free sectors. */
+static size_t reserved_cnt;          /* Free sectors set aside by
+                                        free_map_reserve(). */
+static struct bitmap *dirty;         /* Free map file sectors changed
+                                        since last written. */
+static unsigned long long writes_saved; /* Sector writes avoided by
+                                           writing only DIRTY. */
+
+/* Number of free map bits in one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Number of sectors in a region of the disk.  Searches for free
+   space look at a summary of each region first and only scan
+   the bits of regions that can satisfy the request. */
+#define REGION_SECTORS BITS_PER_SECTOR
+
+/* Summary of the free sectors in a region. */
+struct region
+  {
+    uint16_t free_cnt;                  /* Number of free sectors. */
+    uint16_t max_run;                   /* Longest run of free sectors. */
+    uint16_t head_run;                  /* Free sectors at the start. */
+    uint16_t tail_run;                  /* Free sectors at the end. */
+  };
+
+static struct region *regions;       /* Summary of each region. */
+static size_t region_cnt;            /* Number of regions. */
+static block_sector_t next_fit;      /* Where free_map_allocate()
+                                        starts looking. */
+static struct lock free_map_lock;    /* Protects all of the above. */
+
+static bool allocate (size_t cnt, block_sector_t goal, block_sector_t *);
+static void set_sectors (block_sector_t, size_t cnt, bool used);
+static size_t find_run (size_t cnt, block_sector_t goal);
+static void summarize_region (size_t);
 
 /* Initializes the free map. */
 void
 free_map_init (void) 
 {
+  size_t i;
+
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
-  bitmap_mark (free_map, FREE_MAP_SECTOR);
-  bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (free_map, SYSTEM_INODE_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  free_cnt = bitmap_size (free_map) - 1 - JOURNAL_SECTORS;
+  reserved_cnt = 0;
+  dirty = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                       BITS_PER_SECTOR));
+  if (dirty == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  writes_saved = 0;
+
+  region_cnt = DIV_ROUND_UP (bitmap_size (free_map), REGION_SECTORS);
+  regions = malloc (region_cnt * sizeof *regions);
+  if (regions == NULL)
+    PANIC ("free map summary creation failed");
+  for (i = 0; i < region_cnt; i++)
+    summarize_region (i);
+  next_fit = 0;
+  lock_init (&free_map_lock);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  Sectors set aside by
+   free_map_reserve() are not used.  The search starts where the
+   previous one ended (next fit).  The change reaches the free
+   map file at the next free_map_sync().
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (cnt, next_fit, sectorp);
+  if (success)
+    next_fit = *sectorp + cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Allocates CNT consecutive sectors, as close after GOAL as
+   possible, and stores the first into *SECTORP.  Callers pass
+   the sector of the inode that will own the new sectors, or of
+   its directory, to keep related data together.  Otherwise
+   like free_map_allocate(). */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t goal,
+                        block_sector_t *sectorp)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (cnt, goal, sectorp);
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Allocates a run of up to CNT consecutive sectors, for data
+   whose space was set aside earlier with free_map_reserve(), and
+   stores the first into *SECTORP.  The run starts at GOAL if
+   there is room there, so that a file being appended to can
+   extend its last extent; otherwise the first free run of CNT
+   sectors after GOAL, wrapping around to the start of the disk,
+   is used.  Only if no run of CNT free sectors exists is a
+   shorter one returned.
+   Returns the number of sectors allocated, which is 0 only if
+   the disk is full.
+   The caller must release its reservation for the sectors it
+   receives with free_map_unreserve().  It may hold on to the
+   reservation until it is sure to keep the sectors; in the
+   meantime they count twice, so fewer sectors appear free. */
+size_t
+free_map_allocate_run (size_t cnt, block_sector_t goal,
+                       block_sector_t *sectorp)
+{
+  size_t sector = BITMAP_ERROR;
+
+  lock_acquire (&free_map_lock);
+  while (cnt > 0)
+    {
+      sector = find_run (cnt, goal);
+      if (sector != BITMAP_ERROR)
+        break;
+      cnt /= 2;
+    }
+  if (cnt > 0)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      set_sectors (sector, cnt, true);
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  lock_release (&free_map_lock);
+  return cnt;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  set_sectors (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Sets aside CNT free sectors for data that will be allocated
+   later with free_map_allocate_run(), so that the space is
+   guaranteed to be there when it is needed.  Returns true if
+   successful, false if fewer than CNT unreserved sectors are
+   free. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = free_cnt >= reserved_cnt + cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Returns CNT sectors set aside by free_map_reserve() to the
+   pool of free sectors. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
 void
 free_map_open (void) 
 {
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
+  size_t i;
+
+  free_map_file = file_open (inode_open (FREE_MAP_INODE));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  inode_set_metadata (file_get_inode (free_map_file));
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+  for (i = 0; i < region_cnt; i++)
+    summarize_region (i);
+}
+
+/* Writes the sectors of the free map file whose bits have
+   changed since they were last written. */
+void
+free_map_sync (void)
+{
+  size_t idx;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (idx = 0; idx < bitmap_size (dirty); idx++)
+      if (bitmap_test (dirty, idx))
+        {
+          bitmap_write_part (free_map, free_map_file,
+                             idx * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+          bitmap_reset (dirty, idx);
+          writes_saved--;
+        }
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_sync ();
   file_close (free_map_file);
+  free_map_file = NULL;
+}
+
+/* Prints statistics about free map writes. */
+void
+free_map_print_stats (void)
+{
+  printf ("Free map: %llu sector writes saved\n", writes_saved);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -73,13 +248,180 @@ void
 free_map_create (void) 
 {
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  if (!inode_create (FREE_MAP_INODE, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
+  /* Write bitmap to file.  The file starts out as a hole, so
+     give it its sectors at once, so that writing it back never
+     needs to allocate, then write it again, since allocating
+     them changed the map. */
+  free_map_file = file_open (inode_open (FREE_MAP_INODE));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  inode_set_metadata (file_get_inode (free_map_file));
+  if (!bitmap_write (free_map, free_map_file)
+      || !inode_flush (file_get_inode (free_map_file))
+      || !bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty, false);
+  writes_saved = 0;
+}
+
+/* Does the work of free_map_allocate_near().  The free map lock
+   must be held. */
+static bool
+allocate (size_t cnt, block_sector_t goal, block_sector_t *sectorp)
+{
+  size_t sector = BITMAP_ERROR;
+
+  if (free_cnt >= reserved_cnt + cnt)
+    sector = find_run (cnt, goal);
+  if (sector == BITMAP_ERROR)
+    return false;
+  set_sectors (sector, cnt, true);
+  *sectorp = sector;
+  return true;
+}
+
+/* Marks the CNT sectors starting at SECTOR as USED or free, and
+   records which sectors of the free map file and which regions
+   changed.  Writing the whole free map file each time, as
+   bitmap_write() does, would cost one write per sector of it;
+   only the changed sectors will be written instead. */
+static void
+set_sectors (block_sector_t sector, size_t cnt, bool used)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  ASSERT (cnt > 0);
+
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  if (used)
+    free_cnt -= cnt;
+  else
+    free_cnt += cnt;
+
+  writes_saved += bitmap_size (dirty);
+  bitmap_set_multiple (dirty, first, last - first + 1, true);
+
+  /* Regions and free map file sectors are the same size. */
+  for (i = first; i <= last; i++)
+    summarize_region (i);
+}
+
+/* Returns the first sector of region IDX. */
+static block_sector_t
+region_start (size_t idx)
+{
+  return idx * REGION_SECTORS;
+}
+
+/* Returns the sector just past the end of region IDX. */
+static block_sector_t
+region_end (size_t idx)
+{
+  size_t end = (idx + 1) * REGION_SECTORS;
+  return end < bitmap_size (free_map) ? end : bitmap_size (free_map);
+}
+
+/* Recomputes the summary of region IDX from the free map. */
+static void
+summarize_region (size_t idx)
+{
+  struct region *r = &regions[idx];
+  block_sector_t start = region_start (idx);
+  block_sector_t end = region_end (idx);
+  block_sector_t pos = start;
+
+  r->free_cnt = r->max_run = r->head_run = r->tail_run = 0;
+  while (pos < end)
+    {
+      /* Find the next run of free sectors. */
+      size_t run_start = bitmap_scan_range (free_map, pos, end, 1, false);
+      size_t run_end, run;
+      if (run_start == BITMAP_ERROR)
+        break;
+      run_end = bitmap_scan_range (free_map, run_start, end, 1, true);
+      if (run_end == BITMAP_ERROR)
+        run_end = end;
+
+      run = run_end - run_start;
+      r->free_cnt += run;
+      if (run > r->max_run)
+        r->max_run = run;
+      if (run_start == start)
+        r->head_run = run;
+      if (run_end == end)
+        r->tail_run = run;
+      pos = run_end;
+    }
+}
+
+/* Returns true if the TAIL free sectors at the end of region IDX,
+   together with the free sectors at the start of the regions
+   that follow, make a run of at least CNT sectors. */
+static bool
+run_continues (size_t idx, size_t tail, size_t cnt)
+{
+  size_t run = tail;
+
+  for (idx++; run < cnt && idx < region_cnt; idx++)
+    {
+      run += regions[idx].head_run;
+      if (regions[idx].free_cnt != region_end (idx) - region_start (idx))
+        break;
+    }
+  return run >= cnt;
+}
+
+/* Returns the first sector of a run of CNT free sectors, looking
+   first at GOAL, then after it, then wrapping around to the
+   start of the disk.  Returns BITMAP_ERROR if there is no such
+   run.  Only regions whose summary shows that a run could start
+   in them are scanned. */
+static size_t
+find_run (size_t cnt, block_sector_t goal)
+{
+  size_t first, i;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+
+  if (cnt == 0 || cnt > bitmap_size (free_map))
+    return BITMAP_ERROR;
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+  if (goal + cnt <= bitmap_size (free_map)
+      && bitmap_none (free_map, goal, cnt))
+    return goal;
+
+  /* Look in GOAL's region from GOAL onward, then in the regions
+     after it, and finally in all of GOAL's region. */
+  first = goal / REGION_SECTORS;
+  for (i = 0; i <= region_cnt; i++)
+    {
+      size_t idx = (first + i) % region_cnt;
+      block_sector_t start = i == 0 ? goal : region_start (idx);
+      const struct region *r = &regions[idx];
+      size_t sector;
+
+      /* A run entirely within the region. */
+      if (r->max_run >= cnt)
+        {
+          sector = bitmap_scan_range (free_map, start, region_end (idx),
+                                      cnt, false);
+          if (sector != BITMAP_ERROR)
+            return sector;
+        }
+
+      /* A run that starts at the end of the region and continues
+         into the next ones. */
+      if (r->tail_run > 0 && r->tail_run < cnt
+          && region_end (idx) - r->tail_run >= start
+          && run_continues (idx, r->tail_run, cnt))
+        return region_end (idx) - r->tail_run;
+    }
+  return BITMAP_ERROR;
 }
@@ -1,14 +1,18 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <round.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ustar.h>
+#include "filesys/defrag.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include "threads/vaddr.h"
 
 /* List files in the root directory. */
@@ -37,6 +41,7 @@ fsutil_cat (char **argv)
   
   struct file *file;
   char *buffer;
+  unsigned ra_hits, ra_misses;
 
   printf ("Printing '%s' to the console...\n", file_name);
   file = filesys_open (file_name);
@@ -52,6 +57,8 @@ fsutil_cat (char **argv)
 
       hex_dump (pos, buffer, n, true); 
     }
+  file_read_ahead_stats (file, &ra_hits, &ra_misses);
+  printf ("Read-ahead: %u hits, %u misses\n", ra_hits, ra_misses);
   palloc_free_page (buffer);
   file_close (file);
 }
@@ -67,6 +74,56 @@ fsutil_rm (char **argv)
     PANIC ("%s: delete failed\n", file_name);
 }
 
+/* Defragments the file system, reporting how fragmented it was
+   before and after. */
+void
+fsutil_defrag (char **argv UNUSED)
+{
+  struct defrag_stats before, after;
+
+  printf ("Defragmenting file system...\n");
+  defrag_run (&before, &after);
+  defrag_print_stats ("Before", &before);
+  defrag_print_stats ("After", &after);
+}
+
+/* Copies between the scratch device and the file system go
+   through a ring of RING_BUFS buffers of RING_SECTORS sectors
+   each.  A helper thread fills the buffers from one side while
+   the calling thread drains them into the other, so that reading
+   a run of sectors overlaps writing the one before it, instead
+   of each sector being read and then written in turn. */
+#define RING_BUFS 4
+#define RING_SECTORS 64
+#define RING_BUF_SIZE (RING_SECTORS * BLOCK_SECTOR_SIZE)
+
+/* A ring of buffers. */
+struct ring
+  {
+    uint8_t *bufs[RING_BUFS];           /* Buffers. */
+    size_t lens[RING_BUFS];             /* Bytes in each full buffer. */
+    size_t head;                        /* Next buffer to fill. */
+    size_t tail;                        /* Next buffer to drain. */
+    size_t ofs;                         /* Bytes drained from tail buffer. */
+    bool draining;                      /* Holding the tail buffer? */
+    struct semaphore full;              /* Counts full buffers. */
+    struct semaphore empty;             /* Counts empty buffers. */
+    struct semaphore done;              /* Upped when the filler exits. */
+    bool stop;                          /* Tells the filler to exit. */
+
+    /* What the filler reads: either DEV, from SECTOR onward, or
+       FILE, from its current position onward. */
+    struct block *dev;                  /* Device. */
+    block_sector_t sector;              /* Next sector to read from DEV. */
+    struct file *file;                  /* File. */
+  };
+
+static void ring_start (struct ring *, thread_func *);
+static const uint8_t *ring_read (struct ring *, size_t max, size_t *len);
+static void ring_finish (struct ring *);
+static thread_func fill_from_device;
+static thread_func fill_from_file;
+
 /* Extracts a ustar-format tar archive from the scratch block
    device into the Pintos file system. */
 void
@@ -74,32 +131,40 @@ fsutil_extract (char **argv UNUSED)
 {
   static block_sector_t sector = 0;
 
-  struct block *src;
-  void *header, *data;
+  struct ring ring;
+  char *header;
 
-  /* Allocate buffers. */
+  /* Allocate buffer. */
   header = malloc (BLOCK_SECTOR_SIZE);
-  data = malloc (BLOCK_SECTOR_SIZE);
-  if (header == NULL || data == NULL)
-    PANIC ("couldn't allocate buffers");
+  if (header == NULL)
+    PANIC ("couldn't allocate buffer");
 
   /* Open source block device. */
-  src = block_get_role (BLOCK_SCRATCH);
-  if (src == NULL)
+  ring.dev = block_get_role (BLOCK_SCRATCH);
+  if (ring.dev == NULL)
     PANIC ("couldn't open scratch device");
 
   printf ("Extracting ustar archive from scratch device "
           "into file system...\n");
 
+  ring.sector = sector;
+  ring_start (&ring, fill_from_device);
   for (;;)
     {
       const char *file_name;
       const char *error;
+      const uint8_t *data;
       enum ustar_type type;
+      size_t len;
       int size;
 
-      /* Read and parse ustar header. */
-      block_read (src, sector++, header);
+      /* Read and parse ustar header.  The header is copied out
+         of the ring, since FILE_NAME points into it. */
+      data = ring_read (&ring, BLOCK_SECTOR_SIZE, &len);
+      if (data == NULL)
+        PANIC ("end of scratch device in ustar archive");
+      memcpy (header, data, BLOCK_SECTOR_SIZE);
+      sector++;
       error = ustar_parse_header (header, &file_name, &type, &size);
       if (error != NULL)
         PANIC ("bad ustar header in sector %"PRDSNu" (%s)", sector - 1, error);
@@ -114,6 +179,7 @@ fsutil_extract (char **argv UNUSED)
       else if (type == USTAR_REGULAR)
         {
           struct file *dst;
+          size_t left = ROUND_UP (size, BLOCK_SECTOR_SIZE);
 
           printf ("Putting '%s' into the file system...\n", file_name);
 
@@ -124,23 +190,30 @@ fsutil_extract (char **argv UNUSED)
           if (dst == NULL)
             PANIC ("%s: open failed", file_name);
 
-          /* Do copy. */
-          while (size > 0)
+          /* Do copy, as much of a buffer at a time as the file
+             takes up. */
+          while (left > 0)
             {
-              int chunk_size = (size > BLOCK_SECTOR_SIZE
-                                ? BLOCK_SECTOR_SIZE
-                                : size);
-              block_read (src, sector++, data);
+              int chunk_size;
+
+              data = ring_read (&ring, left, &len);
+              if (data == NULL)
+                PANIC ("%s: end of scratch device with %d bytes unread",
+                       file_name, size);
+              chunk_size = (size_t) size < len ? size : (int) len;
               if (file_write (dst, data, chunk_size) != chunk_size)
                 PANIC ("%s: write failed with %d bytes unwritten",
                        file_name, size);
               size -= chunk_size;
+              left -= len;
+              sector += len / BLOCK_SECTOR_SIZE;
             }
 
           /* Finish up. */
           file_close (dst);
         }
     }
+  ring_finish (&ring);
 
   /* Erase the ustar header from the start of the block device,
      so that the extraction operation is idempotent.  We erase
@@ -148,10 +221,9 @@ fsutil_extract (char **argv UNUSED)
      end-of-archive marker. */
   printf ("Erasing ustar archive...\n");
   memset (header, 0, BLOCK_SECTOR_SIZE);
-  block_write (src, 0, header);
-  block_write (src, 1, header);
+  block_write (ring.dev, 0, header);
+  block_write (ring.dev, 1, header);
 
-  free (data);
   free (header);
 }
 
@@ -169,10 +241,12 @@ fsutil_append (char **argv)
   static block_sector_t sector = 0;
 
   const char *file_name = argv[1];
+  struct ring ring;
+  const uint8_t *data;
   void *buffer;
-  struct file *src;
   struct block *dst;
   off_t size;
+  size_t len, cnt;
 
   printf ("Appending '%s' to ustar archive on scratch device...\n", file_name);
 
@@ -182,10 +256,10 @@ fsutil_append (char **argv)
     PANIC ("couldn't allocate buffer");
 
   /* Open source file. */
-  src = filesys_open (file_name);
-  if (src == NULL)
+  ring.file = filesys_open (file_name);
+  if (ring.file == NULL)
     PANIC ("%s: open failed", file_name);
-  size = file_length (src);
+  size = file_length (ring.file);
 
   /* Open target block device. */
   dst = block_get_role (BLOCK_SCRATCH);
@@ -197,27 +271,164 @@ fsutil_append (char **argv)
     PANIC ("%s: name too long for ustar format", file_name);
   block_write (dst, sector++, buffer);
 
-  /* Do copy. */
-  while (size > 0) 
+  /* Do copy, writing each buffer as the file is read into the
+     next. */
+  ring_start (&ring, fill_from_file);
+  while ((data = ring_read (&ring, RING_BUF_SIZE, &len)) != NULL)
     {
-      int chunk_size = size > BLOCK_SECTOR_SIZE ? BLOCK_SECTOR_SIZE : size;
-      if (sector >= block_size (dst))
+      if ((off_t) len > ROUND_UP (size, BLOCK_SECTOR_SIZE))
+        PANIC ("%s: file grew while being read", file_name);
+      cnt = len / BLOCK_SECTOR_SIZE;
+      if (sector + cnt > block_size (dst))
         PANIC ("%s: out of space on scratch device", file_name);
-      if (file_read (src, buffer, chunk_size) != chunk_size)
-        PANIC ("%s: read failed with %"PROTd" bytes unread", file_name, size);
-      memset (buffer + chunk_size, 0, BLOCK_SECTOR_SIZE - chunk_size);
-      block_write (dst, sector++, buffer);
-      size -= chunk_size;
+      block_write_multiple (dst, sector, data, cnt);
+      sector += cnt;
+      size -= len < (size_t) size ? (off_t) len : size;
     }
+  ring_finish (&ring);
+  if (size > 0)
+    PANIC ("%s: read failed with %"PROTd" bytes unread", file_name, size);
 
   /* Write ustar end-of-archive marker, which is two consecutive
      sectors full of zeros.  Don't advance our position past
      them, though, in case we have more files to append. */
   memset (buffer, 0, BLOCK_SECTOR_SIZE);
   block_write (dst, sector, buffer);
-  block_write (dst, sector, buffer + 1);
+  block_write (dst, sector + 1, buffer);
 
   /* Finish up. */
-  file_close (src);
+  file_close (ring.file);
   free (buffer);
 }
+
+/* Allocates RING's buffers and starts a thread that runs FILLER
+   to fill them.  The caller must have set up the filler's source
+   in RING. */
+static void
+ring_start (struct ring *ring, thread_func *filler)
+{
+  size_t i;
+
+  for (i = 0; i < RING_BUFS; i++)
+    {
+      ring->bufs[i] = malloc (RING_BUF_SIZE);
+      if (ring->bufs[i] == NULL)
+        PANIC ("couldn't allocate buffers");
+    }
+  ring->head = ring->tail = ring->ofs = 0;
+  ring->draining = false;
+  sema_init (&ring->full, 0);
+  sema_init (&ring->empty, RING_BUFS);
+  sema_init (&ring->done, 0);
+  ring->stop = false;
+  if (thread_create ("fsutil-fill", PRI_DEFAULT, filler, ring) == TID_ERROR)
+    PANIC ("couldn't start thread");
+}
+
+/* Returns the next bytes that RING's filler produced, at most MAX
+   of them, waiting for the filler if necessary, and stores the
+   number returned into *LEN.  The bytes stay valid until the next
+   call.  Returns a null pointer when the filler has no more. */
+static const uint8_t *
+ring_read (struct ring *ring, size_t max, size_t *len)
+{
+  const uint8_t *data;
+
+  if (ring->draining && ring->ofs == ring->lens[ring->tail])
+    {
+      /* Done with this buffer, so give it back to the filler. */
+      ring->tail = (ring->tail + 1) % RING_BUFS;
+      ring->draining = false;
+      sema_up (&ring->empty);
+    }
+  if (!ring->draining)
+    {
+      sema_down (&ring->full);
+      ring->ofs = 0;
+      ring->draining = true;
+      if (ring->lens[ring->tail] == 0)
+        return NULL;
+    }
+
+  data = ring->bufs[ring->tail] + ring->ofs;
+  *len = ring->lens[ring->tail] - ring->ofs;
+  if (*len > max)
+    *len = max;
+  ring->ofs += *len;
+  return data;
+}
+
+/* Stops RING's filler, waits for it to exit, and frees RING's
+   buffers. */
+static void
+ring_finish (struct ring *ring)
+{
+  size_t i;
+
+  ring->stop = true;
+  sema_up (&ring->empty);
+  sema_down (&ring->done);
+  for (i = 0; i < RING_BUFS; i++)
+    free (ring->bufs[i]);
+}
+
+/* Fills RING's buffers with the sectors of RING->dev from
+   RING->sector to the end of the device, or until told to stop.
+   Ends with an empty buffer at the end of the device. */
+static void
+fill_from_device (void *ring_)
+{
+  struct ring *ring = ring_;
+
+  for (;;)
+    {
+      uint8_t *buf;
+      size_t cnt;
+
+      sema_down (&ring->empty);
+      if (ring->stop)
+        break;
+
+      buf = ring->bufs[ring->head];
+      cnt = block_size (ring->dev) - ring->sector;
+      if (cnt > RING_SECTORS)
+        cnt = RING_SECTORS;
+      block_read_multiple (ring->dev, ring->sector, buf, cnt);
+      ring->sector += cnt;
+      ring->lens[ring->head] = cnt * BLOCK_SECTOR_SIZE;
+      ring->head = (ring->head + 1) % RING_BUFS;
+      sema_up (&ring->full);
+      if (cnt == 0)
+        break;
+    }
+  sema_up (&ring->done);
+}
+
+/* Fills RING's buffers with the rest of RING->file, each padded
+   with zeros to a whole number of sectors, or until told to stop.
+   Ends with an empty buffer at the end of the file. */
+static void
+fill_from_file (void *ring_)
+{
+  struct ring *ring = ring_;
+
+  for (;;)
+    {
+      uint8_t *buf;
+      off_t n;
+
+      sema_down (&ring->empty);
+      if (ring->stop)
+        break;
+
+      buf = ring->bufs[ring->head];
+      n = file_read (ring->file, buf, RING_BUF_SIZE);
+      memset (buf + n, 0, ROUND_UP (n, BLOCK_SECTOR_SIZE) - n);
+      ring->lens[ring->head] = ROUND_UP (n, BLOCK_SECTOR_SIZE);
+      ring->head = (ring->head + 1) % RING_BUFS;
+      sema_up (&ring->full);
+      if (n == 0)
+        break;
+    }
+  sema_up (&ring->done);
+}
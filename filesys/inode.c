@@ -1,23 +1,128 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/compress.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of inodes packed into each sector of the inode table. */
+#define INODES_PER_SECTOR 4
+
+/* Number of extents stored in the inode itself. */
+#define INODE_EXTENTS 9
+
+/* Number of extents stored in each extent block. */
+#define BLOCK_EXTENTS 42
+
+/* Number of sector numbers that fit in the extent index. */
+#define PTRS_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+
+/* Maximum number of extents in a file. */
+#define MAX_EXTENTS (INODE_EXTENTS + PTRS_PER_SECTOR * BLOCK_EXTENTS)
+
+/* Number of sectors of written data that a file may hold in
+   memory, waiting for disk space to be allocated, before it is
+   flushed. */
+#define DELAYED_MAX 64
+
+/* A compressed file is stored in chunks of this many sectors. */
+#define CHUNK_SECTORS 8
+#define CHUNK_SIZE (CHUNK_SECTORS * BLOCK_SECTOR_SIZE)
+
+/* Number of chunks of written data that a compressed file may
+   hold in memory before they are compressed and written. */
+#define CHUNKS_MAX 8
+
+/* Number of sectors that inode_defragment() copies at a time. */
+#define DEFRAG_SECTORS 8
+
+/* Largest directory, in sectors, that inode_defragment() moves.
+   A directory's data is copied through the journal, and the whole
+   move, with the inode and its extent blocks, must fit in one
+   transaction. */
+#define DEFRAG_META_MAX (JOURNAL_TXN_MAX / 2)
+
+/* Reads and writes of at least this many bytes transfer whole
+   sectors directly between the disk and the caller's buffer,
+   instead of copying them through the buffer cache. */
+#define DIRECT_MIN (8 * BLOCK_SECTOR_SIZE)
+
+/* A run of consecutive data sectors of a file, stored in
+   consecutive sectors on disk. */
+struct extent
+  {
+    uint32_t logical;                   /* First sector within file. */
+    block_sector_t start;               /* First sector on disk. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
+/* Number of bytes of data that a file may store in its inode,
+   in place of its extents. */
+#define INLINE_MAX (INODE_EXTENTS * sizeof (struct extent))
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE / INODES_PER_SECTOR bytes
+   long.  Inode number N is slot N % INODES_PER_SECTOR of inode
+   table sector N / INODES_PER_SECTOR.  A slot whose magic number
+   is not INODE_MAGIC is free.
+
+   The extents are sorted by logical sector and do not overlap.
+   Sectors of the file that no extent covers are holes, which
+   read as zeros.  Extents past the first INODE_EXTENTS are kept
+   in extent blocks, whose sector numbers are listed in the
+   extent index sector.
+
+   A file of at most INLINE_MAX bytes may instead keep its data
+   in the inode, where the extents would go, so that it takes no
+   sector besides the inode's own.  Such a file has the
+   INODE_INLINE flag and no extents.
+
+   A file with the INODE_COMPRESSED flag is stored in chunks of
+   CHUNK_SECTORS sectors.  The extents are its chunk map: they
+   map each chunk's first K sectors and leave the rest as holes.
+   If K is 0, the chunk is all zeros; if K is CHUNK_SECTORS, it
+   is stored as is; otherwise, its K sectors hold it compressed
+   by compress_data().
+
+   utils/pintos-mkfs.c writes inodes in this format too. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t extent_cnt;                /* Number of extents. */
+    block_sector_t extent_index;        /* Extent index sector, or 0. */
+    union
+      {
+        struct extent extents[INODE_EXTENTS]; /* First extents. */
+        uint8_t data[INLINE_MAX];       /* Data, if INODE_INLINE. */
+      };
+    uint32_t flags;                     /* INODE_* flags. */
+  };
+
+/* Inode flags. */
+#define INODE_DIR 0x1                   /* Directory. */
+#define INODE_INLINE 0x2                /* Data stored in the inode. */
+#define INODE_COMPRESSED 0x4            /* Data stored compressed. */
+
+/* On-disk extent block.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_block
+  {
+    struct extent extents[BLOCK_EXTENTS]; /* Extents. */
+    uint32_t unused[2];                 /* Not used. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,136 +133,547 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* A data sector that has been written but not yet given a place
+   on disk. */
+struct delayed_block
+  {
+    struct list_elem elem;              /* Element in inode's list. */
+    size_t idx;                         /* Sector within file. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+/* A chunk of a compressed file that has been written but not yet
+   compressed and written to disk. */
+struct dirty_chunk
+  {
+    struct list_elem elem;              /* Element in inode's list. */
+    size_t idx;                         /* Chunk within file. */
+    uint8_t data[CHUNK_SIZE];           /* Chunk contents. */
+  };
+
+/* State of an in-memory inode. */
+enum inode_state
+  {
+    INODE_LOADING,              /* Being read in by its first opener. */
+    INODE_OPEN,                 /* Ready for use. */
+    INODE_CLOSING,              /* Being written out by its last closer. */
+    INODE_FAILED                /* Could not be read in. */
+  };
+
+/* In-memory inode.
+
+   OPEN_CNT, STATE and ELEM are protected by open_inodes_lock.
+   FLUSH_ELEM is protected by writeback_lock.  The rest
+   is protected by the inode's reader/writer lock: reading the
+   file, or overwriting data that already has disk space, needs
+   it shared, and anything that changes the length, the extents
+   or the delayed blocks needs it exclusive.  LOCK is not used by
+   this module at all; it lets a directory make a lookup and an
+   update of its entries atomic. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
-    block_sector_t sector;              /* Sector number of disk location. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    inumber_t inumber;                  /* Inode number. */
+    block_sector_t sector;              /* Inode table sector holding it. */
     int open_cnt;                       /* Number of openers. */
+    enum inode_state state;             /* Loading, open, or closing. */
+    struct list_elem flush_elem;        /* Element in a writeback pass. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
-    struct inode_disk data;             /* Inode content. */
+    struct lock lock;                   /* See inode_lock(). */
+
+    /* Reader/writer lock. */
+    struct lock rw_lock;                /* Protects the members below. */
+    struct condition rw_cond;           /* Signaled when the lock is freed. */
+    int readers;                        /* Number of holders if shared. */
+    bool writer;                        /* Held exclusive? */
+    int writers_waiting;                /* Threads waiting for exclusive. */
+
+    off_t length;                       /* File size in bytes. */
+    bool dirty;                         /* Changed since last stored? */
+    bool metadata;                      /* Data written through journal? */
+    bool is_dir;                        /* Directory? */
+    uint8_t *inline_data;               /* INLINE_MAX bytes, if inline. */
+
+    /* Extents, as on disk. */
+    struct extent *extents;             /* Array of EXTENT_CAP extents. */
+    size_t extent_cnt;                  /* Number of extents in use. */
+    size_t extent_cap;                  /* Capacity of EXTENTS. */
+    block_sector_t extent_index;        /* Extent index sector, or 0. */
+
+    /* Delayed allocation. */
+    struct list delayed;                /* Delayed blocks, sorted by idx. */
+    size_t delayed_cnt;                 /* Number of delayed blocks. */
+    int64_t delayed_since;              /* Tick when first one was made. */
+    size_t reserved;                    /* Sectors reserved in free map. */
+
+    /* Compression. */
+    bool compressed;                    /* Stored in compressed chunks? */
+    struct list chunks;                 /* Dirty chunks, sorted by idx. */
+    size_t chunk_cnt;                   /* Number of dirty chunks. */
+    struct lock chunk_lock;             /* Protects the members below. */
+    uint8_t *chunk_buf;                 /* Last chunk read from disk. */
+    size_t chunk_buf_idx;               /* Its index, or SIZE_MAX. */
   };
 
+static void lock_shared (struct inode *);
+static void unlock_shared (struct inode *);
+static void lock_exclusive (struct inode *);
+static void unlock_exclusive (struct inode *);
+static bool allocate_delayed (struct inode *);
+static bool claim_slot (block_sector_t, inumber_t *);
+static bool inode_load (struct inode *);
+static bool inode_store (struct inode *, size_t first);
+static void inode_deallocate (struct inode *);
+static size_t unbacked_sectors (struct inode *, off_t offset,
+                                off_t size, bool include_delayed);
+static block_sector_t extent_goal (const struct inode *, size_t idx);
+static block_sector_t lookup_sector (const struct inode *, size_t idx);
+static block_sector_t lookup_extent (const struct extent *, size_t cnt,
+                                     size_t idx);
+static bool insert_extent (struct inode *, size_t logical,
+                           block_sector_t start, size_t cnt, size_t *posp);
+static struct delayed_block *get_delayed (struct inode *, size_t idx,
+                                          bool create);
+static bool sync_data (struct inode *);
+static void collect_open_inodes (struct list *, bool all, int64_t cutoff);
+static bool uninline (struct inode *);
+static off_t read_compressed (struct inode *, uint8_t *, off_t size,
+                              off_t offset);
+static off_t write_compressed (struct inode *, const uint8_t *, off_t size,
+                               off_t offset);
+static struct dirty_chunk *get_chunk (struct inode *, size_t idx,
+                                      bool create);
+static bool write_chunks (struct inode *, struct list *written,
+                          size_t *firstp);
+static bool grow_extents (struct inode *, size_t cnt);
+static bool punch_extents (struct inode *, size_t logical, size_t cnt,
+                           size_t *firstp);
+static size_t sector_run (struct inode *, size_t idx, size_t cnt,
+                          block_sector_t *sectorp);
+static size_t write_holes (struct inode *, size_t idx, size_t cnt,
+                           const uint8_t *, size_t *firstp);
+static block_sector_t read_ptr (block_sector_t, size_t);
+static void write_ptr (block_sector_t, size_t, block_sector_t);
+
+/* Returns the inode table sector that holds inode INUMBER. */
+static inline block_sector_t
+inumber_sector (inumber_t inumber)
+{
+  return inumber / INODES_PER_SECTOR;
+}
+
+/* Returns the byte offset of inode INUMBER within its inode
+   table sector. */
+static inline size_t
+inumber_ofs (inumber_t inumber)
+{
+  return inumber % INODES_PER_SECTOR * sizeof (struct inode_disk);
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, which the caller must have locked.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS or if disk space for that byte has not been allocated
+   yet. */
 block_sector_t
 byte_to_sector (const struct inode *inode, off_t pos)
 {
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
+  if (pos >= inode->length)
     return -1;
+  return lookup_sector (inode, pos / BLOCK_SECTOR_SIZE);
+}
+
+/* Returns the disk sector that INODE's extents map sector IDX of
+   the file to, or -1 if they map it to none.  Unlike
+   byte_to_sector(), does not look at INODE's length, which a
+   compressed chunk's sectors may extend past. */
+static block_sector_t
+lookup_sector (const struct inode *inode, size_t idx)
+{
+  return lookup_extent (inode->extents, inode->extent_cnt, idx);
+}
+
+/* Returns the disk sector that the CNT EXTENTS map sector IDX of
+   a file to, or -1 if they map it to none. */
+static block_sector_t
+lookup_extent (const struct extent *extents, size_t cnt, size_t idx)
+{
+  size_t lo = 0;
+  size_t hi = cnt;
+
+  /* Binary search for the extent that holds sector IDX. */
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct extent *e = &extents[mid];
+
+      if (idx < e->logical)
+        hi = mid;
+      else if (idx >= e->logical + e->length)
+        lo = mid + 1;
+      else
+        return e->start + (idx - e->logical);
+    }
+  return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, indexed by inode number, so that opening a
+   single inode twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open counts and states of its
+   inodes.  It is never held across disk I/O: an inode is entered
+   in the table before it is read in and stays there until it has
+   been written out, and those who find it in the middle of either
+   wait on open_inodes_changed. */
+static struct lock open_inodes_lock;
+static struct condition open_inodes_changed;
+
+/* Serializes passes that write back every open inode. */
+static struct lock writeback_lock;
+
+/* Largest number of inodes open at once. */
+static size_t max_open_inodes;
+
+/* Serializes allocating and freeing inode table slots. */
+static struct lock table_lock;
+
+/* Inode table sector that the last new inode went into, which is
+   tried first for the next one, or 0 if none.  Protected by
+   table_lock. */
+static block_sector_t table_hint;
+
+/* Number of inode table sectors allocated and released. */
+static unsigned long long table_allocs, table_releases;
+
+/* Compression statistics. */
+static unsigned long long chunks_compressed; /* Stored compressed. */
+static unsigned long long chunks_raw;   /* Stored as is. */
+static unsigned long long chunks_zero;  /* All zeros, stored as holes. */
+static unsigned long long chunks_decompressed; /* Read and decompressed. */
+static unsigned long long compress_in;  /* Bytes compressed. */
+static unsigned long long compress_out; /* Sectors' worth of output. */
+static int64_t compress_ticks;          /* Time spent compressing. */
+static int64_t decompress_ticks;        /* Time spent decompressing. */
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("can't create open inode table");
+  lock_init (&open_inodes_lock);
+  cond_init (&open_inodes_changed);
+  lock_init (&writeback_lock);
+  max_open_inodes = 0;
+  lock_init (&table_lock);
+  table_hint = 0;
+  compress_init ();
 }
 
-/* Initializes an inode with LENGTH bytes of data and
-   writes the new inode to sector SECTOR on the file system
-   device.
-   Returns true if successful.
-   Returns false if memory or disk allocation fails. */
-bool
-inode_create (block_sector_t sector, off_t length)
+/* Prints statistics about the open inode table. */
+void
+inode_print_stats (void)
 {
-  struct inode_disk *disk_inode = NULL;
-  bool success = false;
+  printf ("Inodes: %zu open in %zu buckets, at most %zu open\n",
+          hash_size (&open_inodes), open_inodes.bucket_cnt,
+          max_open_inodes);
+  printf ("Inode table: %llu sectors allocated, %llu released\n",
+          table_allocs, table_releases);
+  if (chunks_compressed + chunks_raw + chunks_zero + chunks_decompressed > 0)
+    {
+      unsigned long long in_kb = compress_in / 1024;
+      unsigned long long out_kb = compress_out / 1024;
 
-  ASSERT (length >= 0);
+      printf ("Compression: %llu chunks compressed, %llu stored raw, "
+              "%llu zero; %llu kB in %llu kB (%llu%%) in %lld ticks; "
+              "%llu chunks decompressed in %lld ticks\n",
+              chunks_compressed, chunks_raw, chunks_zero, in_kb, out_kb,
+              compress_in > 0 ? compress_out * 100 / compress_in : 0,
+              compress_ticks, chunks_decompressed, decompress_ticks);
+    }
+}
 
-  /* If this assertion fails, the inode structure is not exactly
-     one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+/* Allocates a free inode number and stores it in *INUMBERP.  The
+   new inode goes into the same inode table sector as inode NEAR,
+   usually its directory's, if that has a free slot, so that the
+   inodes of a directory's files are read together; failing that,
+   into the sector the last new inode went into; failing that,
+   into a new inode table sector allocated as close to NEAR's as
+   possible.  The slot is reserved but holds an empty inode until
+   inode_create() is called for it.  Returns true if successful,
+   false if the disk is full or memory is short. */
+bool
+inode_allocate (inumber_t near, inumber_t *inumberp)
+{
+  static uint8_t zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector;
+  bool success = true;
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
+  lock_acquire (&table_lock);
+  if (!claim_slot (inumber_sector (near), inumberp)
+      && (table_hint == 0 || !claim_slot (table_hint, inumberp)))
     {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start))
+      success = free_map_allocate_near (1, inumber_sector (near), &sector);
+      if (success)
         {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0)
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-
-              for (i = 0; i < sectors; i++)
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true;
+          cache_write_meta (sector, zeros);
+          table_allocs++;
+          table_hint = sector;
+          success = claim_slot (sector, inumberp);
         }
-      free (disk_inode);
     }
+  lock_release (&table_lock);
   return success;
 }
 
-/* Reads an inode from SECTOR
+/* Frees inode number INUMBER, which must not be open, so that
+   inode_allocate() can hand it out again.  Releases its inode
+   table sector in the free map if no inode is left in it. */
+void
+inode_release (inumber_t inumber)
+{
+  static struct inode_disk empty;
+  block_sector_t sector = inumber_sector (inumber);
+  struct inode_disk *table;
+  size_t i;
+
+  lock_acquire (&table_lock);
+  cache_write_meta_at (sector, &empty, inumber_ofs (inumber), sizeof empty);
+  table = malloc (BLOCK_SECTOR_SIZE);
+  if (table != NULL && sector != SYSTEM_INODE_SECTOR)
+    {
+      cache_read (sector, table);
+      for (i = 0; i < INODES_PER_SECTOR; i++)
+        if (table[i].magic == INODE_MAGIC)
+          break;
+      if (i == INODES_PER_SECTOR)
+        {
+          free_map_release (sector, 1);
+          table_releases++;
+          if (table_hint == sector)
+            table_hint = 0;
+        }
+    }
+  lock_release (&table_lock);
+  free (table);
+}
+
+/* Initializes an inode with LENGTH bytes of data and writes it
+   to the slot for INUMBER in the inode table, which must have
+   been reserved with inode_allocate() unless it is one of the
+   system inodes.  The data starts out as a single hole, which
+   reads as zeros, so no sector is allocated or written besides
+   the inode's own; data sectors are allocated as they are first
+   written.
+   A file no longer than INLINE_MAX bytes starts out with its
+   data in the inode.
+   The inode is a directory if IS_DIR is true.
+   Returns true if successful.
+   Returns false if memory allocation fails. */
+bool
+inode_create (inumber_t inumber, off_t length, bool is_dir)
+{
+  struct inode_disk *disk_inode = NULL;
+
+  ASSERT (length >= 0);
+
+  /* If this assertion fails, the inode structure does not pack
+     exactly into sectors, and you should fix that. */
+  ASSERT (sizeof *disk_inode * INODES_PER_SECTOR == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_block) == BLOCK_SECTOR_SIZE);
+
+  disk_inode = calloc (1, sizeof *disk_inode);
+  if (disk_inode == NULL)
+    return false;
+  disk_inode->length = length;
+  disk_inode->magic = INODE_MAGIC;
+  if (is_dir)
+    disk_inode->flags = INODE_DIR;
+  else if (length <= (off_t) INLINE_MAX)
+    disk_inode->flags = INODE_INLINE;
+  cache_write_meta_at (inumber_sector (inumber), disk_inode,
+                       inumber_ofs (inumber), sizeof *disk_inode);
+  free (disk_inode);
+  return true;
+}
+
+/* Reads inode INUMBER from the inode table
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *
-inode_open (block_sector_t sector)
+inode_open (inumber_t inumber)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
+  bool loaded, last;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
+  /* Check whether this inode is already open.  If it is being
+     read in, wait for that.  If it is being closed, wait for it
+     to be gone, and then read it in again. */
+  key.inumber = inumber;
+  lock_acquire (&open_inodes_lock);
+  while ((e = hash_find (&open_inodes, &key.elem)) != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
+      inode = hash_entry (e, struct inode, elem);
+      if (inode->state == INODE_CLOSING)
+        {
+          cond_wait (&open_inodes_changed, &open_inodes_lock);
+          continue;
+        }
+
+      inode->open_cnt++;
+      while (inode->state == INODE_LOADING)
+        cond_wait (&open_inodes_changed, &open_inodes_lock);
+      if (inode->state == INODE_FAILED)
         {
-          inode_reopen (inode);
-          return inode;
+          last = --inode->open_cnt == 0;
+          lock_release (&open_inodes_lock);
+          if (last)
+            free (inode);
+          return NULL;
         }
+      lock_release (&open_inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
-  inode->sector = sector;
+  /* Enter the inode in the table before reading it, so that
+     others who open it meanwhile wait for it to be read. */
+  inode->inumber = inumber;
   inode->open_cnt = 1;
+  inode->state = INODE_LOADING;
+  hash_insert (&open_inodes, &inode->elem);
+  if (hash_size (&open_inodes) > max_open_inodes)
+    max_open_inodes = hash_size (&open_inodes);
+  lock_release (&open_inodes_lock);
+
+  /* Initialize. */
+  inode->sector = inumber_sector (inumber);
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  lock_init (&inode->lock);
+  lock_init (&inode->rw_lock);
+  cond_init (&inode->rw_cond);
+  inode->readers = 0;
+  inode->writer = false;
+  inode->writers_waiting = 0;
+  inode->dirty = false;
+  inode->metadata = false;
+  inode->inline_data = NULL;
+  inode->extents = NULL;
+  list_init (&inode->delayed);
+  inode->delayed_cnt = 0;
+  inode->reserved = 0;
+  list_init (&inode->chunks);
+  inode->chunk_cnt = 0;
+  lock_init (&inode->chunk_lock);
+  inode->chunk_buf = NULL;
+  inode->chunk_buf_idx = SIZE_MAX;
+  loaded = inode_load (inode);
+
+  /* Let those waiting for the inode have it, or tell them that
+     it could not be read. */
+  lock_acquire (&open_inodes_lock);
+  if (loaded)
+    inode->state = INODE_OPEN;
+  else
+    {
+      inode->state = INODE_FAILED;
+      hash_delete (&open_inodes, &inode->elem);
+      inode->open_cnt--;
+    }
+  cond_broadcast (&open_inodes_changed, &open_inodes_lock);
+  last = inode->open_cnt == 0;
+  lock_release (&open_inodes_lock);
+
+  if (!loaded)
+    {
+      free (inode->extents);
+      free (inode->inline_data);
+      free (inode->chunk_buf);
+      if (last)
+        free (inode);
+      return NULL;
+    }
   return inode;
 }
 
+/* Looks up inode INUMBER without opening it, and stores its
+   length in *LENGTH and whether it is a directory in *IS_DIR.
+   If the inode is open, its in-memory state is used; otherwise,
+   only the inode itself is read, from its inode table sector.
+   Returns true if successful, false if memory allocation
+   fails. */
+bool
+inode_stat (inumber_t inumber, off_t *length, bool *is_dir)
+{
+  struct inode key;
+  struct hash_elem *e;
+  struct inode_disk *disk_inode;
+
+  /* An inode still being read in is no newer than the disk. */
+  key.inumber = inumber;
+  lock_acquire (&open_inodes_lock);
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
+    {
+      struct inode *inode = hash_entry (e, struct inode, elem);
+      if (inode->state == INODE_OPEN || inode->state == INODE_CLOSING)
+        {
+          *length = inode->length;
+          *is_dir = inode->is_dir;
+          lock_release (&open_inodes_lock);
+          return true;
+        }
+    }
+  lock_release (&open_inodes_lock);
+
+  disk_inode = malloc (sizeof *disk_inode);
+  if (disk_inode == NULL)
+    return false;
+  cache_read_at (inumber_sector (inumber), disk_inode,
+                 inumber_ofs (inumber), sizeof *disk_inode);
+  *length = disk_inode->length;
+  *is_dir = (disk_inode->flags & INODE_DIR) != 0;
+  free (disk_inode);
+  return true;
+}
+
 /* Reopens and returns INODE. */
 struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
 /* Returns INODE's inode number. */
-block_sector_t
+inumber_t
 inode_get_inumber (const struct inode *inode)
 {
-  return inode->sector;
+  return inode->inumber;
 }
 
-/* Closes INODE and writes it to disk. (Does it?  Check code.)
+/* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
    If INODE was also a removed inode, frees its blocks. */
 void
@@ -168,21 +684,266 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  if (--inode->open_cnt > 0)
+    {
+      lock_release (&open_inodes_lock);
+      return;
+    }
+
+  /* A removed inode leaves the table at once and its blocks are
+     freed.  Any other stays in the table, marked as closing, while
+     its delayed data is given a place on disk and written out, so
+     that anyone who opens it again waits and then reads it as it
+     is now.  If that fails, the inode stays open, with no openers,
+     so that its data is not lost and a later writeback pass tries
+     again. */
+  if (inode->removed)
+    {
+      hash_delete (&open_inodes, &inode->elem);
+      lock_release (&open_inodes_lock);
+      inode_deallocate (inode);
+      inode_release (inode->inumber);
+    }
+  else
+    {
+      bool success;
+
+      inode->state = INODE_CLOSING;
+      lock_release (&open_inodes_lock);
+      success = allocate_delayed (inode);
+
+      lock_acquire (&open_inodes_lock);
+      if (!success)
+        {
+          inode->state = INODE_OPEN;
+          cond_broadcast (&open_inodes_changed, &open_inodes_lock);
+          lock_release (&open_inodes_lock);
+          return;
+        }
+      hash_delete (&open_inodes, &inode->elem);
+      cond_broadcast (&open_inodes_changed, &open_inodes_lock);
+      lock_release (&open_inodes_lock);
+    }
+
+  while (!list_empty (&inode->delayed))
+    free (list_entry (list_pop_front (&inode->delayed),
+                      struct delayed_block, elem));
+  while (!list_empty (&inode->chunks))
+    free (list_entry (list_pop_front (&inode->chunks),
+                      struct dirty_chunk, elem));
+  if (inode->reserved > 0)
+    free_map_unreserve (inode->reserved);
+  free (inode->extents);
+  free (inode->inline_data);
+  free (inode->chunk_buf);
+  free (inode);
+}
+
+/* Returns true if INODE is a directory. */
+bool
+inode_is_dir (const struct inode *inode)
+{
+  return inode->is_dir;
+}
+
+/* Returns true if INODE has been deleted with inode_remove(). */
+bool
+inode_is_removed (const struct inode *inode)
+{
+  return inode->removed;
+}
+
+/* Returns the number of separate runs of disk sectors that
+   INODE's data is stored in, which is 1 for a file whose data
+   can be read without seeking, or 0 for one with no data on
+   disk. */
+size_t
+inode_fragments (struct inode *inode)
+{
+  size_t runs = 0;
+  size_t i;
+
+  lock_shared (inode);
+  for (i = 0; i < inode->extent_cnt; i++)
+    if (i == 0 || (inode->extents[i].start
+                   != inode->extents[i - 1].start
+                      + inode->extents[i - 1].length))
+      runs++;
+  unlock_shared (inode);
+  return runs;
+}
+
+/* Moves INODE's data into a single run of free sectors, in file
+   order, if it is stored in more than one run now.  Delayed data
+   is given its place on disk first.  The move is a journal
+   operation of its own, and the old sectors are released only
+   once it is committed, so that until then nothing else can be
+   written over the data that a crash would leave the inode
+   pointing to.  Must not be called within a journal operation.
+   Returns true if the data was moved, false if it did not need to
+   be, if INODE is a directory larger than DEFRAG_META_MAX
+   sectors, or if there is no free run long enough or memory is
+   short, in which case the data stays where it was. */
+bool
+inode_defragment (struct inode *inode)
+{
+  struct extent *extents = NULL, *old = NULL;
+  uint8_t *buffer = NULL;
+  block_sector_t start, sector;
+  size_t total, cnt, old_cnt = 0, i;
+
+  journal_begin ();
+  lock_exclusive (inode);
+  if (inode->removed || !allocate_delayed (inode))
+    goto done;
+
+  /* Count the sectors to move, and check whether they are in
+     more than one run. */
+  total = cnt = 0;
+  for (i = 0; i < inode->extent_cnt; i++)
+    {
+      const struct extent *e = &inode->extents[i];
+      if (i == 0 || e->start != e[-1].start + e[-1].length)
+        cnt++;
+      total += e->length;
+    }
+  if (cnt <= 1 || (inode->metadata && total > DEFRAG_META_MAX))
+    goto done;
+
+  extents = malloc (inode->extent_cnt * sizeof *extents);
+  buffer = malloc (DEFRAG_SECTORS * BLOCK_SECTOR_SIZE);
+  if (extents == NULL || buffer == NULL
+      || !free_map_allocate_near (total, extent_goal (inode, 0), &start))
+    goto done;
+
+  /* Copy the data.  Old sectors are written back first, so that
+     no dirty copy of them is left in the cache once they are
+     free. */
+  sector = start;
+  cnt = 0;
+  for (i = 0; i < inode->extent_cnt; i++)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      const struct extent *e = &inode->extents[i];
+      size_t done, n, j;
+
+      cache_sync (e->start, e->length);
+      for (done = 0; done < e->length; done += n)
+        {
+          n = e->length - done;
+          if (n > DEFRAG_SECTORS)
+            n = DEFRAG_SECTORS;
+          if (inode->metadata)
+            for (j = 0; j < n; j++)
+              {
+                cache_read (e->start + done + j, buffer);
+                cache_write_meta (sector + done + j, buffer);
+              }
+          else
+            {
+              cache_read_direct (e->start + done, buffer, n);
+              cache_write_direct (sector + done, buffer, n);
+            }
+        }
 
-      /* Deallocate blocks if removed. */
-      if (inode->removed)
+      /* The new extents are contiguous on disk, so only holes
+         keep them apart. */
+      if (cnt > 0 && (extents[cnt - 1].logical + extents[cnt - 1].length
+                      == e->logical))
+        extents[cnt - 1].length += e->length;
+      else
         {
-          free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length));
+          extents[cnt].logical = e->logical;
+          extents[cnt].start = sector;
+          extents[cnt].length = e->length;
+          cnt++;
         }
+      sector += e->length;
+    }
+
+  old = inode->extents;
+  old_cnt = inode->extent_cnt;
+  inode->extents = extents;
+  inode->extent_cap = inode->extent_cnt;
+  inode->extent_cnt = cnt;
+  extents = NULL;
+  inode->dirty = true;
+  if (!inode_store (inode, 0))
+    {
+      /* The inode on disk still points to the old sectors, so
+         keep them and give up the new run instead. */
+      extents = inode->extents;
+      inode->extents = old;
+      inode->extent_cnt = inode->extent_cap = old_cnt;
+      old = NULL;
+      free_map_release (start, total);
+    }
+
+ done:
+  unlock_exclusive (inode);
+  journal_end ();
+  free (extents);
+  free (buffer);
+  if (old == NULL)
+    return false;
+
+  /* The old sectors may be reused only once the new extents are
+     on disk. */
+  journal_commit ();
+  for (i = 0; i < old_cnt; i++)
+    free_map_release (old[i].start, old[i].length);
+  free (old);
+  return true;
+}
+
+/* Makes INODE store its data compressed from now on.  Only a
+   regular file that has no data on disk yet can be converted.
+   Returns true if successful, false otherwise. */
+bool
+inode_set_compressed (struct inode *inode)
+{
+  bool success = false;
 
-      free (inode);
+  lock_exclusive (inode);
+  if (inode->compressed)
+    success = true;
+  else if (!inode->is_dir && !inode->metadata && inode->extent_cnt == 0
+           && inode->delayed_cnt == 0 && inode->deny_write_cnt == 0)
+    {
+      inode->chunk_buf = malloc (CHUNK_SIZE);
+      if (inode->chunk_buf != NULL)
+        {
+          inode->compressed = true;
+          success = true;
+          if (inode->inline_data != NULL)
+            {
+              /* Carry the data over into the first chunk. */
+              if (inode->length > 0)
+                {
+                  struct dirty_chunk *c = get_chunk (inode, 0, true);
+                  if (c != NULL)
+                    memcpy (c->data, inode->inline_data, INLINE_MAX);
+                  else
+                    success = false;
+                }
+              if (success)
+                {
+                  free (inode->inline_data);
+                  inode->inline_data = NULL;
+                }
+            }
+          if (success)
+            inode->dirty = true;
+          else
+            {
+              inode->compressed = false;
+              free (inode->chunk_buf);
+              inode->chunk_buf = NULL;
+            }
+        }
     }
+  unlock_exclusive (inode);
+  return success;
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -196,18 +957,37 @@ inode_remove (struct inode *inode)
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
+   than SIZE if an error occurs or end of file is reached.
+   A large read transfers the whole sectors it covers directly
+   into BUFFER; only a partial sector at either end is copied
+   through the buffer cache. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  bool direct = size >= DIRECT_MIN && !inode->metadata;
 
+  lock_shared (inode);
+  if (inode->inline_data != NULL)
+    {
+      if (offset < inode->length)
+        {
+          bytes_read = size < inode->length - offset
+                       ? size : inode->length - offset;
+          memcpy (buffer, inode->inline_data + offset, bytes_read);
+        }
+      size = 0;
+    }
+  else if (inode->compressed)
+    {
+      bytes_read = read_compressed (inode, buffer, size, offset);
+      size = 0;
+    }
   while (size > 0)
     {
       /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -220,23 +1000,44 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (direct && sector_ofs == 0)
+        {
+          /* Whole sectors, as many in a row as are consecutive on
+             disk or are holes. */
+          off_t left = size < inode_left ? size : inode_left;
+          size_t cnt = sector_run (inode, offset / BLOCK_SECTOR_SIZE,
+                                   left / BLOCK_SECTOR_SIZE, &sector_idx);
+          if (cnt > 0)
+            {
+              off_t n = cnt * BLOCK_SECTOR_SIZE;
+              if (sector_idx != (block_sector_t) -1)
+                cache_read_direct (sector_idx, buffer + bytes_read, cnt);
+              else
+                memset (buffer + bytes_read, 0, n);
+              size -= n;
+              offset += n;
+              bytes_read += n;
+              continue;
+            }
+        }
+
+      sector_idx = byte_to_sector (inode, offset);
+      if (sector_idx != (block_sector_t) -1)
         {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
+          /* Copy the chunk out of the buffer cache. */
+          cache_read_at (sector_idx, buffer + bytes_read, sector_ofs,
+                         chunk_size);
         }
       else
         {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+          /* Not on disk: copy from the delayed block, if the
+             sector has been written, otherwise it is a hole. */
+          struct delayed_block *b
+            = get_delayed (inode, offset / BLOCK_SECTOR_SIZE, false);
+          if (b != NULL)
+            memcpy (buffer + bytes_read, b->data + sector_ofs, chunk_size);
+          else
+            memset (buffer + bytes_read, 0, chunk_size);
         }
 
       /* Advance. */
@@ -244,31 +1045,126 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  unlock_shared (inode);
 
   return bytes_read;
 }
 
+/* Asks for the sectors that hold the SIZE bytes of INODE
+   starting at OFFSET to be read into the cache in the
+   background.  Bytes past the end of INODE, or not yet on disk,
+   are ignored. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t end = offset + size;
+
+  lock_shared (inode);
+  if (end > inode_length (inode))
+    end = inode_length (inode);
+  for (offset -= offset % BLOCK_SECTOR_SIZE; offset < end;
+       offset += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, offset);
+      if (sector != (block_sector_t) -1)
+        cache_read_ahead (sector);
+    }
+  unlock_shared (inode);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if an error occurs.
+   A write past end of file extends the inode, leaving a hole
+   between the old end of file and OFFSET.  If the disk is too
+   full to hold the sectors written that are holes, nothing is
+   written.
+
+   Disk space for those sectors is only reserved here.  The data
+   is held in memory and allocated its sectors, all at once, when
+   it is flushed, so that a file written in many small pieces
+   still ends up in a few large extents.  A large write, though,
+   transfers the whole sectors it covers directly from BUFFER to
+   disk, allocating any that are holes at once.
+
+   Data kept in the inode is written there, and the inode with
+   it, as long as it fits.  A write that does not fit moves the
+   data out of the inode first.
+
+   A compressed file is written a chunk at a time, into memory;
+   the chunks are compressed when they are flushed. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset)
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  size_t new_sectors = 0;
+  size_t first = SIZE_MAX;
+  bool direct = size >= DIRECT_MIN && !inode->metadata;
+  bool exclusive;
+  off_t old_length;
 
+  /* Checked before waiting for the lock, too, so that a write to
+     a running executable fails at once instead of queuing behind
+     a page fault that is reading from it. */
   if (inode->deny_write_cnt)
     return 0;
+  if (inode->compressed)
+    return write_compressed (inode, buffer, size, offset);
+
+  /* Overwriting sectors that are already on disk changes only
+     their contents, which the buffer cache keeps consistent, so
+     a shared lock is enough. */
+  lock_shared (inode);
+  exclusive = (offset + size > inode->length
+               || inode->inline_data != NULL
+               || unbacked_sectors (inode, offset, size, true) > 0);
+  if (exclusive)
+    {
+      unlock_shared (inode);
+      lock_exclusive (inode);
+      if (inode->inline_data != NULL && !inode->deny_write_cnt)
+        {
+          if (offset + size <= (off_t) INLINE_MAX)
+            {
+              memcpy (inode->inline_data + offset, buffer, size);
+              if (offset + size > inode->length)
+                inode->length = offset + size;
+              inode_store (inode, 0);
+              unlock_exclusive (inode);
+              return size;
+            }
+          if (!uninline (inode))
+            {
+              unlock_exclusive (inode);
+              return 0;
+            }
+        }
+      new_sectors = unbacked_sectors (inode, offset, size, false);
+    }
+
+  if (inode->deny_write_cnt
+      || (new_sectors > 0 && !free_map_reserve (new_sectors)))
+    {
+      if (exclusive)
+        unlock_exclusive (inode);
+      else
+        unlock_shared (inode);
+      return 0;
+    }
+  inode->reserved += new_sectors;
+  old_length = inode->length;
+  if (offset + size > inode->length)
+    {
+      inode->length = offset + size;
+      inode->dirty = true;
+    }
 
   while (size > 0)
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -281,30 +1177,61 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (direct && sector_ofs == 0)
+        {
+          /* Whole sectors, as many in a row as are consecutive on
+             disk or are holes.  Only an exclusive holder may
+             allocate the holes. */
+          off_t left = size < inode_left ? size : inode_left;
+          size_t idx = offset / BLOCK_SECTOR_SIZE;
+          size_t cnt = sector_run (inode, idx, left / BLOCK_SECTOR_SIZE,
+                                   &sector_idx);
+          if (cnt > 0 && sector_idx != (block_sector_t) -1)
+            cache_write_direct (sector_idx, buffer + bytes_written, cnt);
+          else if (cnt > 0 && exclusive)
+            cnt = write_holes (inode, idx, cnt, buffer + bytes_written,
+                               &first);
+          else
+            cnt = 0;
+          if (cnt > 0)
+            {
+              off_t n = cnt * BLOCK_SECTOR_SIZE;
+              size -= n;
+              offset += n;
+              bytes_written += n;
+              continue;
+            }
+        }
+
+      sector_idx = byte_to_sector (inode, offset);
+
+      if (sector_idx != (block_sector_t) -1)
         {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
+          /* Copy the chunk into the buffer cache, which reads in
+             the rest of the sector first if the chunk does not
+             cover it. */
+          if (inode->metadata)
+            cache_write_meta_at (sector_idx, buffer + bytes_written,
+                                 sector_ofs, chunk_size);
+          else
+            cache_write_at (sector_idx, buffer + bytes_written, sector_ofs,
+                            chunk_size);
         }
       else
         {
-          /* We need a bounce buffer. */
-          if (bounce == NULL)
+          /* Copy the chunk into a delayed block. */
+          struct delayed_block *b
+            = get_delayed (inode, offset / BLOCK_SECTOR_SIZE, true);
+          if (b == NULL)
+            break;
+          memcpy (b->data + sector_ofs, buffer + bytes_written, chunk_size);
+          if (inode->delayed_cnt >= DELAYED_MAX && !allocate_delayed (inode))
             {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
+              /* Keep what was copied, but take no more until the
+                 delayed data can be written. */
+              bytes_written += chunk_size;
+              break;
             }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left)
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
         }
 
       /* Advance. */
@@ -312,18 +1239,311 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  if (exclusive)
+    {
+      /* A write that stopped short extends the file only as far
+         as it got. */
+      if (size > 0 && offset < inode->length && inode->length > old_length)
+        inode->length = offset > old_length ? offset : old_length;
+      if (first != SIZE_MAX)
+        inode_store (inode, first);
+      unlock_exclusive (inode);
+    }
+  else
+    unlock_shared (inode);
 
   return bytes_written;
 }
 
-/* Disables writes to INODE.
-   May be called at most once per inode opener. */
-void
-inode_deny_write (struct inode *inode)
+/* Allocates disk space for every sector of INODE that has been
+   written but does not have any yet, writes the delayed data
+   into the new sectors, and writes INODE's extents to disk.
+   Holes that were never written stay holes.  Sectors are
+   allocated in runs as long as the free map allows, placed where
+   they would be if the file had no holes when possible, so that
+   a file written in order simply grows.
+   Returns true if successful, false if the disk is full or
+   memory is short, in which case the delayed data stays in
+   memory. */
+bool
+inode_flush (struct inode *inode)
+{
+  bool success;
+
+  lock_exclusive (inode);
+  success = allocate_delayed (inode);
+  unlock_exclusive (inode);
+  return success;
+}
+
+/* Does the work of inode_flush() for INODE, which must be locked
+   exclusive or be known to nobody else.  Either all of the
+   delayed data gets its place on disk and INODE is stored, or
+   nothing changes: the sectors allocated are released, and the
+   data stays in memory, where its reservation still covers it. */
+static bool
+allocate_delayed (struct inode *inode)
+{
+  struct extent *saved = NULL;
+  size_t saved_cnt = inode->extent_cnt;
+  bool saved_dirty = inode->dirty;
+  size_t first = inode->extent_cnt;
+  struct list blocks, chunks;
+
+  if (list_empty (&inode->delayed) && list_empty (&inode->chunks))
+    return !inode->dirty || inode_store (inode, first);
+
+  /* Keep a copy of the extents, to put back on failure. */
+  if (saved_cnt > 0)
+    {
+      saved = malloc (saved_cnt * sizeof *saved);
+      if (saved == NULL)
+        return false;
+      memcpy (saved, inode->extents, saved_cnt * sizeof *saved);
+    }
+  list_init (&blocks);
+  list_init (&chunks);
+
+  if (inode->chunk_cnt > 0 && !write_chunks (inode, &chunks, &first))
+    goto fail;
+
+  while (!list_empty (&inode->delayed))
+    {
+      struct delayed_block *b;
+      struct list_elem *e;
+      block_sector_t start;
+      size_t idx, cnt, pos, i;
+
+      /* Delayed blocks are sorted, so the first run of sectors
+         to allocate starts at the front of the list. */
+      b = list_entry (list_front (&inode->delayed), struct delayed_block, elem);
+      idx = b->idx;
+      cnt = 1;
+      for (e = list_next (&b->elem); e != list_end (&inode->delayed);
+           e = list_next (e))
+        {
+          if (list_entry (e, struct delayed_block, elem)->idx != idx + cnt)
+            break;
+          cnt++;
+        }
+
+      cnt = free_map_allocate_run (cnt, extent_goal (inode, idx), &start);
+      if (cnt == 0)
+        goto fail;
+      if (!insert_extent (inode, idx, start, cnt, &pos))
+        {
+          free_map_release (start, cnt);
+          goto fail;
+        }
+      if (pos < first)
+        first = pos;
+
+      for (i = 0; i < cnt; i++)
+        {
+          b = list_entry (list_pop_front (&inode->delayed),
+                          struct delayed_block, elem);
+          if (inode->metadata)
+            cache_write_meta (start + i, b->data);
+          else
+            cache_write (start + i, b->data);
+          list_push_back (&blocks, &b->elem);
+        }
+    }
+
+  if (!inode_store (inode, first))
+    goto fail;
+
+  /* The data is on disk and INODE points to it, so the memory and
+     the reservations can go, and so can the sectors that rewritten
+     chunks had, once the new mapping commits. */
+  while (!list_empty (&chunks))
+    {
+      struct dirty_chunk *c = list_entry (list_pop_front (&chunks),
+                                          struct dirty_chunk, elem);
+      size_t logical = c->idx * CHUNK_SECTORS;
+      size_t i;
+
+      for (i = 0; i < CHUNK_SECTORS; i++)
+        {
+          block_sector_t sector = lookup_extent (saved, saved_cnt,
+                                                 logical + i);
+          if (sector != (block_sector_t) -1)
+            journal_release (sector, 1);
+        }
+      free (c);
+      inode->chunk_cnt--;
+      free_map_unreserve (CHUNK_SECTORS);
+      inode->reserved -= CHUNK_SECTORS;
+    }
+  while (!list_empty (&blocks))
+    {
+      free (list_entry (list_pop_front (&blocks), struct delayed_block, elem));
+      inode->delayed_cnt--;
+      free_map_unreserve (1);
+      inode->reserved--;
+    }
+  free (saved);
+  return true;
+
+ fail:
+  /* Nothing on disk points to the new sectors yet. */
+  while (!list_empty (&chunks))
+    {
+      struct dirty_chunk *c = list_entry (list_back (&chunks),
+                                          struct dirty_chunk, elem);
+      size_t i;
+
+      for (i = 0; i < CHUNK_SECTORS; i++)
+        {
+          block_sector_t sector = lookup_sector (inode,
+                                                 c->idx * CHUNK_SECTORS + i);
+          if (sector != (block_sector_t) -1)
+            free_map_release (sector, 1);
+        }
+      list_remove (&c->elem);
+      list_push_front (&inode->chunks, &c->elem);
+    }
+  while (!list_empty (&blocks))
+    {
+      struct delayed_block *b = list_entry (list_back (&blocks),
+                                            struct delayed_block, elem);
+      free_map_release (lookup_sector (inode, b->idx), 1);
+      list_remove (&b->elem);
+      list_push_front (&inode->delayed, &b->elem);
+    }
+  if (saved_cnt > 0)
+    memcpy (inode->extents, saved, saved_cnt * sizeof *saved);
+  inode->extent_cnt = saved_cnt;
+  inode->dirty = saved_dirty;
+  free (saved);
+  return false;
+}
+
+/* Writes INODE's data to disk, giving delayed data a place on
+   disk first, and commits the journal, so that the file's
+   contents and metadata survive a crash.  Returns true if
+   successful, false if the disk is full or memory is short. */
+bool
+inode_sync (struct inode *inode)
 {
-  inode->deny_write_cnt++;
-  ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  bool success = sync_data (inode);
+  journal_commit ();
+  return success;
+}
+
+/* Writes to disk the data of every open inode whose oldest
+   delayed data was created at timer tick CUTOFF or earlier.
+   Metadata is left to the journal. */
+void
+inode_writeback (int64_t cutoff)
+{
+  struct list list;
+
+  lock_acquire (&writeback_lock);
+  collect_open_inodes (&list, false, cutoff);
+  while (!list_empty (&list))
+    {
+      struct inode *inode = list_entry (list_pop_front (&list),
+                                        struct inode, flush_elem);
+      sync_data (inode);
+      inode_close (inode);
+    }
+  lock_release (&writeback_lock);
+}
+
+/* Allocates INODE's delayed data and then writes back all of
+   INODE's dirty cached data sectors.  Returns true if
+   successful, false if the delayed data could not be
+   allocated. */
+static bool
+sync_data (struct inode *inode)
+{
+  bool success;
+  size_t i;
+
+  lock_exclusive (inode);
+  success = allocate_delayed (inode);
+  for (i = 0; i < inode->extent_cnt; i++)
+    cache_sync (inode->extents[i].start, inode->extents[i].length);
+  unlock_exclusive (inode);
+  return success;
+}
+
+/* Adds to LIST, reopened, each open inode that is not removed
+   and, unless ALL is true, whose oldest delayed data was created
+   at timer tick CUTOFF or earlier.  The caller may then write them
+   out without holding open_inodes_lock, and must close each one
+   afterward.  writeback_lock must be held. */
+static void
+collect_open_inodes (struct list *list, bool all, int64_t cutoff)
+{
+  struct hash_iterator i;
+
+  ASSERT (lock_held_by_current_thread (&writeback_lock));
+
+  list_init (list);
+  lock_acquire (&open_inodes_lock);
+  hash_first (&i, &open_inodes);
+  while (hash_next (&i))
+    {
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+      if (inode->state == INODE_OPEN && !inode->removed
+          && (all || (inode->delayed_cnt + inode->chunk_cnt > 0
+                      && inode->delayed_since <= cutoff)))
+        {
+          inode->open_cnt++;
+          list_push_back (list, &inode->flush_elem);
+        }
+    }
+  lock_release (&open_inodes_lock);
+}
+
+/* Flushes every open inode, for use at shutdown. */
+void
+inode_flush_all (void)
+{
+  struct list list;
+
+  lock_acquire (&writeback_lock);
+  collect_open_inodes (&list, true, 0);
+  while (!list_empty (&list))
+    {
+      struct inode *inode = list_entry (list_pop_front (&list),
+                                        struct inode, flush_elem);
+      inode_flush (inode);
+      inode_close (inode);
+    }
+  lock_release (&writeback_lock);
+}
+
+/* Returns the number of openers of INODE. */
+static int
+open_count (struct inode *inode)
+{
+  int cnt;
+
+  lock_acquire (&open_inodes_lock);
+  cnt = inode->open_cnt;
+  lock_release (&open_inodes_lock);
+  return cnt;
+}
+
+/* Disables writes to INODE.
+   May be called at most once per inode opener. */
+void
+inode_deny_write (struct inode *inode)
+{
+  int cnt;
+
+  lock_exclusive (inode);
+  cnt = ++inode->deny_write_cnt;
+  unlock_exclusive (inode);
+
+  /* Checked only once INODE is unlocked, because open_count()
+     takes open_inodes_lock, which is not otherwise acquired while
+     an inode's reader/writer lock is held. */
+  ASSERT (cnt <= open_count (inode));
 }
 
 /* Re-enables writes to INODE.
@@ -332,14 +1552,1066 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode)
 {
+  int cnt;
+
+  lock_exclusive (inode);
   ASSERT (inode->deny_write_cnt > 0);
-  ASSERT (inode->deny_write_cnt <= inode->open_cnt);
-  inode->deny_write_cnt--;
+  cnt = inode->deny_write_cnt--;
+  unlock_exclusive (inode);
+  ASSERT (cnt <= open_count (inode));
+}
+
+/* Marks INODE's data as file system metadata, such as a
+   directory's entries, so that writes to it go through the
+   journal. */
+void
+inode_set_metadata (struct inode *inode)
+{
+  inode->metadata = true;
 }
 
 /* Returns the length, in bytes, of INODE's data. */
 off_t
 inode_length (const struct inode *inode)
 {
-  return inode->data.length;
+  return inode->length;
+}
+
+/* Acquires INODE's lock, which this module does not use itself,
+   so that the caller can make a sequence of reads and writes of
+   INODE atomic with respect to other users of the lock.
+   Directories use it to keep their entries consistent. */
+void
+inode_lock (struct inode *inode)
+{
+  lock_acquire (&inode->lock);
+}
+
+/* Releases INODE's lock. */
+void
+inode_unlock (struct inode *inode)
+{
+  lock_release (&inode->lock);
+}
+
+/* Returns a hash value for inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->inumber);
+}
+
+/* Returns true if inode A precedes inode B. */
+static bool
+inode_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct inode *a = hash_entry (a_, struct inode, elem);
+  const struct inode *b = hash_entry (b_, struct inode, elem);
+  return a->inumber < b->inumber;
+}
+
+/* Reader/writer lock. */
+
+/* Acquires INODE's reader/writer lock for reading.  Waits while
+   a writer holds the lock or is waiting for it, so that a steady
+   stream of readers cannot starve writers. */
+static void
+lock_shared (struct inode *inode)
+{
+  lock_acquire (&inode->rw_lock);
+  while (inode->writer || inode->writers_waiting > 0)
+    cond_wait (&inode->rw_cond, &inode->rw_lock);
+  inode->readers++;
+  lock_release (&inode->rw_lock);
+}
+
+/* Releases INODE's reader/writer lock, held for reading. */
+static void
+unlock_shared (struct inode *inode)
+{
+  lock_acquire (&inode->rw_lock);
+  ASSERT (inode->readers > 0);
+  if (--inode->readers == 0)
+    cond_broadcast (&inode->rw_cond, &inode->rw_lock);
+  lock_release (&inode->rw_lock);
+}
+
+/* Acquires INODE's reader/writer lock for writing. */
+static void
+lock_exclusive (struct inode *inode)
+{
+  lock_acquire (&inode->rw_lock);
+  inode->writers_waiting++;
+  while (inode->writer || inode->readers > 0)
+    cond_wait (&inode->rw_cond, &inode->rw_lock);
+  inode->writers_waiting--;
+  inode->writer = true;
+  lock_release (&inode->rw_lock);
+}
+
+/* Releases INODE's reader/writer lock, held for writing. */
+static void
+unlock_exclusive (struct inode *inode)
+{
+  lock_acquire (&inode->rw_lock);
+  ASSERT (inode->writer);
+  inode->writer = false;
+  cond_broadcast (&inode->rw_cond, &inode->rw_lock);
+  lock_release (&inode->rw_lock);
+}
+
+/* Extents. */
+
+/* Reads INODE's length, type and extents from the inode table
+   and its extent blocks.  A directory's data is metadata.  Returns true
+   if successful, false if memory allocation fails. */
+static bool
+inode_load (struct inode *inode)
+{
+  struct inode_disk *disk_inode;
+  size_t cnt, b;
+
+  disk_inode = malloc (sizeof *disk_inode);
+  if (disk_inode == NULL)
+    return false;
+  cache_read_at (inode->sector, disk_inode, inumber_ofs (inode->inumber),
+                 sizeof *disk_inode);
+
+  inode->length = disk_inode->length;
+  inode->is_dir = (disk_inode->flags & INODE_DIR) != 0;
+  if (inode->is_dir)
+    inode->metadata = true;
+  inode->compressed = (disk_inode->flags & INODE_COMPRESSED) != 0;
+  if (inode->compressed)
+    {
+      inode->chunk_buf = malloc (CHUNK_SIZE);
+      if (inode->chunk_buf == NULL)
+        {
+          free (disk_inode);
+          return false;
+        }
+    }
+  inode->inline_data = NULL;
+  if (disk_inode->flags & INODE_INLINE)
+    {
+      inode->inline_data = malloc (INLINE_MAX);
+      if (inode->inline_data == NULL)
+        {
+          free (disk_inode);
+          return false;
+        }
+      memcpy (inode->inline_data, disk_inode->data, INLINE_MAX);
+    }
+  inode->extent_cnt = disk_inode->extent_cnt;
+  inode->extent_cap = disk_inode->extent_cnt;
+  inode->extent_index = disk_inode->extent_index;
+  inode->extents = NULL;
+  if (inode->extent_cnt > 0)
+    {
+      inode->extents = malloc (inode->extent_cnt * sizeof *inode->extents);
+      if (inode->extents == NULL)
+        {
+          free (disk_inode);
+          return false;
+        }
+    }
+
+  cnt = inode->extent_cnt < INODE_EXTENTS ? inode->extent_cnt : INODE_EXTENTS;
+  memcpy (inode->extents, disk_inode->extents, cnt * sizeof *inode->extents);
+  free (disk_inode);
+
+  for (b = 0; cnt < inode->extent_cnt; b++)
+    {
+      size_t n = inode->extent_cnt - cnt;
+      if (n > BLOCK_EXTENTS)
+        n = BLOCK_EXTENTS;
+      cache_read_at (read_ptr (inode->extent_index, b), inode->extents + cnt,
+                     0, n * sizeof *inode->extents);
+      cnt += n;
+    }
+  return true;
+}
+
+/* Writes INODE's length and extents to disk, allocating extent
+   blocks and the extent index as needed and releasing those no
+   longer needed.  Extents before index FIRST are assumed not to
+   have changed since they were last written, so extent blocks
+   that hold only such extents are not rewritten.  Returns true
+   if successful, false if the disk is full or memory is short,
+   in which case INODE on disk is left as it was. */
+static bool
+inode_store (struct inode *inode, size_t first)
+{
+  struct inode_disk *disk_inode;
+  struct extent_block *block;
+  bool new_index = false;
+  size_t block_cnt, old_cnt, cnt, b;
+
+  block_cnt = (inode->extent_cnt > INODE_EXTENTS
+               ? DIV_ROUND_UP (inode->extent_cnt - INODE_EXTENTS,
+                               BLOCK_EXTENTS)
+               : 0);
+  ASSERT (block_cnt <= PTRS_PER_SECTOR);
+
+  disk_inode = calloc (1, sizeof *disk_inode);
+  block = malloc (sizeof *block);
+  if (disk_inode == NULL || block == NULL)
+    goto fail;
+
+  /* Allocate the extent index and any extent blocks it lacks
+     before writing anything else.  The extent blocks in use are
+     always the first entries in the index. */
+  if (block_cnt > 0 && inode->extent_index == 0)
+    {
+      static block_sector_t zeros[PTRS_PER_SECTOR];
+      if (!free_map_allocate_near (1, inode->sector, &inode->extent_index))
+        goto fail;
+      cache_write_meta (inode->extent_index, zeros);
+      new_index = true;
+    }
+  for (old_cnt = 0; old_cnt < block_cnt; old_cnt++)
+    if (read_ptr (inode->extent_index, old_cnt) == 0)
+      break;
+  for (b = old_cnt; b < block_cnt; b++)
+    {
+      block_sector_t sector;
+      if (!free_map_allocate_near (1, inode->sector, &sector))
+        {
+          while (b-- > old_cnt)
+            {
+              free_map_release (read_ptr (inode->extent_index, b), 1);
+              write_ptr (inode->extent_index, b, 0);
+            }
+          if (new_index)
+            {
+              free_map_release (inode->extent_index, 1);
+              inode->extent_index = 0;
+            }
+          goto fail;
+        }
+      write_ptr (inode->extent_index, b, sector);
+    }
+
+  /* Extent blocks. */
+  for (b = 0; b < block_cnt; b++)
+    {
+      size_t lo = INODE_EXTENTS + b * BLOCK_EXTENTS;
+
+      if (b < old_cnt && lo + BLOCK_EXTENTS <= first)
+        continue;
+      memset (block, 0, sizeof *block);
+      cnt = inode->extent_cnt - lo;
+      if (cnt > BLOCK_EXTENTS)
+        cnt = BLOCK_EXTENTS;
+      memcpy (block->extents, inode->extents + lo, cnt * sizeof *block->extents);
+      cache_write_meta (read_ptr (inode->extent_index, b), block);
+    }
+  free (block);
+
+  /* Release extent blocks that are no longer needed. */
+  if (inode->extent_index != 0)
+    {
+      for (b = block_cnt; b < PTRS_PER_SECTOR; b++)
+        {
+          block_sector_t sector = read_ptr (inode->extent_index, b);
+          if (sector == 0)
+            break;
+          free_map_release (sector, 1);
+          write_ptr (inode->extent_index, b, 0);
+        }
+      if (block_cnt == 0)
+        {
+          free_map_release (inode->extent_index, 1);
+          inode->extent_index = 0;
+        }
+    }
+
+  /* The inode itself. */
+  disk_inode->length = inode->length;
+  disk_inode->magic = INODE_MAGIC;
+  disk_inode->flags = inode->is_dir ? INODE_DIR : 0;
+  if (inode->compressed)
+    disk_inode->flags |= INODE_COMPRESSED;
+  disk_inode->extent_cnt = inode->extent_cnt;
+  disk_inode->extent_index = inode->extent_index;
+  if (inode->inline_data != NULL)
+    {
+      disk_inode->flags |= INODE_INLINE;
+      memcpy (disk_inode->data, inode->inline_data, INLINE_MAX);
+    }
+  else
+    {
+      cnt = (inode->extent_cnt < INODE_EXTENTS
+             ? inode->extent_cnt : INODE_EXTENTS);
+      memcpy (disk_inode->extents, inode->extents,
+              cnt * sizeof *disk_inode->extents);
+    }
+  cache_write_meta_at (inode->sector, disk_inode,
+                       inumber_ofs (inode->inumber), sizeof *disk_inode);
+  free (disk_inode);
+
+  inode->dirty = false;
+  return true;
+
+ fail:
+  free (disk_inode);
+  free (block);
+  return false;
+}
+
+/* Releases every data and extent sector of INODE. */
+static void
+inode_deallocate (struct inode *inode)
+{
+  size_t i;
+
+  for (i = 0; i < inode->extent_cnt; i++)
+    free_map_release (inode->extents[i].start, inode->extents[i].length);
+  if (inode->extent_index != 0)
+    {
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        {
+          block_sector_t sector = read_ptr (inode->extent_index, i);
+          if (sector == 0)
+            break;
+          free_map_release (sector, 1);
+        }
+      free_map_release (inode->extent_index, 1);
+    }
+}
+
+/* Reserves the first free slot in inode table SECTOR, if any, by
+   writing an empty inode to it, and stores its inode number in
+   *INUMBERP.  Returns true if successful, false if the sector
+   has no free slot or memory is short.  The caller must hold
+   table_lock. */
+static bool
+claim_slot (block_sector_t sector, inumber_t *inumberp)
+{
+  struct inode_disk *table;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&table_lock));
+
+  table = malloc (BLOCK_SECTOR_SIZE);
+  if (table == NULL)
+    return false;
+  cache_read (sector, table);
+  for (i = 0; i < INODES_PER_SECTOR; i++)
+    if (table[i].magic != INODE_MAGIC)
+      {
+        memset (&table[i], 0, sizeof table[i]);
+        table[i].magic = INODE_MAGIC;
+        *inumberp = sector * INODES_PER_SECTOR + i;
+        cache_write_meta_at (sector, &table[i], inumber_ofs (*inumberp),
+                             sizeof table[i]);
+        break;
+      }
+  free (table);
+  return i < INODES_PER_SECTOR;
+}
+
+/* Moves the data that INODE keeps in the inode into a delayed
+   block for its first sector, from which it is written to a
+   sector of its own like any other data.  INODE must be locked
+   exclusive.  Returns true if successful, false if the disk is
+   full or memory is short. */
+static bool
+uninline (struct inode *inode)
+{
+  struct delayed_block *b;
+
+  ASSERT (inode->inline_data != NULL);
+
+  if (inode->length > 0)
+    {
+      if (!free_map_reserve (1))
+        return false;
+      b = get_delayed (inode, 0, true);
+      if (b == NULL)
+        {
+          free_map_unreserve (1);
+          return false;
+        }
+      inode->reserved++;
+      memcpy (b->data, inode->inline_data, INLINE_MAX);
+    }
+  free (inode->inline_data);
+  inode->inline_data = NULL;
+  inode->dirty = true;
+  return true;
+}
+
+/* Returns the number of sectors among those holding the SIZE
+   bytes of INODE starting at OFFSET, including any past the end
+   of file, that have no disk space allocated.  Sectors that
+   already have a delayed block are counted only if
+   INCLUDE_DELAYED is true.
+
+   Walks the extents and the delayed blocks that overlap the
+   range once each, instead of looking up every sector, so that
+   a large write does not cost a search per sector. */
+static size_t
+unbacked_sectors (struct inode *inode, off_t offset, off_t size,
+                  bool include_delayed)
+{
+  size_t idx = offset / BLOCK_SECTOR_SIZE;
+  size_t end = bytes_to_sectors (offset + size);
+  size_t limit = bytes_to_sectors (inode->length);
+  size_t lo = 0, hi = inode->extent_cnt;
+  size_t pos, cnt = 0;
+  struct list_elem *e;
+
+  /* Sectors past the end of file count even if an extent maps
+     them. */
+  if (limit > end)
+    limit = end;
+  if (limit < idx)
+    limit = idx;
+  cnt += end - limit;
+
+  /* Binary search for the first extent that ends after IDX, then
+     add up the holes between it and its successors. */
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct extent *x = &inode->extents[mid];
+      if (x->logical + x->length <= idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  for (pos = idx; lo < inode->extent_cnt && pos < limit; lo++)
+    {
+      const struct extent *x = &inode->extents[lo];
+      if (x->logical >= limit)
+        break;
+      if (x->logical > pos)
+        cnt += x->logical - pos;
+      pos = x->logical + x->length;
+    }
+  if (pos < limit)
+    cnt += limit - pos;
+
+  /* Delayed blocks never have disk space, so each one in the
+     range was counted above.  Search from the back, since files
+     are mostly written in order. */
+  if (!include_delayed)
+    for (e = list_rbegin (&inode->delayed); e != list_rend (&inode->delayed);
+         e = list_prev (e))
+      {
+        struct delayed_block *b = list_entry (e, struct delayed_block, elem);
+        if (b->idx < idx)
+          break;
+        if (b->idx < end)
+          cnt--;
+      }
+  return cnt;
+}
+
+/* Returns the disk sector at which to try to allocate sector IDX
+   of INODE: where it would be if the file had no holes, judging
+   by the closest extent before IDX, or by the inode itself if
+   there is none. */
+static block_sector_t
+extent_goal (const struct inode *inode, size_t idx)
+{
+  size_t lo = 0, hi = inode->extent_cnt;
+
+  /* Binary search for the number of extents that start before
+     IDX. */
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (inode->extents[mid].logical < idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo == 0)
+    return inode->sector + 1 + idx;
+  else
+    {
+      const struct extent *e = &inode->extents[lo - 1];
+      return e->start + (idx - e->logical);
+    }
+}
+
+/* Maps the CNT sectors of INODE starting at sector LOGICAL, all
+   of which are holes, to the disk sectors starting at START,
+   merging them into the neighboring extents where they are
+   contiguous both in the file and on disk.  Stores into *POSP
+   the index of the first extent that changed.  Returns true if
+   successful, false if INODE has too many extents or memory is
+   short. */
+static bool
+insert_extent (struct inode *inode, size_t logical, block_sector_t start,
+               size_t cnt, size_t *posp)
+{
+  struct extent *prev, *next, *e;
+  size_t lo = 0, hi = inode->extent_cnt;
+
+  /* Binary search for the position of the new extent. */
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (inode->extents[mid].logical < logical)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  prev = lo > 0 ? &inode->extents[lo - 1] : NULL;
+  next = lo < inode->extent_cnt ? &inode->extents[lo] : NULL;
+  ASSERT (prev == NULL || prev->logical + prev->length <= logical);
+  ASSERT (next == NULL || logical + cnt <= next->logical);
+
+  inode->dirty = true;
+  if (prev != NULL && prev->logical + prev->length == logical
+      && prev->start + prev->length == start)
+    {
+      /* Extend PREV, and join it to NEXT if the new sectors fill
+         the hole between them exactly. */
+      prev->length += cnt;
+      if (next != NULL && logical + cnt == next->logical
+          && start + cnt == next->start)
+        {
+          prev->length += next->length;
+          memmove (next, next + 1,
+                   (inode->extent_cnt - lo - 1) * sizeof *next);
+          inode->extent_cnt--;
+        }
+      *posp = lo - 1;
+      return true;
+    }
+  if (next != NULL && logical + cnt == next->logical
+      && start + cnt == next->start)
+    {
+      /* Extend NEXT backward. */
+      next->logical = logical;
+      next->start = start;
+      next->length += cnt;
+      *posp = lo;
+      return true;
+    }
+
+  if (!grow_extents (inode, 1))
+    return false;
+
+  e = &inode->extents[lo];
+  memmove (e + 1, e, (inode->extent_cnt - lo) * sizeof *e);
+  inode->extent_cnt++;
+  e->logical = logical;
+  e->start = start;
+  e->length = cnt;
+  *posp = lo;
+  return true;
+}
+
+/* Makes sure that INODE has room for CNT more extents.  Returns
+   true if successful, false if INODE would have too many extents
+   or memory is short. */
+static bool
+grow_extents (struct inode *inode, size_t cnt)
+{
+  if (inode->extent_cnt + cnt > MAX_EXTENTS)
+    return false;
+  if (inode->extent_cnt + cnt > inode->extent_cap)
+    {
+      size_t new_cap = inode->extent_cap > 0 ? inode->extent_cap * 2 : 4;
+      struct extent *new_extents;
+
+      while (new_cap < inode->extent_cnt + cnt)
+        new_cap *= 2;
+      new_extents = realloc (inode->extents, new_cap * sizeof *new_extents);
+      if (new_extents == NULL)
+        return false;
+      inode->extents = new_extents;
+      inode->extent_cap = new_cap;
+    }
+  return true;
+}
+
+/* Turns the CNT sectors of INODE starting at sector LOGICAL into
+   holes.  Their disk space is not released: the inode on disk
+   still points to it, so that is left to the caller.  Lowers
+   *FIRSTP to the index of the first extent changed.  Returns true if
+   successful, false if an extent would have to be split and
+   INODE has too many extents or memory is short, in which case
+   nothing is changed. */
+static bool
+punch_extents (struct inode *inode, size_t logical, size_t cnt,
+               size_t *firstp)
+{
+  size_t end = logical + cnt;
+  size_t i;
+
+  for (i = 0; i < inode->extent_cnt && inode->extents[i].logical < end; )
+    {
+      struct extent *e = &inode->extents[i];
+      size_t e_end = e->logical + e->length;
+      size_t lo = e->logical > logical ? e->logical : logical;
+      size_t hi = e_end < end ? e_end : end;
+
+      if (e_end <= logical)
+        {
+          i++;
+          continue;
+        }
+
+      if (lo > e->logical && hi < e_end)
+        {
+          /* Split E around the hole. */
+          if (!grow_extents (inode, 1))
+            return false;
+          e = &inode->extents[i];
+          memmove (e + 2, e + 1, (inode->extent_cnt - i - 1) * sizeof *e);
+          inode->extent_cnt++;
+          e[1].logical = hi;
+          e[1].start = e->start + (hi - e->logical);
+          e[1].length = e_end - hi;
+        }
+      if (i < *firstp)
+        *firstp = i;
+      inode->dirty = true;
+
+      if (lo == e->logical && hi == e_end)
+        {
+          memmove (e, e + 1, (inode->extent_cnt - i - 1) * sizeof *e);
+          inode->extent_cnt--;
+        }
+      else if (lo == e->logical)
+        {
+          e->start += hi - e->logical;
+          e->length = e_end - hi;
+          e->logical = hi;
+          i++;
+        }
+      else
+        {
+          e->length = lo - e->logical;
+          i++;
+        }
+    }
+  return true;
+}
+
+/* Returns the number of sectors of chunk IDX of compressed file
+   INODE that are on disk.  A chunk at the end of the file may be
+   stored in more sectors than the file's length covers. */
+static size_t
+chunk_sectors (const struct inode *inode, size_t idx)
+{
+  size_t k;
+
+  for (k = 0; k < CHUNK_SECTORS; k++)
+    if (lookup_sector (inode, idx * CHUNK_SECTORS + k) == (block_sector_t) -1)
+      break;
+  return k;
+}
+
+/* Reads chunk IDX of compressed file INODE from disk into DATA,
+   CHUNK_SIZE bytes, decompressing it if necessary. */
+static void
+read_chunk (struct inode *inode, size_t idx, uint8_t *data)
+{
+  size_t k = chunk_sectors (inode, idx);
+  size_t first = idx * CHUNK_SECTORS;
+  size_t i;
+
+  if (k == 0)
+    memset (data, 0, CHUNK_SIZE);
+  else if (k == CHUNK_SECTORS)
+    for (i = 0; i < k; i++)
+      cache_read (lookup_sector (inode, first + i),
+                  data + i * BLOCK_SECTOR_SIZE);
+  else
+    {
+      uint8_t *packed = malloc (k * BLOCK_SECTOR_SIZE);
+      int64_t start;
+      bool ok = packed != NULL;
+
+      for (i = 0; ok && i < k; i++)
+        cache_read (lookup_sector (inode, first + i),
+                    packed + i * BLOCK_SECTOR_SIZE);
+      start = timer_ticks ();
+      if (ok)
+        ok = decompress_data (packed, k * BLOCK_SECTOR_SIZE, data,
+                              CHUNK_SIZE);
+      decompress_ticks += timer_elapsed (start);
+      chunks_decompressed++;
+      if (!ok)
+        memset (data, 0, CHUNK_SIZE);
+      free (packed);
+    }
+}
+
+/* Reads SIZE bytes from compressed file INODE, which must be
+   locked shared, into BUFFER, starting at OFFSET.  Returns the
+   number of bytes read. */
+static off_t
+read_compressed (struct inode *inode, uint8_t *buffer, off_t size,
+                 off_t offset)
+{
+  off_t bytes_read = 0;
+
+  while (size > 0 && offset < inode->length)
+    {
+      size_t idx = offset / CHUNK_SIZE;
+      off_t ofs = offset % CHUNK_SIZE;
+      off_t n = CHUNK_SIZE - ofs;
+      struct dirty_chunk *c;
+
+      if (n > size)
+        n = size;
+      if (n > inode->length - offset)
+        n = inode->length - offset;
+
+      c = get_chunk (inode, idx, false);
+      if (c != NULL)
+        memcpy (buffer + bytes_read, c->data + ofs, n);
+      else
+        {
+          /* Keep the chunk decompressed for the next read, which
+             is likely to be of the same chunk. */
+          lock_acquire (&inode->chunk_lock);
+          if (inode->chunk_buf_idx != idx)
+            {
+              read_chunk (inode, idx, inode->chunk_buf);
+              inode->chunk_buf_idx = idx;
+            }
+          memcpy (buffer + bytes_read, inode->chunk_buf + ofs, n);
+          lock_release (&inode->chunk_lock);
+        }
+
+      size -= n;
+      offset += n;
+      bytes_read += n;
+    }
+  return bytes_read;
+}
+
+/* Writes SIZE bytes from BUFFER into compressed file INODE,
+   starting at OFFSET, into dirty chunks.  Flushes them if there
+   are too many.  Returns the number of bytes written, which is
+   less than SIZE if the disk is full or memory is short. */
+static off_t
+write_compressed (struct inode *inode, const uint8_t *buffer, off_t size,
+                  off_t offset)
+{
+  off_t bytes_written = 0;
+
+  lock_exclusive (inode);
+  if (inode->deny_write_cnt)
+    size = 0;
+  while (size > 0)
+    {
+      size_t idx = offset / CHUNK_SIZE;
+      off_t ofs = offset % CHUNK_SIZE;
+      off_t n = CHUNK_SIZE - ofs < size ? CHUNK_SIZE - ofs : size;
+      struct dirty_chunk *c;
+
+      /* Take no more once there are too many dirty chunks that
+         cannot be written. */
+      if (inode->chunk_cnt >= CHUNKS_MAX && !allocate_delayed (inode))
+        break;
+      c = get_chunk (inode, idx, true);
+      if (c == NULL)
+        break;
+      memcpy (c->data + ofs, buffer + bytes_written, n);
+      size -= n;
+      offset += n;
+      bytes_written += n;
+      if (offset > inode->length)
+        {
+          inode->length = offset;
+          inode->dirty = true;
+        }
+    }
+  unlock_exclusive (inode);
+  return bytes_written;
+}
+
+/* Returns the dirty chunk for chunk IDX of compressed file
+   INODE.  If there is none, returns a null pointer, unless
+   CREATE is true, in which case one is made from the chunk's
+   current contents, with disk space reserved for it stored as
+   is.  Returns a null pointer in that case, too, if the disk is
+   full or memory is short. */
+static struct dirty_chunk *
+get_chunk (struct inode *inode, size_t idx, bool create)
+{
+  struct list_elem *e;
+  struct dirty_chunk *c;
+
+  for (e = list_rbegin (&inode->chunks); e != list_rend (&inode->chunks);
+       e = list_prev (e))
+    {
+      c = list_entry (e, struct dirty_chunk, elem);
+      if (c->idx == idx)
+        return c;
+      if (c->idx < idx)
+        break;
+    }
+
+  if (!create || !free_map_reserve (CHUNK_SECTORS))
+    return NULL;
+  c = malloc (sizeof *c);
+  if (c == NULL)
+    {
+      free_map_unreserve (CHUNK_SECTORS);
+      return NULL;
+    }
+  inode->reserved += CHUNK_SECTORS;
+  c->idx = idx;
+  read_chunk (inode, idx, c->data);
+  list_insert (list_next (e), &c->elem);
+  if (inode->chunk_cnt++ == 0)
+    inode->delayed_since = timer_ticks ();
+
+  /* The copy kept for reading goes stale once the chunk is
+     written back. */
+  if (inode->chunk_buf_idx == idx)
+    inode->chunk_buf_idx = SIZE_MAX;
+  return c;
+}
+
+/* Compresses each of INODE's dirty chunks, writes it to newly
+   allocated sectors, maps them in place of the sectors it had
+   before, which are not released, and moves it to WRITTEN.  INODE
+   must be locked exclusive or be known to nobody else.  Lowers
+   *FIRSTP to the index of the first extent changed.  Returns
+   true if successful, false if memory is short, in which case
+   the remaining chunks stay in INODE's list. */
+static bool
+write_chunks (struct inode *inode, struct list *written, size_t *firstp)
+{
+  uint8_t *packed = malloc (CHUNK_SIZE);
+  bool success = true;
+
+  if (packed == NULL)
+    return false;
+  while (!list_empty (&inode->chunks))
+    {
+      struct dirty_chunk *c = list_entry (list_front (&inode->chunks),
+                                          struct dirty_chunk, elem);
+      size_t logical = c->idx * CHUNK_SECTORS;
+      block_sector_t starts[CHUNK_SECTORS];
+      size_t lengths[CHUNK_SECTORS];
+      size_t runs = 0, k, done, i, pos;
+      const uint8_t *data;
+      int64_t start;
+      size_t n;
+
+      /* Compress the chunk, unless it is all zeros, in which case
+         it needs no disk space at all.  Store it as is if
+         compressing would not save a sector. */
+      for (i = 0; i < CHUNK_SIZE && c->data[i] == 0; i++)
+        continue;
+      if (i == CHUNK_SIZE)
+        {
+          k = 0;
+          data = NULL;
+        }
+      else
+        {
+          start = timer_ticks ();
+          n = compress_data (c->data, CHUNK_SIZE, packed,
+                             CHUNK_SIZE - BLOCK_SECTOR_SIZE);
+          compress_ticks += timer_elapsed (start);
+          compress_in += CHUNK_SIZE;
+          if (n > 0)
+            {
+              k = DIV_ROUND_UP (n, BLOCK_SECTOR_SIZE);
+              memset (packed + n, 0, k * BLOCK_SECTOR_SIZE - n);
+              data = packed;
+            }
+          else
+            {
+              k = CHUNK_SECTORS;
+              data = c->data;
+            }
+          compress_out += k * BLOCK_SECTOR_SIZE;
+        }
+
+      /* Allocate the new sectors.  The chunk's reservation covers
+         them. */
+      for (done = 0; done < k; done += lengths[runs++])
+        {
+          lengths[runs] = free_map_allocate_run (k - done,
+                                                 extent_goal (inode, logical),
+                                                 &starts[runs]);
+          if (lengths[runs] == 0)
+            break;
+        }
+      if (done < k || !grow_extents (inode, runs + 1)
+          || !punch_extents (inode, logical, CHUNK_SECTORS, firstp))
+        {
+          for (i = 0; i < runs; i++)
+            free_map_release (starts[i], lengths[i]);
+          success = false;
+          break;
+        }
+
+      /* Map and write them.  Room for the extents was made
+         above, so mapping them cannot fail. */
+      for (i = 0, done = 0; i < runs; done += lengths[i++])
+        {
+          size_t j;
+
+          if (!insert_extent (inode, logical + done, starts[i], lengths[i],
+                              &pos))
+            NOT_REACHED ();
+          if (pos < *firstp)
+            *firstp = pos;
+          for (j = 0; j < lengths[i]; j++)
+            cache_write (starts[i] + j,
+                         data + (done + j) * BLOCK_SECTOR_SIZE);
+        }
+      if (k == 0)
+        chunks_zero++;
+      else if (k == CHUNK_SECTORS)
+        chunks_raw++;
+      else
+        chunks_compressed++;
+
+      list_remove (&c->elem);
+      list_push_back (written, &c->elem);
+    }
+  free (packed);
+  return success;
+}
+
+/* Returns the delayed block for sector IDX of INODE, which must
+   not have been allocated on disk.  If the sector has not been
+   written yet, returns a null pointer, unless CREATE is true, in
+   which case a zeroed delayed block is created for it.  Returns
+   a null pointer in that case, too, if memory is short. */
+static struct delayed_block *
+get_delayed (struct inode *inode, size_t idx, bool create)
+{
+  struct list_elem *e;
+  struct delayed_block *b;
+
+  /* Search from the back, since files are mostly written in
+     order. */
+  for (e = list_rbegin (&inode->delayed); e != list_rend (&inode->delayed);
+       e = list_prev (e))
+    {
+      b = list_entry (e, struct delayed_block, elem);
+      if (b->idx == idx)
+        return b;
+      if (b->idx < idx)
+        break;
+    }
+
+  if (!create)
+    return NULL;
+  ASSERT (idx < bytes_to_sectors (inode->length));
+  b = calloc (1, sizeof *b);
+  if (b == NULL)
+    return NULL;
+  b->idx = idx;
+  list_insert (list_next (e), &b->elem);
+  if (inode->delayed_cnt++ == 0)
+    inode->delayed_since = timer_ticks ();
+  return b;
+}
+
+/* Returns the number of sectors of INODE, starting at sector IDX
+   and at most CNT of them, that can be transferred as one run.
+   If they are consecutive on disk, stores the first one's disk
+   sector into *SECTORP.  If they are holes without delayed
+   blocks, stores -1 into *SECTORP.  Returns 0 if sector IDX has
+   a delayed block. */
+static size_t
+sector_run (struct inode *inode, size_t idx, size_t cnt,
+            block_sector_t *sectorp)
+{
+  struct list_elem *e;
+  size_t lo = 0, hi = inode->extent_cnt;
+
+  /* Binary search for the first extent that ends after IDX. */
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct extent *x = &inode->extents[mid];
+      if (x->logical + x->length <= idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo < inode->extent_cnt && inode->extents[lo].logical <= idx)
+    {
+      const struct extent *x = &inode->extents[lo];
+      size_t left = x->logical + x->length - idx;
+      *sectorp = x->start + (idx - x->logical);
+      return cnt < left ? cnt : left;
+    }
+
+  /* A hole, up to the next extent or delayed block. */
+  if (lo < inode->extent_cnt && inode->extents[lo].logical - idx < cnt)
+    cnt = inode->extents[lo].logical - idx;
+  for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+       e = list_next (e))
+    {
+      struct delayed_block *b = list_entry (e, struct delayed_block, elem);
+      if (b->idx >= idx)
+        {
+          if (b->idx - idx < cnt)
+            cnt = b->idx - idx;
+          break;
+        }
+    }
+  *sectorp = -1;
+  return cnt;
+}
+
+/* Gives the CNT holes of INODE starting at sector IDX, none of
+   which has a delayed block, disk space at once and writes CNT
+   sectors of data from BUFFER straight to them.  Their space
+   must already be reserved.  Lowers *FIRSTP to the index of the
+   first extent changed.  Returns the number of sectors written,
+   which is less than CNT if the free space is fragmented, or 0
+   on failure. */
+static size_t
+write_holes (struct inode *inode, size_t idx, size_t cnt,
+             const uint8_t *buffer, size_t *firstp)
+{
+  block_sector_t start;
+  size_t pos;
+
+  cnt = free_map_allocate_run (cnt, extent_goal (inode, idx), &start);
+  if (cnt == 0)
+    return 0;
+  if (!insert_extent (inode, idx, start, cnt, &pos))
+    {
+      free_map_release (start, cnt);
+      return 0;
+    }
+  if (pos < *firstp)
+    *firstp = pos;
+  free_map_unreserve (cnt);
+  inode->reserved -= cnt;
+
+  cache_write_direct (start, buffer, cnt);
+  return cnt;
+}
+
+/* Returns entry IDX of the extent index SECTOR. */
+static block_sector_t
+read_ptr (block_sector_t sector, size_t idx)
+{
+  block_sector_t ptr;
+
+  cache_read_at (sector, &ptr, idx * sizeof ptr, sizeof ptr);
+  return ptr;
+}
+
+/* Sets entry IDX of the extent index SECTOR to PTR. */
+static void
+write_ptr (block_sector_t sector, size_t idx, block_sector_t ptr)
+{
+  cache_write_meta_at (sector, &ptr, idx * sizeof ptr, sizeof ptr);
 }
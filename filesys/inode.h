@@ -2,23 +2,45 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
 struct bitmap;
 
+/* Inode number. */
+typedef uint32_t inumber_t;
+
 void inode_init (void);
-bool inode_create (block_sector_t, off_t);
-struct inode *inode_open (block_sector_t);
+void inode_print_stats (void);
+bool inode_allocate (inumber_t near, inumber_t *);
+void inode_release (inumber_t);
+bool inode_create (inumber_t, off_t, bool is_dir);
+struct inode *inode_open (inumber_t);
+bool inode_stat (inumber_t, off_t *length, bool *is_dir);
 struct inode *inode_reopen (struct inode *);
-block_sector_t inode_get_inumber (const struct inode *);
+inumber_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+bool inode_is_dir (const struct inode *);
+bool inode_is_removed (const struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+void inode_read_ahead (struct inode *, off_t offset, off_t size);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+bool inode_flush (struct inode *);
+void inode_flush_all (void);
+bool inode_sync (struct inode *);
+void inode_writeback (int64_t cutoff);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+void inode_set_metadata (struct inode *);
+bool inode_set_compressed (struct inode *);
+size_t inode_fragments (struct inode *);
+bool inode_defragment (struct inode *);
+void inode_lock (struct inode *);
+void inode_unlock (struct inode *);
 block_sector_t byte_to_sector (const struct inode *inode, off_t pos);
 
 #endif /* filesys/inode.h */
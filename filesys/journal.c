@@ -0,0 +1,759 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Write-ahead journal for file system metadata.
+
+   Metadata sectors (inodes, extent blocks, directories and the
+   free map) are not written to their home locations as they
+   change.  Instead, each new version is handed to the journal,
+   which keeps a copy in memory and adds the sector to the
+   running transaction.  Committing a transaction writes all of
+   its sectors one after another into the log, followed by a
+   commit block, so that the metadata changes of many operations
+   reach the disk in one sequential write.  Checkpointing later
+   writes the logged sectors to their home locations, in sector
+   order, and empties the log.  After a crash, journal_open()
+   replays every committed transaction still in the log.
+
+   On disk, the journal is JOURNAL_SECTORS sectors starting at
+   JOURNAL_SECTOR: a header, then the log.  Each transaction in
+   the log is one or more descriptors, each followed by the data
+   of the sectors it lists, and then a commit block.  The header
+   names the sequence number of the first transaction in the
+   log.  Transactions are numbered consecutively, so replay stops
+   at the first sector that does not continue the sequence.
+
+   A sector that has been logged and is then written as file
+   data must not be overwritten by a stale copy from the log
+   when it is checkpointed or replayed.  journal_forget() drops
+   the copy and logs a revocation for the sector.  The revocation
+   counts only once its transaction commits, so the data must not
+   reach the sector before then: journal_sync_revoke() commits it
+   first if need be.
+
+   Disk space freed by an operation must not be reused until the
+   metadata that stops pointing to it has committed: written to
+   as file data in the meantime, it would be read through the old
+   metadata after a crash.  journal_release() holds such sectors
+   until then. */
+
+/* Identify journal sectors. */
+#define HEADER_MAGIC 0x4c4e524a         /* "JRNL". */
+#define DESC_MAGIC 0x4353454a           /* "JESC". */
+#define COMMIT_MAGIC 0x544d434a         /* "JCMT". */
+
+/* First sector of the log, and number of sectors in it. */
+#define LOG_START (JOURNAL_SECTOR + 1)
+#define LOG_SECTORS (JOURNAL_SECTORS - 1)
+
+/* Number of sectors listed in a descriptor. */
+#define DESC_ENTRIES 125
+
+/* Set in a descriptor entry for a revoked sector, which has no
+   data in the log. */
+#define REVOKED 0x80000000
+
+/* Log sectors taken by a transaction of at most JOURNAL_TXN_MAX
+   sectors. */
+#define TXN_FOOTPRINT \
+  (JOURNAL_TXN_MAX + DIV_ROUND_UP (JOURNAL_TXN_MAX, DESC_ENTRIES) + 1)
+
+/* Journal header.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    unsigned magic;                     /* HEADER_MAGIC. */
+    uint32_t seq;                       /* First transaction in log. */
+    uint32_t unused[126];               /* Not used. */
+  };
+
+/* Descriptor.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct descriptor
+  {
+    unsigned magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Transaction. */
+    uint32_t cnt;                       /* Number of entries used. */
+    block_sector_t sectors[DESC_ENTRIES]; /* Home sectors, in order. */
+  };
+
+/* Commit block.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct commit_block
+  {
+    unsigned magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Transaction. */
+    uint32_t unused[126];               /* Not used. */
+  };
+
+/* A metadata sector that has been handed to the journal and not
+   yet checkpointed. */
+struct jblock
+  {
+    struct hash_elem elem;              /* Element in blocks. */
+    struct list_elem txn_elem;          /* Element in running. */
+    block_sector_t sector;              /* Home sector. */
+    bool running;                       /* In the running transaction? */
+    bool logged;                        /* Some version is in the log? */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Latest contents. */
+  };
+
+/* A revocation in the running transaction. */
+struct revoke
+  {
+    struct list_elem elem;              /* Element in revokes. */
+    block_sector_t sector;              /* Revoked sector. */
+  };
+
+/* Sectors to return to the free map once the running transaction
+   has committed. */
+struct release
+  {
+    struct list_elem elem;              /* Element in a release list. */
+    block_sector_t start;               /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+  };
+
+static bool enabled;                    /* Between open and close? */
+static struct hash blocks;              /* All jblocks, by sector. */
+static struct list running;             /* Running transaction's jblocks. */
+static struct list revokes;             /* Running transaction's revokes. */
+static size_t running_cnt;              /* Length of RUNNING. */
+static size_t revoke_cnt;               /* Length of REVOKES. */
+static struct list releases;            /* Running transaction's releases. */
+static struct list committed;           /* Releases ready to be made. */
+static uint32_t seq;                    /* Running transaction's number. */
+static size_t log_head;                 /* Next log sector to write. */
+
+/* Operations in progress and commits waiting for them. */
+static int active_cnt;
+static int commits_waiting;
+
+/* Protects all of the above.  Held while the log is written and
+   while checkpointing. */
+static struct lock journal_lock;
+static struct condition journal_cond;   /* Signaled when ACTIVE_CNT
+                                           or COMMITS_WAITING drops. */
+
+/* Statistics. */
+static unsigned long long commit_cnt;   /* Transactions committed. */
+static unsigned long long logged_cnt;   /* Sectors written to the log. */
+static unsigned long long absorbed_cnt; /* Writes merged into a sector
+                                           already in the running
+                                           transaction. */
+static unsigned long long checkpoint_cnt; /* Checkpoints. */
+
+static void commit_running (void);
+static void release_committed (void);
+static void checkpoint (void);
+static void write_header (void);
+static struct jblock *lookup (block_sector_t);
+static hash_hash_func jblock_hash;
+static hash_less_func jblock_less;
+static hash_action_func jblock_free;
+
+/* Initializes the journal module. */
+void
+journal_init (void)
+{
+  if (!hash_init (&blocks, jblock_hash, jblock_less, NULL))
+    PANIC ("can't create journal table");
+  list_init (&running);
+  list_init (&revokes);
+  list_init (&releases);
+  list_init (&committed);
+  running_cnt = revoke_cnt = 0;
+  lock_init (&journal_lock);
+  cond_init (&journal_cond);
+  active_cnt = commits_waiting = 0;
+  commit_cnt = logged_cnt = absorbed_cnt = checkpoint_cnt = 0;
+  enabled = false;
+}
+
+/* Creates an empty journal on disk and starts using it. */
+void
+journal_create (void)
+{
+  static uint8_t zeros[BLOCK_SECTOR_SIZE];
+
+  ASSERT (sizeof (struct journal_header) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct descriptor) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct commit_block) == BLOCK_SECTOR_SIZE);
+
+  /* Clear the start of the log, in case the disk held another
+     journal whose sequence numbers happen to match. */
+  seq = 1;
+  log_head = 0;
+  block_write (fs_device, LOG_START, zeros);
+  write_header ();
+  enabled = true;
+}
+
+/* Reads the journal from disk, replays every transaction
+   committed to it, and starts using it. */
+void
+journal_open (void)
+{
+  struct journal_header *h;
+  struct descriptor *d;
+  block_sector_t *homes, *txn_homes;
+  size_t *srcs, *txn_srcs;
+  size_t cnt = 0, txn_cnt, pos = 0, replayed = 0, i, j;
+
+  h = malloc (sizeof *h);
+  d = malloc (sizeof *d);
+  homes = malloc (LOG_SECTORS * sizeof *homes);
+  srcs = malloc (LOG_SECTORS * sizeof *srcs);
+  txn_homes = malloc (LOG_SECTORS * sizeof *txn_homes);
+  txn_srcs = malloc (LOG_SECTORS * sizeof *txn_srcs);
+  if (h == NULL || d == NULL || homes == NULL || srcs == NULL
+      || txn_homes == NULL || txn_srcs == NULL)
+    PANIC ("can't allocate memory to replay journal");
+
+  block_read (fs_device, JOURNAL_SECTOR, h);
+  if (h->magic != HEADER_MAGIC)
+    PANIC ("journal header is corrupt");
+  seq = h->seq;
+
+  /* Find the committed transactions.  For each sector, HOMES and
+     SRCS end up with its home and the log sector that holds its
+     last committed version, unless it was revoked since. */
+  for (;;)
+    {
+      bool committed = false;
+
+      /* Read this transaction's descriptors, up to its commit
+         block. */
+      txn_cnt = 0;
+      i = pos;
+      while (i < LOG_SECTORS)
+        {
+          block_read (fs_device, LOG_START + i++, d);
+          if (d->seq != seq)
+            break;
+          if (d->magic == COMMIT_MAGIC)
+            {
+              committed = true;
+              break;
+            }
+          if (d->magic != DESC_MAGIC || d->cnt > DESC_ENTRIES)
+            break;
+          for (j = 0; j < d->cnt && txn_cnt < LOG_SECTORS; j++)
+            {
+              txn_homes[txn_cnt] = d->sectors[j];
+              txn_srcs[txn_cnt++] = (d->sectors[j] & REVOKED ? 0 : i++);
+            }
+        }
+      if (!committed)
+        break;
+
+      /* Merge them into the result. */
+      for (j = 0; j < txn_cnt; j++)
+        {
+          block_sector_t home = txn_homes[j] & ~REVOKED;
+          size_t k;
+
+          for (k = 0; k < cnt; k++)
+            if (homes[k] == home)
+              break;
+          if (txn_homes[j] & REVOKED)
+            {
+              if (k < cnt)
+                {
+                  homes[k] = homes[--cnt];
+                  srcs[k] = srcs[cnt];
+                }
+            }
+          else
+            {
+              homes[k] = home;
+              srcs[k] = txn_srcs[j];
+              if (k == cnt)
+                cnt++;
+            }
+        }
+      pos = i;
+      seq++;
+      replayed++;
+    }
+
+  /* Copy the sectors home. */
+  if (replayed > 0)
+    {
+      printf ("Replaying journal: %zu transactions, %zu sectors...",
+              replayed, cnt);
+      for (i = 0; i < cnt; i++)
+        {
+          block_read (fs_device, LOG_START + srcs[i], d);
+          block_write (fs_device, homes[i], d);
+        }
+      printf ("done.\n");
+    }
+
+  /* Start over with an empty log. */
+  log_head = 0;
+  write_header ();
+  enabled = true;
+
+  free (h);
+  free (d);
+  free (homes);
+  free (srcs);
+  free (txn_homes);
+  free (txn_srcs);
+}
+
+/* Commits and checkpoints everything in the journal and stops
+   using it. */
+void
+journal_close (void)
+{
+  journal_commit ();
+  lock_acquire (&journal_lock);
+  commit_running ();
+  checkpoint ();
+  enabled = false;
+  lock_release (&journal_lock);
+  release_committed ();
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats (void)
+{
+  printf ("Journal: %llu commits, %llu sectors logged, "
+          "%llu writes absorbed, %llu checkpoints\n",
+          commit_cnt, logged_cnt, absorbed_cnt, checkpoint_cnt);
+}
+
+/* Starts an operation whose metadata changes must reach the disk
+   together.  Waits for any commit that is waiting for operations
+   to finish, so that commits are not starved.  Operations must
+   not nest. */
+void
+journal_begin (void)
+{
+  lock_acquire (&journal_lock);
+  while (commits_waiting > 0)
+    cond_wait (&journal_cond, &journal_lock);
+  active_cnt++;
+  lock_release (&journal_lock);
+}
+
+/* Ends an operation started with journal_begin(). */
+void
+journal_end (void)
+{
+  lock_acquire (&journal_lock);
+  ASSERT (active_cnt > 0);
+  if (--active_cnt == 0)
+    cond_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Waits for the operations in progress to finish, brings the
+   free map file up to date, and commits the running
+   transaction.  Checkpoints, too, if the log is more than half
+   full.  Must not be called within an operation. */
+void
+journal_commit (void)
+{
+  lock_acquire (&journal_lock);
+  if (!enabled)
+    {
+      lock_release (&journal_lock);
+      return;
+    }
+  commits_waiting++;
+  while (active_cnt > 0)
+    cond_wait (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* With no operation in progress, the free map agrees with the
+     rest of the metadata, so log it in the same transaction. */
+  free_map_sync ();
+
+  lock_acquire (&journal_lock);
+  commit_running ();
+  if (log_head > LOG_SECTORS / 2)
+    checkpoint ();
+  if (--commits_waiting == 0)
+    cond_broadcast (&journal_cond, &journal_lock);
+  lock_release (&journal_lock);
+  release_committed ();
+}
+
+/* Adds the contents of metadata SECTOR, BLOCK_SECTOR_SIZE bytes
+   at DATA, to the running transaction.  Returns true if
+   successful.  Returns false if the journal is not in use or
+   memory is short, in which case the caller must write SECTOR to
+   disk itself.
+
+   If the running transaction grows too large, it is committed
+   at once, even if the operations in it have not finished, so an
+   operation that changes more than JOURNAL_TXN_MAX sectors may be only
+   partly committed at a crash. */
+bool
+journal_write (block_sector_t sector, const void *data)
+{
+  struct jblock *b;
+
+  lock_acquire (&journal_lock);
+  if (!enabled)
+    {
+      lock_release (&journal_lock);
+      return false;
+    }
+
+  b = lookup (sector);
+  if (b == NULL)
+    {
+      b = malloc (sizeof *b);
+      if (b == NULL)
+        {
+          lock_release (&journal_lock);
+          return false;
+        }
+      b->sector = sector;
+      b->running = false;
+      b->logged = false;
+      hash_insert (&blocks, &b->elem);
+    }
+  memcpy (b->data, data, BLOCK_SECTOR_SIZE);
+
+  if (b->running)
+    absorbed_cnt++;
+  else
+    {
+      b->running = true;
+      list_push_back (&running, &b->txn_elem);
+      running_cnt++;
+      if (running_cnt + revoke_cnt >= JOURNAL_TXN_MAX)
+        commit_running ();
+    }
+  lock_release (&journal_lock);
+  return true;
+}
+
+/* If the journal holds a version of SECTOR that has not been
+   checkpointed, copies it into DATA and returns true.
+   Otherwise, returns false, and SECTOR's home location is up to
+   date. */
+bool
+journal_read (block_sector_t sector, void *data)
+{
+  struct jblock *b;
+
+  lock_acquire (&journal_lock);
+  b = lookup (sector);
+  if (b != NULL)
+    memcpy (data, b->data, BLOCK_SECTOR_SIZE);
+  lock_release (&journal_lock);
+  return b != NULL;
+}
+
+/* Drops the journal's version of SECTOR, which is about to be
+   written as file data, so that neither checkpointing nor replay
+   overwrites the data with it.  Returns true if this logged a
+   revocation that is not yet committed, in which case the caller
+   must call journal_sync_revoke() before writing SECTOR. */
+bool
+journal_forget (block_sector_t sector)
+{
+  struct jblock *b;
+  bool pending = false;
+
+  lock_acquire (&journal_lock);
+  b = lookup (sector);
+  if (b != NULL)
+    {
+      hash_delete (&blocks, &b->elem);
+      if (b->running)
+        {
+          list_remove (&b->txn_elem);
+          running_cnt--;
+        }
+      if (b->logged)
+        {
+          struct revoke *r = malloc (sizeof *r);
+          if (r != NULL)
+            {
+              r->sector = sector;
+              list_push_back (&revokes, &r->elem);
+              if (++revoke_cnt + running_cnt >= JOURNAL_TXN_MAX)
+                commit_running ();
+              else
+                pending = true;
+            }
+          else
+            {
+              /* Without a revocation, the log must go. */
+              commit_running ();
+              checkpoint ();
+            }
+        }
+      free (b);
+    }
+  lock_release (&journal_lock);
+  return pending;
+}
+
+/* Makes sure that the revocation of SECTOR logged by
+   journal_forget() is on disk, committing the running
+   transaction if it is still there.  Until then, writing file
+   data to SECTOR is unsafe: after a crash, replay would copy the
+   stale metadata over it. */
+void
+journal_sync_revoke (block_sector_t sector)
+{
+  struct list_elem *e;
+
+  lock_acquire (&journal_lock);
+  for (e = list_begin (&revokes); e != list_end (&revokes);
+       e = list_next (e))
+    if (list_entry (e, struct revoke, elem)->sector == sector)
+      {
+        commit_running ();
+        break;
+      }
+  lock_release (&journal_lock);
+}
+
+/* Returns the CNT sectors starting at SECTOR to the free map
+   once the running transaction has committed, or at once if the
+   journal is not in use.  The metadata change that stopped using
+   them must already have been handed to the journal.  If memory
+   is short, commits the running transaction first instead. */
+void
+journal_release (block_sector_t sector, size_t cnt)
+{
+  lock_acquire (&journal_lock);
+  if (enabled)
+    {
+      struct release *r = malloc (sizeof *r);
+      if (r != NULL)
+        {
+          r->start = sector;
+          r->cnt = cnt;
+          list_push_back (&releases, &r->elem);
+          lock_release (&journal_lock);
+          return;
+        }
+      commit_running ();
+    }
+  lock_release (&journal_lock);
+  free_map_release (sector, cnt);
+}
+
+/* Returns to the free map the sectors of every release whose
+   transaction has committed.  The free map takes its own lock,
+   so the journal lock must not be held. */
+static void
+release_committed (void)
+{
+  struct list list;
+
+  list_init (&list);
+  lock_acquire (&journal_lock);
+  while (!list_empty (&committed))
+    list_push_back (&list, list_pop_front (&committed));
+  lock_release (&journal_lock);
+
+  while (!list_empty (&list))
+    {
+      struct release *r = list_entry (list_pop_front (&list),
+                                      struct release, elem);
+      free_map_release (r->start, r->cnt);
+      free (r);
+    }
+}
+
+/* Writes the running transaction to the log and starts a new
+   one.  Checkpoints afterward if the log no longer has room for
+   a full transaction.  The journal lock must be held. */
+static void
+commit_running (void)
+{
+  struct descriptor *d;
+  struct commit_block *c;
+  struct list_elem *re, *be;
+  size_t pos = log_head;
+
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+
+  /* Whatever the running transaction holds, it commits below, and
+     everything logged before it has committed already. */
+  while (!list_empty (&releases))
+    list_push_back (&committed, list_pop_front (&releases));
+  if (running_cnt + revoke_cnt == 0)
+    return;
+  ASSERT (LOG_SECTORS - log_head >= TXN_FOOTPRINT);
+
+  /* Descriptors, each followed by the sectors it lists.
+     Revocations come first, so that a sector revoked and then
+     logged again in the same transaction is replayed. */
+  d = malloc (sizeof *d);
+  if (d == NULL)
+    PANIC ("can't allocate memory to commit journal");
+  re = list_begin (&revokes);
+  be = list_begin (&running);
+  while (re != list_end (&revokes) || be != list_end (&running))
+    {
+      struct list_elem *first = be, *e;
+
+      memset (d, 0, sizeof *d);
+      d->magic = DESC_MAGIC;
+      d->seq = seq;
+      for (; d->cnt < DESC_ENTRIES && re != list_end (&revokes);
+           re = list_next (re))
+        d->sectors[d->cnt++]
+          = list_entry (re, struct revoke, elem)->sector | REVOKED;
+      for (; d->cnt < DESC_ENTRIES && be != list_end (&running);
+           be = list_next (be))
+        d->sectors[d->cnt++] = list_entry (be, struct jblock, txn_elem)->sector;
+      block_write (fs_device, LOG_START + pos++, d);
+
+      for (e = first; e != be; e = list_next (e))
+        block_write (fs_device, LOG_START + pos++,
+                     list_entry (e, struct jblock, txn_elem)->data);
+    }
+
+  /* Commit block.  The transaction counts once this is on
+     disk. */
+  c = (struct commit_block *) d;
+  memset (c, 0, sizeof *c);
+  c->magic = COMMIT_MAGIC;
+  c->seq = seq;
+  block_write (fs_device, LOG_START + pos++, c);
+  free (d);
+
+  while (!list_empty (&running))
+    {
+      struct jblock *b = list_entry (list_pop_front (&running),
+                                     struct jblock, txn_elem);
+      b->running = false;
+      b->logged = true;
+    }
+  while (!list_empty (&revokes))
+    free (list_entry (list_pop_front (&revokes), struct revoke, elem));
+  commit_cnt++;
+  logged_cnt += running_cnt;
+  running_cnt = revoke_cnt = 0;
+  seq++;
+  log_head = pos;
+
+  if (LOG_SECTORS - log_head < TXN_FOOTPRINT)
+    checkpoint ();
+}
+
+/* Compares the jblocks that A and B point to by sector. */
+static int
+compare_sectors (const void *a_, const void *b_)
+{
+  const struct jblock *a = *(struct jblock *const *) a_;
+  const struct jblock *b = *(struct jblock *const *) b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes every committed sector in the journal to its home
+   location, in sector order, and empties the log.  The journal
+   lock must be held, and the running transaction must be
+   empty. */
+static void
+checkpoint (void)
+{
+  struct jblock **array;
+  struct hash_iterator i;
+  size_t cnt = 0;
+
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+  ASSERT (running_cnt + revoke_cnt == 0);
+  if (log_head == 0)
+    return;
+
+  array = malloc (hash_size (&blocks) * sizeof *array);
+  hash_first (&i, &blocks);
+  while (hash_next (&i))
+    {
+      struct jblock *b = hash_entry (hash_cur (&i), struct jblock, elem);
+      if (array != NULL)
+        array[cnt++] = b;
+      else
+        block_write (fs_device, b->sector, b->data);
+    }
+  if (array != NULL)
+    {
+      size_t j;
+
+      qsort (array, cnt, sizeof *array, compare_sectors);
+      for (j = 0; j < cnt; j++)
+        block_write (fs_device, array[j]->sector, array[j]->data);
+      free (array);
+    }
+  hash_clear (&blocks, jblock_free);
+
+  /* Only now that every sector is home may the log be reused. */
+  log_head = 0;
+  write_header ();
+  checkpoint_cnt++;
+}
+
+/* Writes the journal header, naming SEQ as the first transaction
+   in the log. */
+static void
+write_header (void)
+{
+  struct journal_header *h = calloc (1, sizeof *h);
+  if (h == NULL)
+    PANIC ("can't allocate memory for journal header");
+  h->magic = HEADER_MAGIC;
+  h->seq = seq;
+  block_write (fs_device, JOURNAL_SECTOR, h);
+  free (h);
+}
+
+/* Returns the jblock for SECTOR, or a null pointer if there is
+   none.  The journal lock must be held. */
+static struct jblock *
+lookup (block_sector_t sector)
+{
+  struct jblock key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&blocks, &key.elem);
+  return e != NULL ? hash_entry (e, struct jblock, elem) : NULL;
+}
+
+/* Returns a hash value for jblock E. */
+static unsigned
+jblock_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct jblock, elem)->sector);
+}
+
+/* Returns true if jblock A precedes jblock B. */
+static bool
+jblock_less (const struct hash_elem *a, const struct hash_elem *b,
+             void *aux UNUSED)
+{
+  return (hash_entry (a, struct jblock, elem)->sector
+          < hash_entry (b, struct jblock, elem)->sector);
+}
+
+/* Frees jblock E. */
+static void
+jblock_free (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct jblock, elem));
+}
@@ -0,0 +1,30 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Number of sectors, revocations included, at which the running
+   transaction is committed without waiting for the operations in
+   it to finish.  Only an operation that changes fewer sectors is
+   sure to reach the disk all at once. */
+#define JOURNAL_TXN_MAX 64
+
+void journal_init (void);
+void journal_create (void);
+void journal_open (void);
+void journal_close (void);
+void journal_print_stats (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_commit (void);
+
+bool journal_write (block_sector_t, const void *);
+bool journal_read (block_sector_t, void *);
+bool journal_forget (block_sector_t);
+void journal_sync_revoke (block_sector_t);
+void journal_release (block_sector_t, size_t);
+
+#endif /* filesys/journal.h */
@@ -68,6 +68,32 @@ last_mask (const struct bitmap *b)
   int last_bits = b->bit_cnt % ELEM_BITS;
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
+
+/* Returns the index of the first bit in B at or after START,
+   and before END, that is set to VALUE, or END if there is
+   none.  Examines a whole element at a time. */
+static size_t
+next_bit (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  elem_type flip = value ? 0 : (elem_type) -1;
+  size_t idx;
+  elem_type bits;
+
+  if (start >= end)
+    return end;
+
+  idx = elem_idx (start);
+  bits = (b->bits[idx] ^ flip) & ((elem_type) -1 << (start % ELEM_BITS));
+  while (bits == 0)
+    {
+      idx++;
+      if (idx * ELEM_BITS >= end)
+        return end;
+      bits = b->bits[idx] ^ flip;
+    }
+  start = idx * ELEM_BITS + __builtin_ctzl (bits);
+  return start < end ? start : end;
+}
 
 /* Creation and destruction. */
 
@@ -250,16 +276,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return next_bit (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -298,13 +319,43 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  return bitmap_scan_range (b, start, b->bit_cnt, cnt, value);
+}
+
+/* Finds and returns the starting index of the first group of CNT
+   consecutive bits in B that are all set to VALUE and that
+   starts at or after START and before END.  The group itself
+   may extend past END.
+   If there is no such group, returns BITMAP_ERROR.
+   If CNT is zero, returns START.
+   Skips over whole elements that cannot start a group, so that
+   sparse or full bitmaps are searched quickly. */
+size_t
+bitmap_scan_range (const struct bitmap *b, size_t start, size_t end,
+                   size_t cnt, bool value)
+{
+  ASSERT (b != NULL);
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (end <= b->bit_cnt);
+
+  if (cnt == 0)
+    return start;
+  if (cnt > b->bit_cnt)
+    return BITMAP_ERROR;
+  if (end > b->bit_cnt - cnt + 1)
+    end = b->bit_cnt - cnt + 1;
+
+  while (start < end)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t run_end;
+
+      start = next_bit (b, start, end, value);
+      if (start >= end)
+        break;
+      run_end = next_bit (b, start, start + cnt, !value);
+      if (run_end == start + cnt)
+        return start;
+      start = run_end;
     }
   return BITMAP_ERROR;
 }
@@ -358,6 +409,26 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the SIZE bytes of B's representation in a file that
+   start at byte offset OFS to the same place in FILE, so that
+   a file written by bitmap_write() can be brought up to date
+   without rewriting the parts that did not change.  Bytes past
+   the end of B's representation are not written.  Returns true
+   if successful, false otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file,
+                   size_t ofs, size_t size)
+{
+  size_t file_size = byte_cnt (b->bit_cnt);
+
+  if (ofs >= file_size)
+    return true;
+  if (size > file_size - ofs)
+    size = file_size - ofs;
+  return (file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+          == (off_t) size);
+}
 #endif /* FILESYS */
 
 /* Debugging. */
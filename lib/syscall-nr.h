@@ -28,7 +28,12 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+    SYS_GETDENTS,               /* Reads many directory entries. */
+    SYS_FSYNC,                  /* Writes a file's data to disk. */
+    SYS_SYNC,                   /* Writes all file system data to disk. */
+    SYS_COPY_FILE_RANGE,        /* Copies bytes between files. */
+    SYS_COMPRESS                /* Stores a file compressed. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -15,6 +15,19 @@ typedef int mapid_t;
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
+/* A directory entry returned by getdents(). */
+struct dirent
+  {
+    int inumber;                        /* Inode number. */
+    int size;                           /* File size in bytes. */
+    int type;                           /* DT_REG or DT_DIR. */
+    char name[READDIR_MAX_LEN + 1];     /* Null terminated file name. */
+  };
+
+/* Types of directory entries. */
+#define DT_REG 1                /* Ordinary file. */
+#define DT_DIR 2                /* Directory. */
+
 /* Typical return values from main() and arguments to exit(). */
 #define EXIT_SUCCESS 0          /* Successful execution. */
 #define EXIT_FAILURE 1          /* Unsuccessful execution. */
@@ -44,5 +57,10 @@ bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
+int getdents (int fd, struct dirent *, unsigned cnt);
+bool fsync (int fd);
+void sync (void);
+int copy_file_range (int fd_in, int fd_out, unsigned length);
+bool compress (int fd);
 
 #endif /* lib/user/syscall.h */
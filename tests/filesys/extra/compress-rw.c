@@ -0,0 +1,57 @@
+/* Switches a new file to compressed storage, writes a mix of
+   compressible and random data across several chunks, overwrites
+   a range that straddles a chunk boundary, and checks the result.
+   Also checks that a file that already holds data and a directory
+   both refuse to be compressed. */
+
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 14000
+
+static char buf[FILE_SIZE];
+static char patch[3000];
+
+void
+test_main (void) 
+{
+  int fd, i;
+
+  random_init (0);
+  for (i = 0; i < 9000; i++)
+    buf[i] = "compressible "[i % 13];
+  random_bytes (buf + 9000, FILE_SIZE - 9000);
+  random_bytes (patch, sizeof patch);
+
+  CHECK (create ("c", 0), "create \"c\"");
+  CHECK ((fd = open ("c")) > 1, "open \"c\"");
+  CHECK (compress (fd), "compress \"c\"");
+  CHECK (compress (fd), "compress \"c\" again");
+  CHECK (write (fd, buf, FILE_SIZE) == FILE_SIZE,
+         "write %d bytes to \"c\"", FILE_SIZE);
+  seek (fd, 3000);
+  CHECK (write (fd, patch, sizeof patch) == (int) sizeof patch,
+         "overwrite %zu bytes at offset 3000", sizeof patch);
+  memcpy (buf + 3000, patch, sizeof patch);
+  msg ("close \"c\"");
+  close (fd);
+  check_file ("c", buf, FILE_SIZE);
+
+  CHECK (create ("plain", 0), "create \"plain\"");
+  CHECK ((fd = open ("plain")) > 1, "open \"plain\"");
+  CHECK (write (fd, buf, 5000) == 5000, "write 5000 bytes to \"plain\"");
+  CHECK (!compress (fd), "compress \"plain\" (must fail)");
+  msg ("close \"plain\"");
+  close (fd);
+  check_file ("plain", buf, 5000);
+
+  CHECK (mkdir ("d"), "mkdir \"d\"");
+  CHECK ((fd = open ("d")) > 1, "open \"d\"");
+  CHECK (!compress (fd), "compress \"d\" (must fail)");
+  msg ("close \"d\"");
+  close (fd);
+}
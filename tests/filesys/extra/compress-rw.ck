@@ -0,0 +1,31 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(compress-rw) begin
+(compress-rw) create "c"
+(compress-rw) open "c"
+(compress-rw) compress "c"
+(compress-rw) compress "c" again
+(compress-rw) write 14000 bytes to "c"
+(compress-rw) overwrite 3000 bytes at offset 3000
+(compress-rw) close "c"
+(compress-rw) open "c" for verification
+(compress-rw) verified contents of "c"
+(compress-rw) close "c"
+(compress-rw) create "plain"
+(compress-rw) open "plain"
+(compress-rw) write 5000 bytes to "plain"
+(compress-rw) compress "plain" (must fail)
+(compress-rw) close "plain"
+(compress-rw) open "plain" for verification
+(compress-rw) verified contents of "plain"
+(compress-rw) close "plain"
+(compress-rw) mkdir "d"
+(compress-rw) open "d"
+(compress-rw) compress "d" (must fail)
+(compress-rw) close "d"
+(compress-rw) end
+EOF
+pass;
@@ -0,0 +1,65 @@
+/* Copies parts of one file into another with copy_file_range and
+   checks the bytes copied, the positions of both files after
+   each call, and the result.  Also checks that copying from a
+   directory fails. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SRC_SIZE 30000
+
+static char src_data[SRC_SIZE];
+static char expected[SRC_SIZE];
+
+void
+test_main (void) 
+{
+  int src, dst, dir;
+
+  random_init (0);
+  random_bytes (src_data, sizeof src_data);
+  CHECK (create ("src", 0), "create \"src\"");
+  CHECK ((src = open ("src")) > 1, "open \"src\"");
+  CHECK (write (src, src_data, SRC_SIZE) == SRC_SIZE, "write \"src\"");
+  CHECK (create ("dst", 0), "create \"dst\"");
+  CHECK ((dst = open ("dst")) > 1, "open \"dst\"");
+
+  /* From the middle of "src" to the start of "dst". */
+  seek (src, 1000);
+  CHECK (copy_file_range (src, dst, 12345) == 12345,
+         "copy 12345 bytes from offset 1000");
+  CHECK (tell (src) == 13345 && tell (dst) == 12345,
+         "both positions advanced by 12345");
+
+  /* Asking for more than is left copies up to the end of "src". */
+  CHECK (copy_file_range (src, dst, 100000) == SRC_SIZE - 13345,
+         "copy the rest of \"src\"");
+  CHECK (copy_file_range (src, dst, 100) == 0, "copy at end of \"src\"");
+  memcpy (expected, src_data + 1000, SRC_SIZE - 1000);
+
+  /* Over existing data in the middle of "dst". */
+  seek (src, 0);
+  seek (dst, 500);
+  CHECK (copy_file_range (src, dst, 700) == 700,
+         "copy 700 bytes over offset 500 of \"dst\"");
+  memcpy (expected + 500, src_data, 700);
+
+  msg ("close \"src\"");
+  close (src);
+  msg ("close \"dst\"");
+  close (dst);
+  check_file ("dst", expected, SRC_SIZE - 1000);
+
+  CHECK (mkdir ("d"), "mkdir \"d\"");
+  CHECK ((dir = open ("d")) > 1, "open \"d\"");
+  CHECK ((dst = open ("dst")) > 1, "open \"dst\"");
+  CHECK (copy_file_range (dir, dst, 100) == -1,
+         "copy from directory \"d\" fails");
+  msg ("close \"d\"");
+  close (dir);
+  msg ("close \"dst\"");
+  close (dst);
+}
@@ -0,0 +1,30 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(copy-range) begin
+(copy-range) create "src"
+(copy-range) open "src"
+(copy-range) write "src"
+(copy-range) create "dst"
+(copy-range) open "dst"
+(copy-range) copy 12345 bytes from offset 1000
+(copy-range) both positions advanced by 12345
+(copy-range) copy the rest of "src"
+(copy-range) copy at end of "src"
+(copy-range) copy 700 bytes over offset 500 of "dst"
+(copy-range) close "src"
+(copy-range) close "dst"
+(copy-range) open "dst" for verification
+(copy-range) verified contents of "dst"
+(copy-range) close "dst"
+(copy-range) mkdir "d"
+(copy-range) open "d"
+(copy-range) open "dst"
+(copy-range) copy from directory "d" fails
+(copy-range) close "d"
+(copy-range) close "dst"
+(copy-range) end
+EOF
+pass;
@@ -0,0 +1,71 @@
+/* Writes two files in alternating 2 kB pieces, so that their
+   sectors interleave on disk, while the background defragmenter
+   runs.  Reads both back many times so that some reads overlap a
+   move, then appends to both and checks them once more. */
+
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PIECE 2048
+#define PIECE_CNT 40
+#define FILE_SIZE (PIECE * PIECE_CNT)
+#define PASS_CNT 20
+
+static char data[2][FILE_SIZE + PIECE];
+static char buf[FILE_SIZE + PIECE];
+
+static void
+verify (int fd, int which, int size) 
+{
+  seek (fd, 0);
+  if (read (fd, buf, size) != size)
+    fail ("read %d bytes from \"f%d\"", size, which);
+  if (memcmp (buf, data[which], size))
+    fail ("\"f%d\" differs from expected", which);
+}
+
+void
+test_main (void) 
+{
+  int fds[2];
+  int i, j;
+
+  random_init (0);
+  random_bytes (data, sizeof data);
+
+  CHECK (create ("f0", 0), "create \"f0\"");
+  CHECK (create ("f1", 0), "create \"f1\"");
+  CHECK ((fds[0] = open ("f0")) > 1, "open \"f0\"");
+  CHECK ((fds[1] = open ("f1")) > 1, "open \"f1\"");
+
+  msg ("write %d bytes to each file in alternating pieces", FILE_SIZE);
+  for (i = 0; i < PIECE_CNT; i++)
+    for (j = 0; j < 2; j++)
+      if (write (fds[j], data[j] + i * PIECE, PIECE) != PIECE)
+        fail ("write piece %d of \"f%d\"", i, j);
+
+  msg ("read both files back %d times", PASS_CNT);
+  for (i = 0; i < PASS_CNT; i++)
+    for (j = 0; j < 2; j++)
+      verify (fds[j], j, FILE_SIZE);
+
+  msg ("append %d bytes to each file", PIECE);
+  for (j = 0; j < 2; j++)
+    {
+      seek (fds[j], FILE_SIZE);
+      if (write (fds[j], data[j] + FILE_SIZE, PIECE) != PIECE)
+        fail ("append to \"f%d\"", j);
+    }
+  for (j = 0; j < 2; j++)
+    {
+      msg ("close \"f%d\"", j);
+      close (fds[j]);
+    }
+
+  check_file ("f0", data[0], FILE_SIZE + PIECE);
+  check_file ("f1", data[1], FILE_SIZE + PIECE);
+}
@@ -0,0 +1,24 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(defrag-interleave) begin
+(defrag-interleave) create "f0"
+(defrag-interleave) create "f1"
+(defrag-interleave) open "f0"
+(defrag-interleave) open "f1"
+(defrag-interleave) write 81920 bytes to each file in alternating pieces
+(defrag-interleave) read both files back 20 times
+(defrag-interleave) append 2048 bytes to each file
+(defrag-interleave) close "f0"
+(defrag-interleave) close "f1"
+(defrag-interleave) open "f0" for verification
+(defrag-interleave) verified contents of "f0"
+(defrag-interleave) close "f0"
+(defrag-interleave) open "f1" for verification
+(defrag-interleave) verified contents of "f1"
+(defrag-interleave) close "f1"
+(defrag-interleave) end
+EOF
+pass;
@@ -0,0 +1,105 @@
+/* Lists a directory holding files of different sizes and a few
+   subdirectories with getdents, a handful of entries at a time,
+   and checks each entry's name, size, type and inode number.
+   Also checks that getdents returns 0 at the end and -1 for a
+   file that is not a directory. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 40
+#define DIR_CNT 3
+#define BATCH 7
+
+void
+test_main (void) 
+{
+  static char zeros[FILE_CNT * 10];
+  struct dirent entries[BATCH];
+  bool seen[FILE_CNT + DIR_CNT];
+  int fd, n, cnt, i;
+
+  CHECK (mkdir ("d"), "mkdir \"d\"");
+  msg ("creating %d files and %d directories in \"d\"", FILE_CNT, DIR_CNT);
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      char name[32];
+      snprintf (name, sizeof name, "d/f%d", i);
+      if (!create (name, 0))
+        fail ("create \"%s\"", name);
+      if ((fd = open (name)) < 2)
+        fail ("open \"%s\"", name);
+      if (write (fd, zeros, i * 10) != i * 10)
+        fail ("write \"%s\"", name);
+      close (fd);
+    }
+  for (i = 0; i < DIR_CNT; i++)
+    {
+      char name[32];
+      snprintf (name, sizeof name, "d/sub%d", i);
+      if (!mkdir (name))
+        fail ("mkdir \"%s\"", name);
+    }
+
+  CHECK ((fd = open ("d")) > 1, "open \"d\"");
+  memset (seen, 0, sizeof seen);
+  cnt = 0;
+  while ((n = getdents (fd, entries, BATCH)) > 0)
+    {
+      if (n > BATCH)
+        fail ("getdents returned %d entries, more than %d", n, BATCH);
+      for (i = 0; i < n; i++)
+        {
+          const struct dirent *e = &entries[i];
+          char path[32];
+          int idx, entry_fd, size, type;
+
+          if (e->name[0] == 'f')
+            {
+              idx = atoi (e->name + 1);
+              size = idx * 10;
+              type = DT_REG;
+            }
+          else
+            {
+              idx = FILE_CNT + atoi (e->name + 3);
+              size = -1;
+              type = DT_DIR;
+            }
+          if (idx < 0 || idx >= FILE_CNT + DIR_CNT || seen[idx])
+            fail ("unexpected or repeated entry \"%s\"", e->name);
+          seen[idx] = true;
+          if (e->type != type)
+            fail ("\"%s\" has type %d instead of %d", e->name, e->type, type);
+          if (size >= 0 && e->size != size)
+            fail ("\"%s\" has size %d instead of %d", e->name, e->size, size);
+
+          snprintf (path, sizeof path, "d/%s", e->name);
+          if ((entry_fd = open (path)) < 2)
+            fail ("open \"%s\"", path);
+          if (inumber (entry_fd) != e->inumber)
+            fail ("\"%s\" has inode number %d instead of %d",
+                  e->name, e->inumber, inumber (entry_fd));
+          close (entry_fd);
+          cnt++;
+        }
+    }
+  if (n < 0)
+    fail ("getdents on \"d\" returned %d", n);
+  if (cnt != FILE_CNT + DIR_CNT)
+    fail ("getdents returned %d entries instead of %d",
+          cnt, FILE_CNT + DIR_CNT);
+  msg ("getdents returned each entry once, with its size and type");
+  CHECK (getdents (fd, entries, BATCH) == 0, "getdents at end of \"d\"");
+  msg ("close \"d\"");
+  close (fd);
+
+  CHECK ((fd = open ("d/f1")) > 1, "open \"d/f1\"");
+  CHECK (getdents (fd, entries, BATCH) == -1, "getdents on \"d/f1\" fails");
+  msg ("close \"d/f1\"");
+  close (fd);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-getdents) begin
+(dir-getdents) mkdir "d"
+(dir-getdents) creating 40 files and 3 directories in "d"
+(dir-getdents) open "d"
+(dir-getdents) getdents returned each entry once, with its size and type
+(dir-getdents) getdents at end of "d"
+(dir-getdents) close "d"
+(dir-getdents) open "d/f1"
+(dir-getdents) getdents on "d/f1" fails
+(dir-getdents) close "d/f1"
+(dir-getdents) end
+EOF
+pass;
@@ -0,0 +1,54 @@
+/* Creates enough files in a directory that its table has to
+   grow, then lists it with readdir and checks that every file
+   is returned exactly once, that "." and ".." are not, and that
+   readdir keeps failing once the end is reached. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 50
+
+void
+test_main (void) 
+{
+  bool seen[FILE_CNT];
+  char name[READDIR_MAX_LEN + 1];
+  int fd, cnt, i;
+
+  CHECK (mkdir ("a"), "mkdir \"a\"");
+  msg ("creating %d files in \"a\"", FILE_CNT);
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      char file_name[32];
+      snprintf (file_name, sizeof file_name, "a/file%d", i);
+      if (!create (file_name, 0))
+        fail ("create \"%s\"", file_name);
+    }
+
+  CHECK ((fd = open ("a")) > 1, "open \"a\"");
+  memset (seen, 0, sizeof seen);
+  cnt = 0;
+  while (readdir (fd, name)) 
+    {
+      char file_name[32];
+
+      i = strlen (name) > 4 ? atoi (name + 4) : -1;
+      snprintf (file_name, sizeof file_name, "file%d", i);
+      if (i < 0 || i >= FILE_CNT || strcmp (name, file_name))
+        fail ("readdir returned unexpected name \"%s\"", name);
+      if (seen[i])
+        fail ("readdir returned \"%s\" twice", name);
+      seen[i] = true;
+      cnt++;
+    }
+  if (cnt != FILE_CNT)
+    fail ("readdir returned %d names instead of %d", cnt, FILE_CNT);
+  msg ("readdir returned each file once");
+  CHECK (!readdir (fd, name), "readdir at end of \"a\"");
+  msg ("close \"a\"");
+  close (fd);
+}
@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-readdir-all) begin
+(dir-readdir-all) mkdir "a"
+(dir-readdir-all) creating 50 files in "a"
+(dir-readdir-all) open "a"
+(dir-readdir-all) readdir returned each file once
+(dir-readdir-all) readdir at end of "a"
+(dir-readdir-all) close "a"
+(dir-readdir-all) end
+EOF
+pass;
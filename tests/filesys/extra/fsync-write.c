@@ -0,0 +1,41 @@
+/* Writes a file in pieces, calling fsync after each, then checks
+   its contents, that fsync fails on a closed file descriptor,
+   and that the contents are still intact after sync. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PIECE 1234
+#define PIECE_CNT 5
+
+static char buf[PIECE * PIECE_CNT];
+
+void
+test_main (void) 
+{
+  int fd, i;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create ("f", 0), "create \"f\"");
+  CHECK ((fd = open ("f")) > 1, "open \"f\"");
+  msg ("write and fsync %d pieces of \"f\"", PIECE_CNT);
+  for (i = 0; i < PIECE_CNT; i++)
+    {
+      if (write (fd, buf + i * PIECE, PIECE) != PIECE)
+        fail ("write piece %d of \"f\"", i);
+      if (!fsync (fd))
+        fail ("fsync \"f\" after piece %d", i);
+    }
+  msg ("close \"f\"");
+  close (fd);
+  CHECK (!fsync (fd), "fsync closed file descriptor fails");
+  check_file ("f", buf, sizeof buf);
+
+  msg ("sync");
+  sync ();
+  check_file ("f", buf, sizeof buf);
+}
@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fsync-write) begin
+(fsync-write) create "f"
+(fsync-write) open "f"
+(fsync-write) write and fsync 5 pieces of "f"
+(fsync-write) close "f"
+(fsync-write) fsync closed file descriptor fails
+(fsync-write) open "f" for verification
+(fsync-write) verified contents of "f"
+(fsync-write) close "f"
+(fsync-write) sync
+(fsync-write) open "f" for verification
+(fsync-write) verified contents of "f"
+(fsync-write) close "f"
+(fsync-write) end
+EOF
+pass;
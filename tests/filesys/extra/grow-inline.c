@@ -0,0 +1,80 @@
+/* Grows several small files a few bytes at a time, in turn, from
+   sizes that fit inside the inode to sizes that need data
+   sectors, checking every file after each round so that a write
+   to one cannot have spilled into a neighbor.  Then writes past
+   the end of a small file, across the same boundary, and checks
+   that the gaps read as zeros. */
+
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 4
+#define STEP 23
+#define FINAL_SIZE 700
+
+static char data[FILE_CNT][FINAL_SIZE];
+static char buf[FINAL_SIZE];
+
+void
+test_main (void) 
+{
+  int fds[FILE_CNT];
+  int size, fd, i;
+
+  random_init (0);
+  random_bytes (data, sizeof data);
+
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      char name[16];
+      snprintf (name, sizeof name, "s%d", i);
+      CHECK (create (name, 0), "create \"%s\"", name);
+      CHECK ((fds[i] = open (name)) > 1, "open \"%s\"", name);
+    }
+
+  msg ("grow each file to %d bytes, %d bytes at a time", FINAL_SIZE, STEP);
+  for (size = 0; size < FINAL_SIZE; size += STEP)
+    {
+      int n = FINAL_SIZE - size < STEP ? FINAL_SIZE - size : STEP;
+
+      for (i = 0; i < FILE_CNT; i++)
+        if (write (fds[i], data[i] + size, n) != n)
+          fail ("write %d bytes at offset %d in \"s%d\"", n, size, i);
+      for (i = 0; i < FILE_CNT; i++)
+        {
+          seek (fds[i], 0);
+          if (read (fds[i], buf, size + n) != size + n)
+            fail ("read %d bytes from \"s%d\"", size + n, i);
+          if (memcmp (buf, data[i], size + n))
+            fail ("\"s%d\" differs from expected at %d bytes", i, size + n);
+        }
+    }
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      msg ("close \"s%d\"", i);
+      close (fds[i]);
+    }
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      char name[16];
+      snprintf (name, sizeof name, "s%d", i);
+      check_file (name, data[i], FINAL_SIZE);
+    }
+
+  CHECK (create ("gap", 0), "create \"gap\"");
+  CHECK ((fd = open ("gap")) > 1, "open \"gap\"");
+  memset (buf, 0, sizeof buf);
+  seek (fd, 40);
+  CHECK (write (fd, "inside", 6) == 6, "write \"inside\" at offset 40");
+  memcpy (buf + 40, "inside", 6);
+  seek (fd, 600);
+  CHECK (write (fd, "outside", 7) == 7, "write \"outside\" at offset 600");
+  memcpy (buf + 600, "outside", 7);
+  msg ("close \"gap\"");
+  close (fd);
+  check_file ("gap", buf, 607);
+}
@@ -0,0 +1,42 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-inline) begin
+(grow-inline) create "s0"
+(grow-inline) open "s0"
+(grow-inline) create "s1"
+(grow-inline) open "s1"
+(grow-inline) create "s2"
+(grow-inline) open "s2"
+(grow-inline) create "s3"
+(grow-inline) open "s3"
+(grow-inline) grow each file to 700 bytes, 23 bytes at a time
+(grow-inline) close "s0"
+(grow-inline) close "s1"
+(grow-inline) close "s2"
+(grow-inline) close "s3"
+(grow-inline) open "s0" for verification
+(grow-inline) verified contents of "s0"
+(grow-inline) close "s0"
+(grow-inline) open "s1" for verification
+(grow-inline) verified contents of "s1"
+(grow-inline) close "s1"
+(grow-inline) open "s2" for verification
+(grow-inline) verified contents of "s2"
+(grow-inline) close "s2"
+(grow-inline) open "s3" for verification
+(grow-inline) verified contents of "s3"
+(grow-inline) close "s3"
+(grow-inline) create "gap"
+(grow-inline) open "gap"
+(grow-inline) write "inside" at offset 40
+(grow-inline) write "outside" at offset 600
+(grow-inline) close "gap"
+(grow-inline) open "gap" for verification
+(grow-inline) verified contents of "gap"
+(grow-inline) close "gap"
+(grow-inline) end
+EOF
+pass;
@@ -27,9 +27,6 @@
 static thread_func start_process NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
 
-// lock to control access to the filesystem
-struct lock filesys_lock;
-
 /* Starts a new thread running a user program loaded from
    FILENAME.  The new thread may be scheduled (and may even exit)
    before process_execute() returns.  Returns the new process's
@@ -38,6 +35,7 @@ tid_t
 process_execute (const char *file_name)
 {
   char *fn_copy;
+  struct dir **cwd;
   tid_t tid;
 
   /* Make a copy of FILE_NAME.
@@ -45,7 +43,12 @@ process_execute (const char *file_name)
   fn_copy = palloc_get_page (0);
   if (fn_copy == NULL)
     return TID_ERROR;
-  strlcpy (fn_copy, file_name, PGSIZE);
+
+  /* the child starts in our working directory, so pass it a copy at the
+    end of the page, after the command line */
+  cwd = (struct dir**) (fn_copy + PGSIZE) - 1;
+  strlcpy (fn_copy, file_name, PGSIZE - sizeof *cwd);
+  *cwd = filesys_get_cwd();
 
   /* Create a new thread to execute FILE_NAME. */
   tid = thread_create (file_name, PRI_DEFAULT, start_process, fn_copy);
@@ -67,6 +70,7 @@ process_execute (const char *file_name)
     struct list children = thread_current()->children;
     list_push_front(&children, &search_thread->children_elem);
   } else {
+    dir_close(*cwd);
     palloc_free_page (fn_copy);
   }
   return tid;
@@ -81,6 +85,9 @@ start_process (void *file_name_)
   struct intr_frame if_;
   bool success;
 
+  // take over the working directory from our parent
+  filesys_set_cwd(*((struct dir**) (file_name + PGSIZE) - 1));
+
   /* Initialize interrupt frame and load executable. */
   memset (&if_, 0, sizeof if_);
   if_.gs = if_.fs = if_.es = if_.ds = if_.ss = SEL_UDSEG;
@@ -185,6 +192,9 @@ process_exit (void)
     of the files opened by this thread */
   close_files(cur->files);
 
+  // release this process's working directory
+  filesys_set_cwd(NULL);
+
   /* Destroy the current process's page directory and switch back
      to the kernel-only page directory. */
   pd = cur->pagedir;
@@ -328,10 +338,8 @@ load (const char *file_name, void (**eip) (void), void **esp)
     arguments[arg_size] = token;
     arg_size++;
   }
-  lock_acquire(&filesys_lock);
   /* Open executable file. */
   file = filesys_open (file_name);
-  lock_release(&filesys_lock);
   if (file == NULL)
     {
       printf ("load: %s: open failed\n", file_name);
@@ -339,12 +347,9 @@ load (const char *file_name, void (**eip) (void), void **esp)
     }
 
   // prevent modifications to the executable open by a running process
-  lock_acquire(&filesys_lock);
   file_deny_write(file);
-  lock_release(&filesys_lock);
   t->executing = file;
   /* Read and verify executable header. */
-  lock_acquire(&filesys_lock);
   if (file_read (file, &ehdr, sizeof ehdr) != sizeof ehdr
       || memcmp (ehdr.e_ident, "\177ELF\1\1\1", 7)
       || ehdr.e_type != 2
@@ -356,7 +361,6 @@ load (const char *file_name, void (**eip) (void), void **esp)
       printf ("load: %s: error loading executable\n", file_name);
       goto done;
     }
-    lock_release(&filesys_lock);
 
   /* Read program headers. */
   file_ofs = ehdr.e_phoff;
@@ -366,15 +370,9 @@ load (const char *file_name, void (**eip) (void), void **esp)
 
       if (file_ofs < 0 || file_ofs > file_length (file))
         goto done;
-      lock_acquire(&filesys_lock);
       file_seek (file, file_ofs);
-      lock_release(&filesys_lock);
-
-
-      lock_acquire(&filesys_lock);
       if (file_read (file, &phdr, sizeof phdr) != sizeof phdr)
         goto done;
-      lock_release(&filesys_lock);
       file_ofs += sizeof phdr;
       switch (phdr.p_type)
         {
@@ -504,9 +502,7 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
   ASSERT (pg_ofs (upage) == 0);
   ASSERT (ofs % PGSIZE == 0);
 
-  lock_acquire(&filesys_lock);
   file_seek (file, ofs);
-  lock_release(&filesys_lock);
 
   while (read_bytes > 0 || zero_bytes > 0)
     {
@@ -6,21 +6,20 @@
 #include "threads/synch.h"
 #include "userprog/pagedir.h"
 #include "userprog/process.h"
+#include "filesys/directory.h"
+#include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include "lib/user/syscall.h"
 #include "threads/vaddr.h"
 #include "vm/page.h"
 #include "vm/frame.h"
 static void syscall_handler (struct intr_frame *);
 
-// lock necessary for synchronization of the file system
-extern struct lock filesys_lock;
-
 void
 syscall_init (void)
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-  lock_init(&filesys_lock);
 }
 
 /*
@@ -38,26 +37,14 @@ void valid_address(void* address) {
   }
 }
 
-// Pravat driving here checks if the buffer is valid
-void valid_buffer(void* buffer, int size) {
-  char* buf_ptr = (char*) buffer;
-  int buffer_index = 0;
-  while(buffer_index < size) {
-    valid_address(buffer + buffer_index);
-    buffer_index++;
-  }
-}
-
 // Pravat driving here checks if the read buffer is valid
 void valid_read_buffer(void* buffer, int size) {
-  char* buf_ptr = (char*) buffer;
-  int buffer_index = 0;
-  while(buffer_index < size) {
-    void* buffer_address = buffer + buffer_index;
-    if(!buffer_address || !is_user_vaddr(buffer_address)) {
+  if(size > 0) {
+    // user memory lies below PHYS_BASE, so checking the last byte covers the rest
+    void* buffer_end = buffer + size - 1;
+    if(!buffer || !is_user_vaddr(buffer_end) || buffer_end < buffer) {
       exit(-1);
     }
-    buffer_index++;
   }
 
   /*
@@ -71,6 +58,15 @@ void valid_read_buffer(void* buffer, int size) {
   }
 }
 
+// check every byte of a string, up to and including its null terminator
+void valid_string(const char* string) {
+  valid_address((void*) string);
+  while(*string != '\0') {
+    string++;
+    valid_address((void*) string);
+  }
+}
+
 // Abhi driving here, check if a file descriptor is within the valid range
 void valid_fd(int fd) {
   if(fd < 0 || fd >= FILES_MAX) {
@@ -149,6 +145,45 @@ syscall_handler (struct intr_frame *f)
       valid_address(arg1);
   		close(*arg1);
   		break;
+  	case SYS_CHDIR:
+      valid_address(arg1);
+  		*return_value = chdir((const char*) *arg1);
+  		break;
+  	case SYS_MKDIR:
+      valid_address(arg1);
+  		*return_value = mkdir((const char*) *arg1);
+  		break;
+  	case SYS_READDIR:
+      valid_address(arg2);
+  		*return_value = readdir(*arg1, (char*) *arg2);
+  		break;
+  	case SYS_ISDIR:
+      valid_address(arg1);
+  		*return_value = isdir(*arg1);
+  		break;
+  	case SYS_INUMBER:
+      valid_address(arg1);
+  		*return_value = inumber(*arg1);
+  		break;
+  	case SYS_GETDENTS:
+      valid_address(arg3);
+  		*return_value = getdents(*arg1, (struct dirent*) *arg2, *arg3);
+  		break;
+  	case SYS_FSYNC:
+      valid_address(arg1);
+  		*return_value = fsync(*arg1);
+  		break;
+  	case SYS_SYNC:
+  		sync();
+  		break;
+  	case SYS_COPY_FILE_RANGE:
+      valid_address(arg3);
+  		*return_value = copy_file_range(*arg1, *arg2, *arg3);
+  		break;
+  	case SYS_COMPRESS:
+      valid_address(arg1);
+  		*return_value = compress(*arg1);
+  		break;
     default:
       // failure, an improper syscall number so let's exit this thread
       thread_exit ();
@@ -191,10 +226,6 @@ void exit(int status){
     sema_down(&current_thread->exit_allowed);
   }
 
-  if(!lock_held_by_current_thread(&filesys_lock)) {
-    lock_acquire(&filesys_lock);
-  }
-
   // if this thread has a parent thread, then let its parent know the exit
   if(current_thread->waiting_parent) {
     current_thread->waiting_parent->exit = status;
@@ -204,7 +235,6 @@ void exit(int status){
   char* file_name = get_file_name(current_thread->name);
   file_close(current_thread->executing);
   printf("%s: exit(%d)\n", file_name, status);
-  lock_release(&filesys_lock);
   thread_exit();
 }
 
@@ -225,18 +255,14 @@ int wait(pid_t pid){
 // Pravat driving here, return whether or not the file was created
 bool create(const char* file, unsigned initial_size){
   valid_address(file);
-  lock_acquire(&filesys_lock);
   bool created = filesys_create(file, initial_size);
-  lock_release(&filesys_lock);
   return created;
 }
 
 // Abhi driving here, return whether or not the file was removed
 bool remove(const char* file){
   valid_address(file);
-  lock_acquire(&filesys_lock);
   bool removed = filesys_remove(file) != NULL ? true : false;
-  lock_release(&filesys_lock);
   return removed;
 }
 
@@ -244,7 +270,6 @@ bool remove(const char* file){
   and return the file's file descriptor */
 int open(const char* file){
   valid_address(file);
-  lock_acquire(&filesys_lock);
   struct thread* current_thread = thread_current();
 
   struct file* file_ptr = filesys_open(file);
@@ -260,7 +285,6 @@ int open(const char* file){
       fd = index;
     }
   }
-  lock_release(&filesys_lock);
 	return fd;
 }
 
@@ -268,7 +292,6 @@ int open(const char* file){
   of a file using its file descriptor */
 int filesize(int fd){
   valid_fd(fd);
-  lock_acquire(&filesys_lock);
 
   // receive the file at the index, then receive the size
   struct file* file_ptr = thread_current()->files[fd];
@@ -277,35 +300,62 @@ int filesize(int fd){
     file_size = file_length(file_ptr);
   }
 
-  lock_release(&filesys_lock);
   return file_size;
 }
 
-// Pravat driving, read through a jagged page buffer instead of a whole buffer
-int file_jagged_read(struct file* file_ptr, void* buffer,
-  unsigned size, unsigned buffer_size) {
-  // keep reading the bytes until finally reading size number of bytes
-  int read_bytes = 0;
-  while(read_bytes < size) {
-    int bytes_read = file_read(file_ptr, buffer, buffer_size);
-    if(bytes_read == buffer_size) {
-      // read the correct number of bytes, so update the buffer
-      read_bytes += bytes_read;
-      buffer += bytes_read;
-
-      // make sure to not read more than a page
-      int remaining_read_bytes = size - read_bytes;
-      if(remaining_read_bytes <= PGSIZE) {
-        buffer_size = remaining_read_bytes;
-      } else {
-        buffer_size = PGSIZE;
+/*
+  the most pages of a user buffer to pin at once, so that a huge read or
+  write cannot take every frame away from other processes
+*/
+#define PINNED_PAGES_MAX 64
+
+/*
+  read or write a file through the user buffer directly, pinning one chunk
+  of the buffer's pages at a time so that the file system can transfer
+  whole sectors straight into or out of their frames
+*/
+static int file_pinned_transfer(int fd, struct file* file_ptr,
+  uint8_t* buffer, unsigned size, bool is_read) {
+  unsigned transferred_bytes = 0;
+  while(transferred_bytes < size) {
+    // the chunk ends at a page boundary, at most PINNED_PAGES_MAX pages away
+    uint8_t* chunk = buffer + transferred_bytes;
+    unsigned chunk_size = size - transferred_bytes;
+    unsigned max_chunk_size = PINNED_PAGES_MAX * PGSIZE - pg_ofs(chunk);
+    if(chunk_size > max_chunk_size) {
+      chunk_size = max_chunk_size;
+    }
+
+    if(!pin_user_buffer(chunk, chunk_size, is_read, is_read)) {
+      // part of the buffer is not valid user memory
+      exit(-1);
+    }
+
+    unsigned chunk_bytes = 0;
+    if(is_read && fd == STDIN_FILENO) {
+      // read from the keyboard inputs
+      while(chunk_bytes < chunk_size) {
+        chunk[chunk_bytes] = input_getc();
+        chunk_bytes++;
       }
+    } else if(!is_read && fd == STDOUT_FILENO) {
+      // simply putbuf into the console, do not write into an actual file
+      putbuf((const char*) chunk, chunk_size);
+      chunk_bytes = chunk_size;
+    } else if(is_read) {
+      chunk_bytes = file_read(file_ptr, chunk, chunk_size);
     } else {
-      // stop the loop, could not read enough bytes
-      read_bytes = size;
+      chunk_bytes = file_write(file_ptr, chunk, chunk_size);
+    }
+    unpin_user_buffer(chunk, chunk_size);
+
+    transferred_bytes += chunk_bytes;
+    if(chunk_bytes < chunk_size) {
+      // reached the end of the file or the disk is full, so stop early
+      break;
     }
   }
-  return read_bytes;
+  return transferred_bytes;
 }
 
 /* Abhi driving here, read size bytes from the
@@ -313,70 +363,37 @@ int file_jagged_read(struct file* file_ptr, void* buffer,
 int read(int fd, void* buffer, unsigned size){
   valid_read_buffer(buffer, size);
   valid_fd(fd);
-  lock_acquire(&filesys_lock);
-
-  void* page_buffer = pg_round_down(buffer);
-  unsigned int buffer_size = (unsigned int) (page_buffer + PGSIZE - buffer);
-
-  // check each page of the buffer and grow stack if necessary
-  int stack_grows = 0;
-  const int MAX_READ_BYTES = buffer + size;
-  while(page_buffer <= MAX_READ_BYTES) {
-    struct page_entry* page = get_page_entry(page_buffer);
-    if(!page) {
-      // need to increase the stack because there aren't enough pages
-      stack_grows++;
-      grow_stack(page_buffer);
-    }
-    page_buffer += PGSIZE;
-  }
 
   // Dinesh driving, receive the file at the index
   int read_bytes = 0;
   struct file* file_ptr = thread_current()->files[fd];
   if(file_ptr) {
-    if(fd == STDIN_FILENO) {
-      while(stack_grows < size) {
-        // read from the keyboard inputs
-        uint8_t* keyboard_input_read = buffer + stack_grows;
-        *keyboard_input_read = input_getc();
-        stack_grows++;
-        read_bytes++;
-      }
-    } else if(size > buffer_size) {
-      // only read up until the buffer size to prevent going out of bounds
-      read_bytes = file_jagged_read(file_ptr, buffer, size, buffer_size);
-    } else {
-      // read the file normally, without reading through the pages
-      read_bytes = file_read(file_ptr, buffer, size);
-    }
+    read_bytes = file_pinned_transfer(fd, file_ptr, buffer, size, true);
   }
 
-  lock_release(&filesys_lock);
   return read_bytes;
 }
 
 /* Dinesh driving here, write the buffer
   into the terminal or write into a file */
 int write(int fd, const void* buffer, unsigned size){
-  valid_buffer(buffer, size);
-  valid_address(buffer);
   valid_fd(fd);
   if(fd == STDOUT_FILENO) {
-    // simply putbuf into the console, do not write into an actual file
-    putbuf(buffer, size);
-    return size;
+    return file_pinned_transfer(fd, NULL, (uint8_t*) buffer, size, false);
   }
-  lock_acquire(&filesys_lock);
 
   // write size number of bytes into a file that this process owns
   struct file* file_ptr = thread_current()->files[fd];
   int write_bytes = 0;
+  if(file_ptr && inode_is_dir(file_get_inode(file_ptr))) {
+    // directories are only changed through create, mkdir and remove
+    return -1;
+  }
   if(file_ptr) {
-    write_bytes = file_write(file_ptr, buffer, size);
+    write_bytes = file_pinned_transfer(fd, file_ptr, (uint8_t*) buffer,
+      size, false);
   }
 
-  lock_release(&filesys_lock);
   return write_bytes;
 }
 
@@ -384,7 +401,6 @@ int write(int fd, const void* buffer, unsigned size){
   be read or written at the file descriptor */
 void seek(int fd, unsigned position){
   valid_fd(fd);
-  lock_acquire(&filesys_lock);
 
   // seek the file
   struct thread* current_thread = thread_current();
@@ -392,15 +408,12 @@ void seek(int fd, unsigned position){
   if(file_ptr) {
     file_seek(file_ptr, position);
   }
-
-  lock_release(&filesys_lock);
 }
 
 /* Abhi driving here, return the position of the
   next byte to be written at the file descriptor */
 unsigned tell(int fd){
   valid_fd(fd);
-  lock_acquire(&filesys_lock);
 
   // tell the file
   struct thread* current_thread = thread_current();
@@ -410,14 +423,12 @@ unsigned tell(int fd){
     next_position = file_tell(file_ptr);
   }
 
-  lock_release(&filesys_lock);
   return next_position;
 }
 
 // Dinesh driving here, close a file at the file descriptor
 void close(int fd){
   valid_fd(fd);
-  lock_acquire(&filesys_lock);
 
   // close the file, then null it out
   struct thread* current_thread = thread_current();
@@ -426,6 +437,177 @@ void close(int fd){
     file_close(file_ptr);
     current_thread->files[fd] = NULL;
   }
+}
+
+// change this process's working directory
+bool chdir(const char* dir){
+  valid_string(dir);
+  return filesys_chdir(dir);
+}
 
-  lock_release(&filesys_lock);
+// return whether or not the directory was created
+bool mkdir(const char* dir){
+  valid_string(dir);
+  return filesys_mkdir(dir);
+}
+
+/*
+  read the next entry's name from the directory open at the file
+  descriptor, continuing from the file position where the last call left
+  off
+*/
+bool readdir(int fd, char name[READDIR_MAX_LEN + 1]){
+  valid_fd(fd);
+  struct file* file_ptr = thread_current()->files[fd];
+  if(!file_ptr || !inode_is_dir(file_get_inode(file_ptr))) {
+    return false;
+  }
+
+  // the name is written straight into user memory, so pin it first
+  if(!pin_user_buffer(name, READDIR_MAX_LEN + 1, true, true)) {
+    exit(-1);
+  }
+  bool read_entry = false;
+  struct dir* dir = dir_open(inode_reopen(file_get_inode(file_ptr)));
+  if(dir) {
+    dir_seek(dir, file_tell(file_ptr));
+    read_entry = dir_readdir(dir, name);
+    file_seek(file_ptr, dir_tell(dir));
+    dir_close(dir);
+  }
+  unpin_user_buffer(name, READDIR_MAX_LEN + 1);
+
+  return read_entry;
+}
+
+// return whether the file descriptor is a directory
+bool isdir(int fd){
+  valid_fd(fd);
+  struct file* file_ptr = thread_current()->files[fd];
+  return file_ptr && inode_is_dir(file_get_inode(file_ptr));
+}
+
+// return the inode number of the file descriptor's file
+int inumber(int fd){
+  valid_fd(fd);
+  struct file* file_ptr = thread_current()->files[fd];
+  if(!file_ptr) {
+    return -1;
+  }
+  return inode_get_inumber(file_get_inode(file_ptr));
+}
+
+/*
+  fill the user's array with as many of the directory's remaining entries
+  as fit, so that listing a directory takes a syscall per batch instead of
+  a readdir plus an open and filesize per entry; return the number of
+  entries filled, 0 at the end of the directory, or -1 if the file
+  descriptor is not a directory
+*/
+int getdents(int fd, struct dirent* entries, unsigned cnt){
+  valid_fd(fd);
+  struct file* file_ptr = thread_current()->files[fd];
+  if(!file_ptr || !inode_is_dir(file_get_inode(file_ptr))) {
+    return -1;
+  }
+
+  // pin at most PINNED_PAGES_MAX pages, the caller asks again for the rest
+  unsigned max_cnt = PINNED_PAGES_MAX * PGSIZE / sizeof *entries;
+  if(cnt > max_cnt) {
+    cnt = max_cnt;
+  }
+  if(cnt == 0) {
+    return 0;
+  }
+  unsigned size = cnt * sizeof *entries;
+  if(!pin_user_buffer(entries, size, true, true)) {
+    exit(-1);
+  }
+
+  unsigned filled = 0;
+  struct dir* dir = dir_open(inode_reopen(file_get_inode(file_ptr)));
+  if(dir) {
+    dir_seek(dir, file_tell(file_ptr));
+    while(filled < cnt) {
+      // read the next name, then its size and type from the inode layer
+      struct dirent* entry = &entries[filled];
+      off_t pos = dir_tell(dir);
+      inumber_t inumber;
+      off_t length;
+      bool is_dir;
+      if(!dir_readdir_inumber(dir, entry->name, &inumber)) {
+        break;
+      }
+      if(!inode_stat(inumber, &length, &is_dir)) {
+        // out of memory, so leave this entry for the next call
+        dir_seek(dir, pos);
+        break;
+      }
+      entry->inumber = inumber;
+      entry->size = length;
+      entry->type = is_dir ? DT_DIR : DT_REG;
+      filled++;
+    }
+    file_seek(file_ptr, dir_tell(dir));
+    dir_close(dir);
+  }
+  unpin_user_buffer(entries, size);
+
+  return filled;
+}
+
+/*
+  write the file's data and metadata to disk before returning, instead of
+  waiting for the writeback thread
+*/
+bool fsync(int fd){
+  valid_fd(fd);
+  struct file* file_ptr = thread_current()->files[fd];
+  if(!file_ptr) {
+    return false;
+  }
+  return file_sync(file_ptr);
+}
+
+// write everything the file system holds in memory to disk
+void sync(void){
+  filesys_sync();
+}
+
+/*
+  copy length bytes from the input file's position to the output file's
+  position inside the file system, so that the data never crosses into
+  user memory; return the number of bytes copied, or -1 if either file
+  descriptor is not an open file
+*/
+int copy_file_range(int fd_in, int fd_out, unsigned length){
+  valid_fd(fd_in);
+  valid_fd(fd_out);
+  struct thread* current_thread = thread_current();
+  struct file* in_ptr = current_thread->files[fd_in];
+  struct file* out_ptr = current_thread->files[fd_out];
+  if(!in_ptr || !out_ptr || inode_is_dir(file_get_inode(in_ptr))
+    || inode_is_dir(file_get_inode(out_ptr))) {
+    return -1;
+  }
+
+  // the number of bytes copied is returned as an int
+  if(length > INT32_MAX) {
+    length = INT32_MAX;
+  }
+  return file_copy(out_ptr, in_ptr, length);
+}
+
+/*
+  store the file's data compressed from now on, which trades CPU time for
+  fewer sectors moved over the disk; only a file with nothing on disk yet
+  can be switched, so call this right after creating it
+*/
+bool compress(int fd){
+  valid_fd(fd);
+  struct file* file_ptr = thread_current()->files[fd];
+  if(!file_ptr) {
+    return false;
+  }
+  return inode_set_compressed(file_get_inode(file_ptr));
 }
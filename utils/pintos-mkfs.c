@@ -0,0 +1,528 @@
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Builds a formatted Pintos file system image on the host, with
+   host files already copied into it, so that they need not be
+   extracted from the scratch disk in the guest.
+
+   The image is what do_format() and a series of filesys_create()
+   and file_write() calls would leave on disk, except that each
+   file's data is in a single extent.  The definitions below must
+   match filesys/filesys.h, inode.c, directory.c, free-map.c and
+   journal.c.  All multibyte numbers are little-endian. */
+
+/* Disk sectors. */
+#define SECTOR_SIZE 512
+
+/* filesys/filesys.h. */
+#define FREE_MAP_INODE 0        /* Free map file inode. */
+#define ROOT_DIR_INODE 1        /* Root directory file inode. */
+#define SYSTEM_INODE_SECTOR 0   /* Inode table sector of the above. */
+#define JOURNAL_SECTOR 2        /* First sector of the journal. */
+#define JOURNAL_SECTORS 256     /* Number of sectors in the journal. */
+
+/* filesys/inode.c.  An inode is INODE_SIZE bytes: length,
+   magic, extent count, extent index sector, then INODE_EXTENTS
+   extents of 12 bytes (logical sector, disk sector, length) or
+   INLINE_MAX bytes of data, then flags. */
+#define INODE_MAGIC 0x494e4f44
+#define INODES_PER_SECTOR 4
+#define INODE_SIZE (SECTOR_SIZE / INODES_PER_SECTOR)
+#define INODE_EXTENTS 9
+#define EXTENT_SIZE 12
+#define INLINE_MAX (INODE_EXTENTS * EXTENT_SIZE)
+#define INODE_DIR 0x1
+#define INODE_INLINE 0x2
+
+/* filesys/directory.c.  A directory is a hash table of
+   one-sector buckets, each holding BUCKET_ENTRIES entries of
+   DIR_ENTRY_SIZE bytes: inode number, NAME_MAX + 1 bytes of
+   name, then an in-use flag. */
+#define NAME_MAX 14
+#define DIR_ENTRY_SIZE 20
+#define BUCKET_ENTRIES (SECTOR_SIZE / DIR_ENTRY_SIZE)
+#define MAX_BUCKETS 65536
+
+/* filesys/journal.c.  An empty journal is a header that starts
+   the log at transaction 1, followed by a log whose first sector
+   does not continue that sequence. */
+#define JOURNAL_MAGIC 0x4c4e524a
+#define FIRST_SEQ 1
+
+/* A file or directory to put in the image. */
+struct node
+  {
+    char name[NAME_MAX + 1];            /* Name in parent directory. */
+    const char *host;                   /* Host file, if regular. */
+    bool is_dir;                        /* Directory? */
+    uint32_t inumber;                   /* Inode number. */
+    struct node *parent;                /* Parent directory. */
+    struct node *children;              /* First entry, if directory. */
+    struct node *next;                  /* Next entry in parent. */
+    size_t child_cnt;                   /* Number of entries. */
+  };
+
+static const char *image_name;          /* Image file name. */
+static int image_fd;                    /* Image file. */
+static uint32_t sector_cnt;             /* Sectors in image. */
+static uint8_t *used;                   /* Free map, one bit per sector. */
+static uint32_t next_sector;            /* Where allocate() looks next. */
+static uint32_t table_sector;           /* Inode table sector being filled. */
+static uint32_t table_slot;             /* Next free slot in it. */
+
+static void
+fail (const char *msg, ...)
+     __attribute__ ((noreturn))
+     __attribute__ ((format (printf, 1, 2)));
+
+/* Prints MSG, formatting as with printf(), and exits. */
+static void
+fail (const char *msg, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "pintos-mkfs: ");
+  va_start (args, msg);
+  vfprintf (stderr, msg, args);
+  va_end (args);
+  putc ('\n', stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Allocates SIZE bytes, or exits if memory is exhausted. */
+static void *
+xcalloc (size_t size)
+{
+  void *p = calloc (1, size);
+  if (p == NULL)
+    fail ("out of memory");
+  return p;
+}
+
+/* Stores V at P as a little-endian 32-bit number. */
+static void
+put32 (uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/* Writes the SIZE bytes at BUF to the image at byte offset OFS. */
+static void
+write_image (const void *buf, size_t size, off_t ofs)
+{
+  if (pwrite (image_fd, buf, size, ofs) != (ssize_t) size)
+    fail ("%s: write: %s", image_name, strerror (errno));
+}
+
+/* Writes zeros to sector SECTOR of the image. */
+static void
+zero_sector (uint32_t sector)
+{
+  static const uint8_t zeros[SECTOR_SIZE];
+  write_image (zeros, SECTOR_SIZE, (off_t) sector * SECTOR_SIZE);
+}
+
+/* Marks SECTOR in use in the free map. */
+static void
+mark (uint32_t sector)
+{
+  used[sector / 8] |= 1 << (sector % 8);
+}
+
+/* Allocates CNT consecutive sectors and returns the first.  The
+   image starts out empty and nothing is ever freed, so each
+   allocation simply follows the previous one, skipping over the
+   journal. */
+static uint32_t
+allocate (uint32_t cnt)
+{
+  uint32_t sector, i;
+
+  if (next_sector < JOURNAL_SECTOR + JOURNAL_SECTORS
+      && next_sector + cnt > JOURNAL_SECTOR)
+    next_sector = JOURNAL_SECTOR + JOURNAL_SECTORS;
+  if (cnt > sector_cnt || next_sector > sector_cnt - cnt)
+    fail ("%s: file system full", image_name);
+  sector = next_sector;
+  next_sector += cnt;
+  for (i = 0; i < cnt; i++)
+    mark (sector + i);
+  return sector;
+}
+
+/* Returns a free inode number.  Inodes are packed into inode
+   table sectors in the order that they are handed out, starting
+   with the free slots left in the system inode sector. */
+static uint32_t
+allocate_inumber (void)
+{
+  if (table_slot == INODES_PER_SECTOR)
+    {
+      table_sector = allocate (1);
+      table_slot = 0;
+      zero_sector (table_sector);
+    }
+  return table_sector * INODES_PER_SECTOR + table_slot++;
+}
+
+/* Writes inode INUMBER: LENGTH bytes, with flags FLAGS, stored
+   either in the CNT sectors starting at START or, if FLAGS has
+   INODE_INLINE, in the LENGTH bytes at DATA. */
+static void
+write_inode (uint32_t inumber, uint32_t length, uint32_t flags,
+             uint32_t start, uint32_t cnt, const void *data)
+{
+  uint8_t inode[INODE_SIZE];
+
+  memset (inode, 0, sizeof inode);
+  put32 (inode + 0, length);
+  put32 (inode + 4, INODE_MAGIC);
+  if (flags & INODE_INLINE)
+    memcpy (inode + 16, data, length);
+  else if (cnt > 0)
+    {
+      put32 (inode + 8, 1);
+      put32 (inode + 16, 0);
+      put32 (inode + 20, start);
+      put32 (inode + 24, cnt);
+    }
+  put32 (inode + INODE_SIZE - 4, flags);
+  write_image (inode, sizeof inode,
+               ((off_t) (inumber / INODES_PER_SECTOR) * SECTOR_SIZE
+                + inumber % INODES_PER_SECTOR * INODE_SIZE));
+}
+
+/* Returns the hash that directory.c uses to pick NAME's bucket:
+   32-bit FNV with the high bits folded into the low ones. */
+static uint32_t
+name_hash (const char *name)
+{
+  const unsigned char *s = (const unsigned char *) name;
+  uint32_t hash = 2166136261u;
+
+  while (*s != '\0')
+    hash = (hash * 16777619u) ^ *s++;
+  return hash ^ (hash >> 16);
+}
+
+/* Adds an entry for NAME and INUMBER to the first free slot of
+   its bucket in the BUCKET_CNT buckets at BUCKETS.  Returns false
+   if the bucket is full. */
+static bool
+add_entry (uint8_t *buckets, size_t bucket_cnt, const char *name,
+           uint32_t inumber)
+{
+  uint8_t *b = buckets + (name_hash (name) & (bucket_cnt - 1)) * SECTOR_SIZE;
+  size_t i;
+
+  for (i = 0; i < BUCKET_ENTRIES; i++)
+    {
+      uint8_t *e = b + i * DIR_ENTRY_SIZE;
+      if (!e[DIR_ENTRY_SIZE - 1])
+        {
+          put32 (e, inumber);
+          strncpy ((char *) e + 4, name, NAME_MAX + 1);
+          e[DIR_ENTRY_SIZE - 1] = true;
+          return true;
+        }
+    }
+  return false;
+}
+
+/* Copies host file NODE->host into the image as NODE's data. */
+static void
+put_file (struct node *node)
+{
+  uint8_t buf[64 * SECTOR_SIZE];
+  struct stat st;
+  uint32_t start, cnt, done;
+  int fd;
+
+  fd = open (node->host, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0)
+    fail ("%s: %s", node->host, strerror (errno));
+  if (st.st_size > INT32_MAX)
+    fail ("%s: file too large", node->host);
+
+  if (st.st_size <= INLINE_MAX)
+    {
+      /* Small enough to keep in the inode. */
+      if (read (fd, buf, st.st_size) != st.st_size)
+        fail ("%s: read failed", node->host);
+      write_inode (node->inumber, st.st_size, INODE_INLINE, 0, 0, buf);
+    }
+  else
+    {
+      cnt = (st.st_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+      start = allocate (cnt);
+      for (done = 0; done < cnt; )
+        {
+          ssize_t n = read (fd, buf, sizeof buf);
+          size_t sectors;
+
+          if (n <= 0)
+            fail ("%s: changed size while being read", node->host);
+          sectors = (n + SECTOR_SIZE - 1) / SECTOR_SIZE;
+          if (sectors > cnt - done)
+            fail ("%s: changed size while being read", node->host);
+          memset (buf + n, 0, sectors * SECTOR_SIZE - n);
+          write_image (buf, sectors * SECTOR_SIZE,
+                       (off_t) (start + done) * SECTOR_SIZE);
+          done += sectors;
+        }
+      write_inode (node->inumber, st.st_size, 0, start, cnt, NULL);
+    }
+  close (fd);
+}
+
+/* Writes directory DIR, then everything in it.  DIR's inode
+   number must already be assigned. */
+static void
+put_dir (struct node *dir)
+{
+  size_t bucket_cnt = 1;
+  uint8_t *buckets;
+  struct node *n;
+  uint32_t start;
+
+  /* Each entry needs an inode number first. */
+  for (n = dir->children; n != NULL; n = n->next)
+    n->inumber = allocate_inumber ();
+
+  /* Start with as many buckets as dir_create() would, then
+     double until no bucket overflows, as dir_add() would. */
+  while (bucket_cnt * BUCKET_ENTRIES < (dir->child_cnt > 16
+                                        ? dir->child_cnt : 16) + 2)
+    bucket_cnt *= 2;
+  for (;;)
+    {
+      bool ok;
+
+      buckets = xcalloc (bucket_cnt * SECTOR_SIZE);
+      ok = (add_entry (buckets, bucket_cnt, ".", dir->inumber)
+            && add_entry (buckets, bucket_cnt, "..", dir->parent->inumber));
+      for (n = dir->children; ok && n != NULL; n = n->next)
+        ok = add_entry (buckets, bucket_cnt, n->name, n->inumber);
+      if (ok)
+        break;
+      free (buckets);
+      bucket_cnt *= 2;
+      if (bucket_cnt > MAX_BUCKETS)
+        fail ("too many files in one directory");
+    }
+  start = allocate (bucket_cnt);
+  write_image (buckets, bucket_cnt * SECTOR_SIZE, (off_t) start * SECTOR_SIZE);
+  write_inode (dir->inumber, bucket_cnt * SECTOR_SIZE, INODE_DIR,
+               start, bucket_cnt, NULL);
+  free (buckets);
+
+  /* Files first, so that they sit next to the directory, then
+     subdirectories. */
+  for (n = dir->children; n != NULL; n = n->next)
+    if (!n->is_dir)
+      put_file (n);
+  for (n = dir->children; n != NULL; n = n->next)
+    if (n->is_dir)
+      put_dir (n);
+}
+
+/* Returns the entry named NAME in directory DIR, creating it if
+   CREATE is true and there is none.  Returns a null pointer if
+   there is none and CREATE is false. */
+static struct node *
+find_entry (struct node *dir, const char *name, bool create)
+{
+  struct node *n, **tail;
+
+  for (tail = &dir->children; (n = *tail) != NULL; tail = &n->next)
+    if (!strcmp (n->name, name))
+      return n;
+  if (!create)
+    return NULL;
+
+  n = xcalloc (sizeof *n);
+  strcpy (n->name, name);
+  n->parent = dir;
+  *tail = n;
+  dir->child_cnt++;
+  return n;
+}
+
+/* Adds host file HOST to the tree under ROOT as PATH, creating
+   directories along PATH as needed. */
+static void
+add_path (struct node *root, const char *host, const char *path)
+{
+  char *copy = strdup (path);
+  char *name, *save;
+  struct node *dir = root, *n = NULL;
+
+  if (copy == NULL)
+    fail ("out of memory");
+  for (name = strtok_r (copy, "/", &save); name != NULL; )
+    {
+      char *next = strtok_r (NULL, "/", &save);
+
+      if (strlen (name) > NAME_MAX)
+        fail ("%s: name too long (max %d characters per component)",
+              path, NAME_MAX);
+      if (!strcmp (name, ".") || !strcmp (name, ".."))
+        fail ("%s: invalid name", path);
+      n = find_entry (dir, name, true);
+      if (next != NULL)
+        {
+          /* Intermediate directory. */
+          if (n->host != NULL)
+            fail ("%s: %s is a file", path, name);
+          n->is_dir = true;
+          dir = n;
+        }
+      else if (n->host != NULL || n->is_dir)
+        fail ("%s: already exists", path);
+      else
+        n->host = host;
+      name = next;
+    }
+  if (n == NULL)
+    fail ("%s: invalid name", path);
+  free (copy);
+}
+
+/* Writes the free map file, whose inode is FREE_MAP_INODE.  Its
+   data sectors must already be allocated, starting at START. */
+static void
+put_free_map (uint32_t start)
+{
+  /* bitmap_file_size() rounds up to whole 32-bit words. */
+  uint32_t length = (sector_cnt + 31) / 32 * 4;
+  uint32_t cnt = (length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+  if (length <= INLINE_MAX)
+    write_inode (FREE_MAP_INODE, length, INODE_INLINE, 0, 0, used);
+  else
+    {
+      write_image (used, cnt * SECTOR_SIZE, (off_t) start * SECTOR_SIZE);
+      write_inode (FREE_MAP_INODE, length, 0, start, cnt, NULL);
+    }
+}
+
+/* Writes an empty journal. */
+static void
+put_journal (void)
+{
+  uint8_t header[SECTOR_SIZE];
+  uint32_t i;
+
+  memset (header, 0, sizeof header);
+  put32 (header + 0, JOURNAL_MAGIC);
+  put32 (header + 4, FIRST_SEQ);
+  write_image (header, sizeof header, (off_t) JOURNAL_SECTOR * SECTOR_SIZE);
+  zero_sector (JOURNAL_SECTOR + 1);
+  for (i = 0; i < JOURNAL_SECTORS; i++)
+    mark (JOURNAL_SECTOR + i);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "pintos-mkfs: builds a Pintos file system image\n"
+           "usage: pintos-mkfs [-s SIZE] IMAGE [FILE[=NAME]...]\n"
+           "  Formats IMAGE and copies each host FILE into it, as NAME\n"
+           "  if given, creating any directories that NAME names.\n"
+           "  -s SIZE   Create IMAGE, SIZE MB long; otherwise IMAGE\n"
+           "            must exist and its size is kept.\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct node root;
+  struct stat st;
+  uint32_t free_map_start = 0, free_map_bytes;
+  double size_mb = -1;
+  int opt, i;
+
+  while ((opt = getopt (argc, argv, "s:h")) != -1)
+    if (opt == 's')
+      {
+        char *end;
+        size_mb = strtod (optarg, &end);
+        if (*end != '\0' || size_mb <= 0)
+          fail ("%s: not a valid size in MB", optarg);
+      }
+    else
+      usage ();
+  if (optind >= argc)
+    usage ();
+
+  /* Collect the files to put. */
+  memset (&root, 0, sizeof root);
+  root.is_dir = true;
+  root.inumber = ROOT_DIR_INODE;
+  root.parent = &root;
+  for (i = optind + 1; i < argc; i++)
+    {
+      char *eq = strchr (argv[i], '=');
+      if (eq != NULL)
+        {
+          *eq = '\0';
+          add_path (&root, argv[i], eq + 1);
+        }
+      else
+        add_path (&root, argv[i], argv[i]);
+    }
+
+  /* Open the image. */
+  image_name = argv[optind];
+  image_fd = open (image_name, O_RDWR | (size_mb > 0 ? O_CREAT | O_TRUNC : 0),
+                   0666);
+  if (image_fd < 0)
+    fail ("%s: open: %s", image_name, strerror (errno));
+  if (size_mb > 0 && ftruncate (image_fd, (off_t) (size_mb * 1024 * 1024)) < 0)
+    fail ("%s: truncate: %s", image_name, strerror (errno));
+  if (fstat (image_fd, &st) < 0)
+    fail ("%s: stat: %s", image_name, strerror (errno));
+  sector_cnt = st.st_size / SECTOR_SIZE;
+  if (sector_cnt < JOURNAL_SECTOR + JOURNAL_SECTORS + 16)
+    fail ("%s: too small for a file system", image_name);
+
+  /* Format.  The free map needs room for whole sectors of bits,
+     since they are written a sector at a time. */
+  free_map_bytes = (sector_cnt + 31) / 32 * 4;
+  used = xcalloc ((free_map_bytes + SECTOR_SIZE - 1)
+                  / SECTOR_SIZE * SECTOR_SIZE);
+  zero_sector (SYSTEM_INODE_SECTOR);
+  mark (SYSTEM_INODE_SECTOR);
+  table_sector = SYSTEM_INODE_SECTOR;
+  table_slot = ROOT_DIR_INODE + 1;
+  next_sector = SYSTEM_INODE_SECTOR + 1;
+  put_journal ();
+  if (free_map_bytes > INLINE_MAX)
+    free_map_start = allocate ((free_map_bytes + SECTOR_SIZE - 1)
+                               / SECTOR_SIZE);
+
+  /* Fill in the files, then write the free map last, once every
+     sector it must mark is allocated. */
+  put_dir (&root);
+  put_free_map (free_map_start);
+
+  if (close (image_fd) < 0)
+    fail ("%s: close: %s", image_name, strerror (errno));
+  return EXIT_SUCCESS;
+}
@@ -133,10 +133,8 @@ bool allocate_file_page(struct page_entry* page) {
 
     if(page->read_bytes) {
       // read a page starting at the file offset
-      lock_acquire(&filesys_lock);
-      file_seek(page->file_ptr, page->file_offset);
-      int read_bytes = file_read(page->file_ptr, user_frame, page->read_bytes);
-      lock_release(&filesys_lock);
+      int read_bytes = file_read_at(page->file_ptr, user_frame,
+        page->read_bytes, page->file_offset);
 
       if(read_bytes != page->read_bytes) {
         // failed to read the bytes, so remove the page from the frame table
@@ -223,3 +221,71 @@ bool handle_faulted_page(uint8_t* fault_addr, uint32_t *esp) {
   }
   return false;
 }
+
+/*
+  bring every page of a user buffer into a frame and pin it there, so
+  that the kernel can read or write the buffer directly without faulting
+  and without the page being evicted underneath it.
+  Missing pages become stack pages if grow is set, otherwise the buffer
+  is invalid, and so is a read-only page if writable is set, and so is
+  any buffer that is not wholly below PHYS_BASE
+*/
+bool pin_user_buffer(void* buffer, unsigned size, bool writable, bool grow) {
+  struct thread* current_thread = thread_current();
+  uint8_t* user_page = pg_round_down(buffer);
+  uint8_t* buffer_end = (uint8_t*) buffer + size;
+
+  // a buffer that wraps past the top of memory would pin no pages at all
+  if(buffer == NULL || buffer_end < (uint8_t*) buffer ||
+    (size > 0 && !is_user_vaddr(buffer_end - 1))) {
+    return false;
+  }
+
+  for(; user_page < buffer_end; user_page += PGSIZE) {
+    struct page_entry* page = get_page_entry(user_page);
+    if(!page && grow && grow_stack(user_page)) {
+      page = get_page_entry(user_page);
+    }
+
+    bool pinned = page && (!writable || page->writable);
+    if(pinned) {
+      // load the page if needed, and retry if it gets evicted before pinning
+      lock_acquire(&page->pinning_lock);
+      while(pinned && !pagedir_get_page(current_thread->pagedir, user_page)) {
+        lock_release(&page->pinning_lock);
+        if(page->location == SWAP_SLOT) {
+          pinned = allocate_swap_page(page);
+        } else if(page->location == FILE_SYSTEM) {
+          pinned = allocate_file_page(page);
+        } else {
+          pinned = false;
+        }
+        if(pinned) {
+          lock_acquire(&page->pinning_lock);
+        }
+      }
+    }
+
+    if(!pinned) {
+      // unpin the pages pinned so far, since the buffer is invalid
+      unsigned pinned_size = 0;
+      if(user_page > (uint8_t*) buffer) {
+        pinned_size = user_page - (uint8_t*) buffer;
+      }
+      unpin_user_buffer(buffer, pinned_size);
+      return false;
+    }
+  }
+  return true;
+}
+
+// unpin the pages of a user buffer pinned by pin_user_buffer
+void unpin_user_buffer(void* buffer, unsigned size) {
+  uint8_t* user_page = pg_round_down(buffer);
+  uint8_t* buffer_end = (uint8_t*) buffer + size;
+
+  for(; user_page < buffer_end; user_page += PGSIZE) {
+    struct page_entry* page = get_page_entry(user_page);
+    lock_release(&page->pinning_lock);
+  }
+}
@@ -5,9 +5,6 @@
 #include "filesys/off_t.h"
 #include <hash.h>
 
-// Dinesh driving, use a lock to control access to the file system
-extern struct lock filesys_lock;
-
 // potential locations of a page
 #define MAIN_MEMORY 0
 #define FILE_SYSTEM 1
@@ -62,3 +59,5 @@ uint8_t* get_user_frame();
 bool allocate_file_page(struct page_entry* page);
 bool allocate_swap_page(struct page_entry* page);
 bool handle_faulted_page(uint8_t* fault_addr, uint32_t *esp);
+bool pin_user_buffer(void* buffer, unsigned size, bool writable, bool grow);
+void unpin_user_buffer(void* buffer, unsigned size);